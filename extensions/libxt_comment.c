@@ -34,7 +34,9 @@ comment_print(const void *ip, const struct xt_entry_match *match, int numeric)
 	struct xt_comment_info *commentinfo = (void *)match->data;
 
 	commentinfo->comment[XT_MAX_COMMENT_LEN-1] = '\0';
-	printf(" /* %s */", commentinfo->comment);
+	fputs(" /* ", stdout);
+	fputs(commentinfo->comment, stdout);
+	fputs(" */", stdout);
 }
 
 /* Saves the union ipt_matchinfo in parsable form to stdout. */
@@ -44,7 +46,7 @@ comment_save(const void *ip, const struct xt_entry_match *match)
 	struct xt_comment_info *commentinfo = (void *)match->data;
 
 	commentinfo->comment[XT_MAX_COMMENT_LEN-1] = '\0';
-	printf(" --comment");
+	fputs(" --comment", stdout);
 	xtables_save_string(commentinfo->comment);
 }
 
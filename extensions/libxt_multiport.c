@@ -272,9 +272,9 @@ print_port(uint16_t port, uint8_t protocol, int numeric)
 	const char *service;
 
 	if (numeric || (service = port_to_service(port, protocol)) == NULL)
-		printf("%u", port);
+		xtables_print_u64(port);
 	else
-		printf("%s", service);
+		fputs(service, stdout);
 }
 
 static void
@@ -306,7 +306,8 @@ __multiport_print(const struct xt_entry_match *match, int numeric,
 	}
 
 	for (i=0; i < multiinfo->count; i++) {
-		printf("%s", i ? "," : "");
+		if (i > 0)
+			putchar(',');
 		print_port(multiinfo->ports[i], proto, numeric);
 	}
 }
@@ -356,10 +357,11 @@ static void __multiport_print_v1(const struct xt_entry_match *match,
 		printf(" !");
 
 	for (i=0; i < multiinfo->count; i++) {
-		printf("%s", i ? "," : "");
+		if (i > 0)
+			putchar(',');
 		print_port(multiinfo->ports[i], proto, numeric);
 		if (multiinfo->pflags[i]) {
-			printf(":");
+			putchar(':');
 			print_port(multiinfo->ports[++i], proto, numeric);
 		}
 	}
@@ -401,7 +403,8 @@ static void __multiport_save(const struct xt_entry_match *match,
 	}
 
 	for (i=0; i < multiinfo->count; i++) {
-		printf("%s", i ? "," : "");
+		if (i > 0)
+			putchar(',');
 		print_port(multiinfo->ports[i], proto, 1);
 	}
 }
@@ -445,10 +448,11 @@ static void __multiport_save_v1(const struct xt_entry_match *match,
 	}
 
 	for (i=0; i < multiinfo->count; i++) {
-		printf("%s", i ? "," : "");
+		if (i > 0)
+			putchar(',');
 		print_port(multiinfo->ports[i], proto, 1);
 		if (multiinfo->pflags[i]) {
-			printf(":");
+			putchar(':');
 			print_port(multiinfo->ports[++i], proto, 1);
 		}
 	}
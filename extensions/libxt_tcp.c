@@ -220,9 +220,9 @@ print_port(uint16_t port, int numeric)
 	const char *service;
 
 	if (numeric || (service = port_to_service(port)) == NULL)
-		printf("%u", port);
+		xtables_print_u64(port);
 	else
-		printf("%s", service);
+		fputs(service, stdout);
 }
 
 static void
@@ -232,14 +232,17 @@ print_ports(const char *name, uint16_t min, uint16_t max,
 	const char *inv = invert ? "!" : "";
 
 	if (min != 0 || max != 0xFFFF || invert) {
-		printf(" %s", name);
+		putchar(' ');
+		fputs(name, stdout);
 		if (min == max) {
-			printf(":%s", inv);
+			putchar(':');
+			fputs(inv, stdout);
 			print_port(min, numeric);
 		} else {
-			printf("s:%s", inv);
+			fputs("s:", stdout);
+			fputs(inv, stdout);
 			print_port(min, numeric);
-			printf(":");
+			putchar(':');
 			print_port(max, numeric);
 		}
 	}
@@ -263,15 +266,15 @@ print_tcpf(uint8_t flags)
 		for (i = 0; (flags & tcp_flag_names[i].flag) == 0; i++);
 
 		if (have_flag)
-			printf(",");
-		printf("%s", tcp_flag_names[i].name);
+			putchar(',');
+		fputs(tcp_flag_names[i].name, stdout);
 		have_flag = 1;
 
 		flags &= ~tcp_flag_names[i].flag;
 	}
 
 	if (!have_flag)
-		printf("NONE");
+		fputs("NONE", stdout);
 }
 
 static void
@@ -294,7 +297,7 @@ tcp_print(const void *ip, const struct xt_entry_match *match, int numeric)
 {
 	const struct xt_tcp *tcp = (struct xt_tcp *)match->data;
 
-	printf(" tcp");
+	fputs(" tcp", stdout);
 	print_ports("spt", tcp->spts[0], tcp->spts[1],
 		    tcp->invflags & XT_TCP_INV_SRCPT,
 		    numeric);
@@ -319,29 +322,27 @@ static void tcp_save(const void *ip, const struct xt_entry_match *match)
 	if (tcpinfo->spts[0] != 0
 	    || tcpinfo->spts[1] != 0xFFFF) {
 		if (tcpinfo->invflags & XT_TCP_INV_SRCPT)
-			printf(" !");
+			fputs(" !", stdout);
+		fputs(" --sport ", stdout);
+		xtables_print_u64(tcpinfo->spts[0]);
 		if (tcpinfo->spts[0]
-		    != tcpinfo->spts[1])
-			printf(" --sport %u:%u",
-			       tcpinfo->spts[0],
-			       tcpinfo->spts[1]);
-		else
-			printf(" --sport %u",
-			       tcpinfo->spts[0]);
+		    != tcpinfo->spts[1]) {
+			putchar(':');
+			xtables_print_u64(tcpinfo->spts[1]);
+		}
 	}
 
 	if (tcpinfo->dpts[0] != 0
 	    || tcpinfo->dpts[1] != 0xFFFF) {
 		if (tcpinfo->invflags & XT_TCP_INV_DSTPT)
-			printf(" !");
+			fputs(" !", stdout);
+		fputs(" --dport ", stdout);
+		xtables_print_u64(tcpinfo->dpts[0]);
 		if (tcpinfo->dpts[0]
-		    != tcpinfo->dpts[1])
-			printf(" --dport %u:%u",
-			       tcpinfo->dpts[0],
-			       tcpinfo->dpts[1]);
-		else
-			printf(" --dport %u",
-			       tcpinfo->dpts[0]);
+		    != tcpinfo->dpts[1]) {
+			putchar(':');
+			xtables_print_u64(tcpinfo->dpts[1]);
+		}
 	}
 
 	if (tcpinfo->option
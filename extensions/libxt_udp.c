@@ -77,9 +77,9 @@ print_port(uint16_t port, int numeric)
 	const char *service;
 
 	if (numeric || (service = port_to_service(port)) == NULL)
-		printf("%u", port);
+		xtables_print_u64(port);
 	else
-		printf("%s", service);
+		fputs(service, stdout);
 }
 
 static void
@@ -89,14 +89,17 @@ print_ports(const char *name, uint16_t min, uint16_t max,
 	const char *inv = invert ? "!" : "";
 
 	if (min != 0 || max != 0xFFFF || invert) {
-		printf(" %s", name);
+		putchar(' ');
+		fputs(name, stdout);
 		if (min == max) {
-			printf(":%s", inv);
+			putchar(':');
+			fputs(inv, stdout);
 			print_port(min, numeric);
 		} else {
-			printf("s:%s", inv);
+			fputs("s:", stdout);
+			fputs(inv, stdout);
 			print_port(min, numeric);
-			printf(":");
+			putchar(':');
 			print_port(max, numeric);
 		}
 	}
@@ -107,7 +110,7 @@ udp_print(const void *ip, const struct xt_entry_match *match, int numeric)
 {
 	const struct xt_udp *udp = (struct xt_udp *)match->data;
 
-	printf(" udp");
+	fputs(" udp", stdout);
 	print_ports("spt", udp->spts[0], udp->spts[1],
 		    udp->invflags & XT_UDP_INV_SRCPT,
 		    numeric);
@@ -126,29 +129,27 @@ static void udp_save(const void *ip, const struct xt_entry_match *match)
 	if (udpinfo->spts[0] != 0
 	    || udpinfo->spts[1] != 0xFFFF) {
 		if (udpinfo->invflags & XT_UDP_INV_SRCPT)
-			printf(" !");
+			fputs(" !", stdout);
+		fputs(" --sport ", stdout);
+		xtables_print_u64(udpinfo->spts[0]);
 		if (udpinfo->spts[0]
-		    != udpinfo->spts[1])
-			printf(" --sport %u:%u",
-			       udpinfo->spts[0],
-			       udpinfo->spts[1]);
-		else
-			printf(" --sport %u",
-			       udpinfo->spts[0]);
+		    != udpinfo->spts[1]) {
+			putchar(':');
+			xtables_print_u64(udpinfo->spts[1]);
+		}
 	}
 
 	if (udpinfo->dpts[0] != 0
 	    || udpinfo->dpts[1] != 0xFFFF) {
 		if (udpinfo->invflags & XT_UDP_INV_DSTPT)
-			printf(" !");
+			fputs(" !", stdout);
+		fputs(" --dport ", stdout);
+		xtables_print_u64(udpinfo->dpts[0]);
 		if (udpinfo->dpts[0]
-		    != udpinfo->dpts[1])
-			printf(" --dport %u:%u",
-			       udpinfo->dpts[0],
-			       udpinfo->dpts[1]);
-		else
-			printf(" --dport %u",
-			       udpinfo->dpts[0]);
+		    != udpinfo->dpts[1]) {
+			putchar(':');
+			xtables_print_u64(udpinfo->dpts[1]);
+		}
 	}
 }
 
@@ -9,6 +9,8 @@
 /* Your shared library should call one of these. */
 extern int do_command6(int argc, char *argv[], char **table,
 		       struct xtc_handle **handle, bool restore);
+extern int do_command6_fast(int argc, char *argv[],
+			    struct xtc_handle *handle);
 
 extern int for_each_chain6(int (*fn)(const xt_chainlabel, int, struct xtc_handle *), int verbose, int builtinstoo, struct xtc_handle *handle);
 extern int flush_entries6(const xt_chainlabel chain, int verbose, struct xtc_handle *handle);
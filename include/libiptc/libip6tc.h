@@ -3,6 +3,7 @@
 /* Library which manipulates firewall rules. Version 0.2. */
 
 #include <linux/types.h>
+#include <stddef.h>
 #include <libiptc/ipt_kernel_headers.h>
 #ifdef __cplusplus
 #	include <climits>
@@ -75,6 +76,32 @@ int ip6tc_append_entry(const xt_chainlabel chain,
 		       const struct ip6t_entry *e,
 		       struct xtc_handle *handle);
 
+/* Insert a copy of `e' with each source x destination address pair into
+   position `rulenum', as ip6tc_insert_entry() called for each pair in
+   turn would.  All or nothing. */
+int ip6tc_insert_entries(const xt_chainlabel chain,
+			 const struct ip6t_entry *e,
+			 unsigned int rulenum,
+			 unsigned int nsaddrs,
+			 const struct in6_addr saddrs[],
+			 const struct in6_addr smasks[],
+			 unsigned int ndaddrs,
+			 const struct in6_addr daddrs[],
+			 const struct in6_addr dmasks[],
+			 struct xtc_handle *handle);
+
+/* Append a copy of `e' with each source x destination address pair to
+   chain `chain', sources varying slowest.  All or nothing. */
+int ip6tc_append_entries(const xt_chainlabel chain,
+			 const struct ip6t_entry *e,
+			 unsigned int nsaddrs,
+			 const struct in6_addr saddrs[],
+			 const struct in6_addr smasks[],
+			 unsigned int ndaddrs,
+			 const struct in6_addr daddrs[],
+			 const struct in6_addr dmasks[],
+			 struct xtc_handle *handle);
+
 /* Check whether a matching rule exists */
 int ip6tc_check_entry(const xt_chainlabel chain,
 		       const struct ip6t_entry *origfw,
@@ -151,6 +178,17 @@ int ip6tc_commit(struct xtc_handle *handle);
 /* Get raw socket. */
 int ip6tc_get_raw_socket(void);
 
+/* Write the table as read from the kernel to `fd' in binary form.
+   The handle must not have been modified. */
+int ip6tc_save_blob(struct xtc_handle *handle, int fd);
+
+/* Replace the table saved at the start of `data' by ip6tc_save_blob().
+   `data' is modified in place.  Tables other than `tablename' (unless
+   NULL) are only validated, as are all of them when `testing'.  Returns
+   the number of bytes consumed, or 0 and sets errno. */
+size_t ip6tc_restore_blob(void *data, size_t len, const char *tablename,
+			 int counters, int testing);
+
 /* Translates errno numbers into more human-readable form than strerror. */
 const char *ip6tc_strerror(int err);
 
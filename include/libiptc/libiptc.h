@@ -3,6 +3,7 @@
 /* Library which manipulates filtering rules. */
 
 #include <linux/types.h>
+#include <stddef.h>
 #include <libiptc/ipt_kernel_headers.h>
 #ifdef __cplusplus
 #	include <climits>
@@ -79,6 +80,32 @@ int iptc_append_entry(const xt_chainlabel chain,
 		      const struct ipt_entry *e,
 		      struct xtc_handle *handle);
 
+/* Insert a copy of `e' with each source x destination address pair into
+   position `rulenum', as iptc_insert_entry() called for each pair in
+   turn would.  All or nothing. */
+int iptc_insert_entries(const xt_chainlabel chain,
+			const struct ipt_entry *e,
+			unsigned int rulenum,
+			unsigned int nsaddrs,
+			const struct in_addr saddrs[],
+			const struct in_addr smasks[],
+			unsigned int ndaddrs,
+			const struct in_addr daddrs[],
+			const struct in_addr dmasks[],
+			struct xtc_handle *handle);
+
+/* Append a copy of `e' with each source x destination address pair to
+   chain `chain', sources varying slowest.  All or nothing. */
+int iptc_append_entries(const xt_chainlabel chain,
+			const struct ipt_entry *e,
+			unsigned int nsaddrs,
+			const struct in_addr saddrs[],
+			const struct in_addr smasks[],
+			unsigned int ndaddrs,
+			const struct in_addr daddrs[],
+			const struct in_addr dmasks[],
+			struct xtc_handle *handle);
+
 /* Check whether a mathching rule exists */
 int iptc_check_entry(const xt_chainlabel chain,
 		      const struct ipt_entry *origfw,
@@ -157,6 +184,17 @@ int iptc_commit(struct xtc_handle *handle);
 /* Get raw socket. */
 int iptc_get_raw_socket(void);
 
+/* Write the table as read from the kernel to `fd' in binary form.
+   The handle must not have been modified. */
+int iptc_save_blob(struct xtc_handle *handle, int fd);
+
+/* Replace the table saved at the start of `data' by iptc_save_blob().
+   `data' is modified in place.  Tables other than `tablename' (unless
+   NULL) are only validated, as are all of them when `testing'.  Returns
+   the number of bytes consumed, or 0 and sets errno. */
+size_t iptc_restore_blob(void *data, size_t len, const char *tablename,
+			int counters, int testing);
+
 /* Translates errno numbers into more human-readable form than strerror. */
 const char *iptc_strerror(int err);
 
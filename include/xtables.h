@@ -481,6 +481,8 @@ extern void xtables_ip6parse_any(const char *, struct in6_addr **,
 	struct in6_addr *, unsigned int *);
 extern void xtables_ip6parse_multiple(const char *, struct in6_addr **,
 	struct in6_addr **, unsigned int *);
+extern void xtables_host_prefetch(const char *const *, unsigned int, int);
+extern void xtables_addr_prefetch(const void *, unsigned int, int);
 
 /**
  * Print the specified value to standard output, quoting dangerous
@@ -504,6 +506,18 @@ extern void xtables_save_string(const char *value);
 
 extern void xtables_print_num(uint64_t number, unsigned int format);
 
+/**
+ * Print @number in decimal to standard output.  Cheaper than printf("%llu")
+ * for the counters, ports and marks that make up most of a ruleset dump.
+ */
+extern void xtables_print_u64(uint64_t number);
+
+/**
+ * Print @value to standard output, padded with spaces on the right to at
+ * least @width columns, like printf("%-*s").
+ */
+extern void xtables_print_field(const char *value, unsigned int width);
+
 #if defined(ALL_INCLUSIVE) || defined(NO_SHARED_LIBS)
 #	ifdef _INIT
 #		undef _init
@@ -13,14 +13,16 @@
 #include <string.h>
 #include <time.h>
 #include <netdb.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 #include "libiptc/libip6tc.h"
 #include "ip6tables.h"
 #include "ip6tables-multi.h"
 
-static int show_counters = 0;
+static int show_counters = 0, binary = 0;
 
 static const struct option options[] = {
+	{.name = "binary",   .has_arg = false, .val = 'b'},
 	{.name = "counters", .has_arg = false, .val = 'c'},
 	{.name = "dump",     .has_arg = false, .val = 'd'},
 	{.name = "table",    .has_arg = true,  .val = 't'},
@@ -71,6 +73,14 @@ static int do_output(const char *tablename)
 		xtables_error(OTHER_PROBLEM, "Cannot initialize: %s\n",
 			   ip6tc_strerror(errno));
 
+	if (binary) {
+		if (!ip6tc_save_blob(h, STDOUT_FILENO))
+			xtables_error(OTHER_PROBLEM, "Cannot save table `%s': %s\n",
+				   tablename, ip6tc_strerror(errno));
+		ip6tc_free(h);
+		return 1;
+	}
+
 	time_t now = time(NULL);
 
 	printf("# Generated by ip6tables-save v%s on %s",
@@ -83,14 +93,19 @@ static int do_output(const char *tablename)
 	     chain;
 	     chain = ip6tc_next_chain(h)) {
 
-		printf(":%s ", chain);
+		putchar(':');
+		fputs(chain, stdout);
+		putchar(' ');
 		if (ip6tc_builtin(chain, h)) {
 			struct xt_counters count;
-			printf("%s ",
-			       ip6tc_get_policy(chain, &count, h));
-			printf("[%llu:%llu]\n", (unsigned long long)count.pcnt, (unsigned long long)count.bcnt);
+			fputs(ip6tc_get_policy(chain, &count, h), stdout);
+			fputs(" [", stdout);
+			xtables_print_u64(count.pcnt);
+			putchar(':');
+			xtables_print_u64(count.bcnt);
+			fputs("]\n", stdout);
 		} else {
-			printf("- [0:0]\n");
+			fputs("- [0:0]\n", stdout);
 		}
 	}
 
@@ -140,7 +155,7 @@ int ip6tables_save_main(int argc, char *argv[])
 	while ((c = getopt_long(argc, argv, "bcdt:M:", options, NULL)) != -1) {
 		switch (c) {
 		case 'b':
-			fprintf(stderr, "-b/--binary option is not implemented\n");
+			binary = 1;
 			break;
 		case 'c':
 			show_counters = 1;
@@ -34,7 +34,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
 #include <ip6tables.h>
+#include "xshared.h"
 #include "ip6tables-multi.h"
 
 int
@@ -58,6 +60,9 @@ ip6tables_main(int argc, char *argv[])
 	init_extensions6();
 #endif
 
+	if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+		exit(xs_batch_main(argc - 1, argv + 1, &ip6tc_ops, do_command6));
+
 	ret = do_command6(argc, argv, &table, &handle, false);
 	if (ret) {
 		ret = ip6tc_commit(handle);
@@ -102,7 +102,7 @@ static struct option original_opts[] = {
 	{.name = "numeric",       .has_arg = 0, .val = 'n'},
 	{.name = "out-interface", .has_arg = 1, .val = 'o'},
 	{.name = "verbose",       .has_arg = 0, .val = 'v'},
-	{.name = "wait",          .has_arg = 0, .val = 'w'},
+	{.name = "wait",          .has_arg = 2, .val = 'w'},
 	{.name = "exact",         .has_arg = 0, .val = 'x'},
 	{.name = "version",       .has_arg = 0, .val = 'V'},
 	{.name = "help",          .has_arg = 2, .val = 'h'},
@@ -235,6 +235,7 @@ exit_printhelp(const struct xtables_rule_match *matches)
 "  --rename-chain\n"
 "            -E old-chain new-chain\n"
 "				Change chain name, (moving any references)\n"
+"  --batch [-w] [file]		Run the command lines in file (default: stdin)\n"
 
 "Options:\n"
 "    --ipv4	-4		Error (line is ignored by ip6tables-restore)\n"
@@ -259,7 +260,7 @@ exit_printhelp(const struct xtables_rule_match *matches)
 "				network interface name ([+] for wildcard)\n"
 "  --table	-t table	table to manipulate (default: `filter')\n"
 "  --verbose	-v		verbose mode\n"
-"  --wait	-w		wait for the xtables lock\n"
+"  --wait	-w [seconds]	wait for the xtables lock\n"
 "  --line-numbers		print line numbers when listing\n"
 "  --exact	-x		expand numbers (display exact values)\n"
 /*"[!] --fragment	-f		match second or further fragments only\n"*/
@@ -548,24 +549,39 @@ print_firewall(const struct ip6t_entry *fw,
 
 	t = ip6t_get_target((struct ip6t_entry *)fw);
 
-	if (format & FMT_LINENUMBERS)
-		printf(FMT("%-4u ", "%u "), num);
+	if (format & FMT_LINENUMBERS) {
+		char *p = buf + sizeof(buf) - 1;
+
+		*p = '\0';
+		do {
+			*--p = '0' + num % 10;
+			num /= 10;
+		} while (num != 0);
+		xtables_print_field(p, FMT(4, 0));
+		fputc(' ', stdout);
+	}
 
 	if (!(format & FMT_NOCOUNTS)) {
 		xtables_print_num(fw->counters.pcnt, format);
 		xtables_print_num(fw->counters.bcnt, format);
 	}
 
-	if (!(format & FMT_NOTARGET))
-		printf(FMT("%-9s ", "%s "), targname);
+	if (!(format & FMT_NOTARGET)) {
+		xtables_print_field(targname, FMT(9, 0));
+		fputc(' ', stdout);
+	}
 
 	fputc(fw->ipv6.invflags & XT_INV_PROTO ? '!' : ' ', stdout);
 	{
 		const char *pname = proto_to_name(fw->ipv6.proto, format&FMT_NUMERIC);
 		if (pname)
-			printf(FMT("%-5s", "%s "), pname);
+			xtables_print_field(pname, FMT(5, 0));
+		else if (format & FMT_NOTABLE)
+			xtables_print_u64(fw->ipv6.proto);
 		else
-			printf(FMT("%-5hu", "%hu "), fw->ipv6.proto);
+			printf("%-5hu", fw->ipv6.proto);
+		if (format & FMT_NOTABLE)
+			fputc(' ', stdout);
 	}
 
 	if (format & FMT_OPTIONS) {
@@ -590,7 +606,9 @@ print_firewall(const struct ip6t_entry *fw,
 		}
 		else if (format & FMT_NUMERIC) strcat(iface, "*");
 		else strcat(iface, "any");
-		printf(FMT(" %-6s ","in %s "), iface);
+		fputs(FMT(" ", "in "), stdout);
+		xtables_print_field(iface, FMT(6, 0));
+		fputc(' ', stdout);
 
 		if (fw->ipv6.invflags & IP6T_INV_VIA_OUT) {
 			iface[0] = '!';
@@ -603,34 +621,42 @@ print_firewall(const struct ip6t_entry *fw,
 		}
 		else if (format & FMT_NUMERIC) strcat(iface, "*");
 		else strcat(iface, "any");
-		printf(FMT("%-6s ","out %s "), iface);
+		if (format & FMT_NOTABLE)
+			fputs("out ", stdout);
+		xtables_print_field(iface, FMT(6, 0));
+		fputc(' ', stdout);
 	}
 
 	fputc(fw->ipv6.invflags & IP6T_INV_SRCIP ? '!' : ' ', stdout);
 	if (!memcmp(&fw->ipv6.smsk, &in6addr_any, sizeof in6addr_any)
 	    && !(format & FMT_NUMERIC))
-		printf(FMT("%-19s ","%s "), "anywhere");
+		xtables_print_field("anywhere", FMT(19, 0));
 	else {
 		if (format & FMT_NUMERIC)
 			strcpy(buf, xtables_ip6addr_to_numeric(&fw->ipv6.src));
 		else
 			strcpy(buf, xtables_ip6addr_to_anyname(&fw->ipv6.src));
 		strcat(buf, xtables_ip6mask_to_numeric(&fw->ipv6.smsk));
-		printf(FMT("%-19s ","%s "), buf);
+		xtables_print_field(buf, FMT(19, 0));
 	}
+	fputc(' ', stdout);
 
 	fputc(fw->ipv6.invflags & IP6T_INV_DSTIP ? '!' : ' ', stdout);
+	if (format & FMT_NOTABLE)
+		fputs("-> ", stdout);
 	if (!memcmp(&fw->ipv6.dmsk, &in6addr_any, sizeof in6addr_any)
 	    && !(format & FMT_NUMERIC))
-		printf(FMT("%-19s ","-> %s"), "anywhere");
+		xtables_print_field("anywhere", FMT(19, 0));
 	else {
 		if (format & FMT_NUMERIC)
 			strcpy(buf, xtables_ip6addr_to_numeric(&fw->ipv6.dst));
 		else
 			strcpy(buf, xtables_ip6addr_to_anyname(&fw->ipv6.dst));
 		strcat(buf, xtables_ip6mask_to_numeric(&fw->ipv6.dmsk));
-		printf(FMT("%-19s ","-> %s"), buf);
+		xtables_print_field(buf, FMT(19, 0));
 	}
+	if (!(format & FMT_NOTABLE))
+		fputc(' ', stdout);
 
 	if (format & FMT_NOTABLE)
 		fputs("  ", stdout);
@@ -664,6 +690,30 @@ print_firewall_line(const struct ip6t_entry *fw,
 	print_firewall(fw, t->u.user.name, 0, FMT_PRINT_RULE, h);
 }
 
+/* Print the rules an append or insert of `fw' is about to add */
+static void
+print_entries(struct ip6t_entry *fw,
+	      unsigned int nsaddrs,
+	      const struct in6_addr saddrs[],
+	      const struct in6_addr smasks[],
+	      unsigned int ndaddrs,
+	      const struct in6_addr daddrs[],
+	      const struct in6_addr dmasks[],
+	      struct xtc_handle *handle)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < nsaddrs; i++) {
+		fw->ipv6.src = saddrs[i];
+		fw->ipv6.smsk = smasks[i];
+		for (j = 0; j < ndaddrs; j++) {
+			fw->ipv6.dst = daddrs[j];
+			fw->ipv6.dmsk = dmasks[j];
+			print_firewall_line(fw, handle);
+		}
+	}
+}
+
 static int
 append_entry(const xt_chainlabel chain,
 	     struct ip6t_entry *fw,
@@ -676,22 +726,12 @@ append_entry(const xt_chainlabel chain,
 	     int verbose,
 	     struct xtc_handle *handle)
 {
-	unsigned int i, j;
-	int ret = 1;
-
-	for (i = 0; i < nsaddrs; i++) {
-		fw->ipv6.src = saddrs[i];
-		fw->ipv6.smsk = smasks[i];
-		for (j = 0; j < ndaddrs; j++) {
-			fw->ipv6.dst = daddrs[j];
-			fw->ipv6.dmsk = dmasks[j];
-			if (verbose)
-				print_firewall_line(fw, handle);
-			ret &= ip6tc_append_entry(chain, fw, handle);
-		}
-	}
+	if (verbose)
+		print_entries(fw, nsaddrs, saddrs, smasks,
+			      ndaddrs, daddrs, dmasks, handle);
 
-	return ret;
+	return ip6tc_append_entries(chain, fw, nsaddrs, saddrs, smasks,
+				    ndaddrs, daddrs, dmasks, handle);
 }
 
 static int
@@ -726,22 +766,13 @@ insert_entry(const xt_chainlabel chain,
 	     int verbose,
 	     struct xtc_handle *handle)
 {
-	unsigned int i, j;
-	int ret = 1;
-
-	for (i = 0; i < nsaddrs; i++) {
-		fw->ipv6.src = saddrs[i];
-		fw->ipv6.smsk = smasks[i];
-		for (j = 0; j < ndaddrs; j++) {
-			fw->ipv6.dst = daddrs[j];
-			fw->ipv6.dmsk = dmasks[j];
-			if (verbose)
-				print_firewall_line(fw, handle);
-			ret &= ip6tc_insert_entry(chain, fw, rulenum, handle);
-		}
-	}
+	if (verbose)
+		print_entries(fw, nsaddrs, saddrs, smasks,
+			      ndaddrs, daddrs, dmasks, handle);
 
-	return ret;
+	return ip6tc_insert_entries(chain, fw, rulenum,
+				    nsaddrs, saddrs, smasks,
+				    ndaddrs, daddrs, dmasks, handle);
 }
 
 static unsigned char *
@@ -915,6 +946,45 @@ delete_chain6(const xt_chainlabel chain, int verbose,
 	return ip6tc_delete_chain(chain, handle);
 }
 
+/* Look up the names of all addresses a listing is going to show at once,
+ * instead of one rule at a time while printing */
+static void
+prefetch_names(const xt_chainlabel chain, int rulenum,
+	       struct xtc_handle *handle)
+{
+	const struct ip6t_entry *e;
+	struct in6_addr *addrs = NULL;
+	unsigned int n = 0, alloc = 0;
+	const char *this;
+	int num;
+
+	for (this = ip6tc_first_chain(handle);
+	     this;
+	     this = ip6tc_next_chain(handle)) {
+		if (chain && strcmp(chain, this) != 0)
+			continue;
+
+		num = 0;
+		for (e = ip6tc_first_rule(this, handle); e;
+		     e = ip6tc_next_rule(e, handle)) {
+			if (rulenum && ++num != rulenum)
+				continue;
+			if (n + 2 > alloc) {
+				alloc = alloc ? alloc * 2 : 64;
+				addrs = xtables_realloc(addrs,
+						alloc * sizeof(*addrs));
+			}
+			if (memcmp(&e->ipv6.smsk, &in6addr_any, sizeof(in6addr_any)) != 0)
+				addrs[n++] = e->ipv6.src;
+			if (memcmp(&e->ipv6.dmsk, &in6addr_any, sizeof(in6addr_any)) != 0)
+				addrs[n++] = e->ipv6.dst;
+		}
+	}
+
+	xtables_addr_prefetch(addrs, n, AF_INET6);
+	free(addrs);
+}
+
 static int
 list_entries(const xt_chainlabel chain, int rulenum, int verbose, int numeric,
 	     int expanded, int linenumbers, struct xtc_handle *handle)
@@ -938,6 +1008,9 @@ list_entries(const xt_chainlabel chain, int rulenum, int verbose, int numeric,
 	if (linenumbers)
 		format |= FMT_LINENUMBERS;
 
+	if (!numeric)
+		prefetch_names(chain, rulenum, handle);
+
 	for (this = ip6tc_first_chain(handle);
 	     this;
 	     this = ip6tc_next_chain(handle)) {
@@ -981,17 +1054,22 @@ print_iface(char letter, const char *iface, const unsigned char *mask,
 	if (mask[0] == 0)
 		return;
 
-	printf("%s -%c ", invert ? " !" : "", letter);
+	if (invert)
+		fputs(" !", stdout);
+	putchar(' ');
+	putchar('-');
+	putchar(letter);
+	putchar(' ');
 
 	for (i = 0; i < IFNAMSIZ; i++) {
 		if (mask[i] != 0) {
 			if (iface[i] != '\0')
-				printf("%c", iface[i]);
+				putchar(iface[i]);
 		} else {
 			/* we can access iface[i-1] here, because
 			 * a few lines above we make sure that mask[0] != 0 */
 			if (iface[i-1] != '\0')
-				printf("+");
+				putchar('+');
 			break;
 		}
 	}
@@ -1001,24 +1079,14 @@ print_iface(char letter, const char *iface, const unsigned char *mask,
 static void print_proto(uint16_t proto, int invert)
 {
 	if (proto) {
-		unsigned int i;
-		const char *invertstr = invert ? " !" : "";
-
-		const struct protoent *pent = getprotobynumber(proto);
-		if (pent) {
-			printf("%s -p %s",
-			       invertstr, pent->p_name);
-			return;
-		}
+		const char *pname = proto <= UINT8_MAX ?
+				    proto_to_name(proto, 0) : NULL;
 
-		for (i = 0; xtables_chain_protos[i].name != NULL; ++i)
-			if (xtables_chain_protos[i].num == proto) {
-				printf("%s -p %s",
-				       invertstr, xtables_chain_protos[i].name);
-				return;
-			}
-
-		printf("%s -p %u", invertstr, proto);
+		fputs(invert ? " ! -p " : " -p ", stdout);
+		if (pname != NULL)
+			fputs(pname, stdout);
+		else
+			xtables_print_u64(proto);
 	}
 }
 
@@ -1029,8 +1097,8 @@ static int print_match_save(const struct xt_entry_match *e,
 		xtables_find_match(e->u.user.name, XTF_TRY_LOAD, NULL);
 
 	if (match) {
-		printf(" -m %s",
-			match->alias ? match->alias(e) : e->u.user.name);
+		fputs(" -m ", stdout);
+		fputs(match->alias ? match->alias(e) : e->u.user.name, stdout);
 
 		/* some matches don't provide a save function */
 		if (match->save)
@@ -1056,15 +1124,18 @@ static void print_ip(const char *prefix, const struct in6_addr *ip,
 	if (l == 0 && !invert)
 		return;
 
-	printf("%s %s %s",
-		invert ? " !" : "",
-		prefix,
-		inet_ntop(AF_INET6, ip, buf, sizeof buf));
+	if (invert)
+		fputs(" !", stdout);
+	putchar(' ');
+	fputs(prefix, stdout);
+	putchar(' ');
+	fputs(inet_ntop(AF_INET6, ip, buf, sizeof buf), stdout);
 
+	putchar('/');
 	if (l == -1)
-		printf("/%s", inet_ntop(AF_INET6, mask, buf, sizeof buf));
+		fputs(inet_ntop(AF_INET6, mask, buf, sizeof buf), stdout);
 	else
-		printf("/%d", l);
+		xtables_print_u64(l);
 }
 
 /* We want this to be readable, so only print out neccessary fields.
@@ -1076,11 +1147,17 @@ void print_rule6(const struct ip6t_entry *e,
 	const char *target_name;
 
 	/* print counters for iptables-save */
-	if (counters > 0)
-		printf("[%llu:%llu] ", (unsigned long long)e->counters.pcnt, (unsigned long long)e->counters.bcnt);
+	if (counters > 0) {
+		putchar('[');
+		xtables_print_u64(e->counters.pcnt);
+		putchar(':');
+		xtables_print_u64(e->counters.bcnt);
+		fputs("] ", stdout);
+	}
 
 	/* print chain name */
-	printf("-A %s", chain);
+	fputs("-A ", stdout);
+	fputs(chain, stdout);
 
 	/* Print IP part. */
 	print_ip("-s", &(e->ipv6.src), &(e->ipv6.smsk),
@@ -1116,8 +1193,12 @@ void print_rule6(const struct ip6t_entry *e,
 	}
 
 	/* print counters for iptables -R */
-	if (counters < 0)
-		printf(" -c %llu %llu", (unsigned long long)e->counters.pcnt, (unsigned long long)e->counters.bcnt);
+	if (counters < 0) {
+		fputs(" -c ", stdout);
+		xtables_print_u64(e->counters.pcnt);
+		putchar(' ');
+		xtables_print_u64(e->counters.bcnt);
+	}
 
 	/* Print target name and targinfo part */
 	target_name = ip6tc_get_target(e, h);
@@ -1132,7 +1213,8 @@ void print_rule6(const struct ip6t_entry *e,
 			exit(1);
 		}
 
-		printf(" -j %s", target->alias ? target->alias(t) : target_name);
+		fputs(" -j ", stdout);
+		fputs(target->alias ? target->alias(t) : target_name, stdout);
 		if (target->save)
 			target->save(&e->ipv6, t);
 		else {
@@ -1148,13 +1230,16 @@ void print_rule6(const struct ip6t_entry *e,
 			}
 		}
 	} else if (target_name && (*target_name != '\0'))
+	{
 #ifdef IP6T_F_GOTO
-		printf(" -%c %s", e->ipv6.flags & IP6T_F_GOTO ? 'g' : 'j', target_name);
+		fputs(e->ipv6.flags & IP6T_F_GOTO ? " -g " : " -j ", stdout);
 #else
-		printf(" -j %s", target_name);
+		fputs(" -j ", stdout);
 #endif
+		fputs(target_name, stdout);
+	}
 
-	printf("\n");
+	putchar('\n');
 }
 
 static int
@@ -1323,7 +1408,7 @@ int do_command6(int argc, char *argv[], char **table,
 	struct in6_addr *smasks = NULL, *dmasks = NULL;
 
 	int verbose = 0;
-	bool wait = false;
+	int wait = 0;
 	const char *chain = NULL;
 	const char *shostnetworkmask = NULL, *dhostnetworkmask = NULL;
 	const char *policy = NULL, *newname = NULL;
@@ -1359,7 +1444,7 @@ int do_command6(int argc, char *argv[], char **table,
 
 	opts = xt_params->orig_opts;
 	while ((cs.c = getopt_long(argc, argv,
-	   "-:A:C:D:R:I:L::S::M:F::Z::N:X::E:P:Vh::o:p:s:d:j:i:bvwnt:m:xc:g:46",
+	   "-:A:C:D:R:I:L::S::M:F::Z::N:X::E:P:Vh::o:p:s:d:j:i:bvw::nt:m:xc:g:46",
 					   opts, NULL)) != -1) {
 		switch (cs.c) {
 			/*
@@ -1603,7 +1688,7 @@ int do_command6(int argc, char *argv[], char **table,
 					      "You cannot use `-w' from "
 					      "ip6tables-restore");
 			}
-			wait = true;
+			wait = xs_parse_wait(argc, argv);
 			break;
 
 		case 'm':
@@ -1753,12 +1838,8 @@ int do_command6(int argc, char *argv[], char **table,
 	generic_opt_check(command, cs.options);
 
 	/* Attempt to acquire the xtables lock */
-	if (!restore && !xtables_lock(wait)) {
-		fprintf(stderr, "Another app is currently holding the xtables lock. "
-			"Perhaps you want to use the -w option?\n");
-		xtables_free_opts(1);
-		exit(RESOURCE_PROBLEM);
-	}
+	if (!restore && !xtables_lock(wait, verbose > 1))
+		xs_lock_failed(wait);
 
 	/* only allocate handle if we weren't called with a handle */
 	if (!*handle)
@@ -1955,3 +2036,489 @@ int do_command6(int argc, char *argv[], char **table,
 
 	return ret;
 }
+
+/* Long (--name) or short (-c) spelling of a base option */
+static bool fast_is_opt(const char *arg, char c, const char *name)
+{
+	if (arg[0] != '-')
+		return false;
+	if (arg[1] == '-')
+		return strcmp(arg + 2, name) == 0;
+	return arg[1] == c && arg[2] == '\0';
+}
+
+static bool fast_is_base_opt(const char *name)
+{
+	const struct option *o;
+
+	for (o = ip6tables_globals.orig_opts; o->name != NULL; ++o)
+		if (strcmp(o->name, name) == 0)
+			return true;
+	return false;
+}
+
+/*
+ * Look `name' up in the options an extension would have merged, and
+ * return its code before the option offset and whether it takes an
+ * argument.
+ */
+static bool fast_find_ext_opt(const struct xt_option_entry *entry,
+			      const struct option *opt, const char *name,
+			      int *c, int *has_arg)
+{
+	if (entry != NULL) {
+		for (; entry->name != NULL; ++entry) {
+			if (strcmp(entry->name, name) != 0)
+				continue;
+			*c = entry->id;
+			*has_arg = entry->type == XTTYPE_NONE ?
+				   no_argument : required_argument;
+			return true;
+		}
+		return false;
+	}
+	for (; opt != NULL && opt->name != NULL; ++opt) {
+		if (strcmp(opt->name, name) != 0)
+			continue;
+		*c = opt->val;
+		*has_arg = opt->has_arg;
+		return true;
+	}
+	return false;
+}
+
+/* A rule line has at most 255 words, each match takes two or more */
+#define FAST_MAX_MATCHES	128
+
+/* A match of the rule built by do_command6_fast() */
+struct fast_match {
+	struct xtables_match *match;		/* for its options */
+	const struct xt_entry_match *blob;	/* reused from the parse cache */
+	int start, end, win;			/* words used, words it may use */
+	uint32_t ctx;
+	bool completed, cacheable;
+};
+
+/* What extension parsers see of the entry, part of the parse cache key */
+#define FAST_CTX(fw) ((fw).ipv6.proto | \
+		      ((fw).ipv6.flags & ~IP6T_F_GOTO) << 16 | \
+		      ((fw).ipv6.invflags & XT_INV_PROTO) << 24)
+
+/* Whether an option in a cached fragment might belong to another extension */
+static bool fast_clash(char **argv, int start, int end,
+		       const struct fast_match *fm, unsigned int nfm,
+		       const struct xtables_target *t)
+{
+	unsigned int k;
+	int c, has_arg;
+
+	for (start += 2; start < end; start++) {
+		const char *w = argv[start] + 2;
+
+		if (argv[start][0] != '-' || argv[start][1] != '-')
+			continue;
+		for (k = 0; k < nfm; k++)
+			if (!fm[k].completed &&
+			    fast_find_ext_opt(fm[k].match->x6_options,
+					      fm[k].match->extra_opts, w,
+					      &c, &has_arg))
+				return true;
+		if (t != NULL &&
+		    fast_find_ext_opt(t->x6_options, t->extra_opts, w,
+				      &c, &has_arg))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Fast path for the "-A chain rule-specification" lines ip6tables-save
+ * writes: builds the entry straight from the words of the line, without
+ * getopt and without merging the options of every extension used.
+ * Extension options go to their parse callbacks directly, and with
+ * xs_parse_cache_enabled, match and target fragments seen before are
+ * copied from the parse cache instead of being parsed again.  Anything
+ * else (other commands, abbreviated or ambiguous options, lines that
+ * fail a check) returns -1 before touching the handle, so that the
+ * caller can run do_command6() for the complete behaviour and error messages.
+ * Otherwise returns the result of appending the rule.
+ */
+int do_command6_fast(int argc, char *argv[], struct xtc_handle *handle)
+{
+	struct iptables_command_state cs;
+	struct ip6t_entry *e;
+	unsigned int nsaddrs = 0, ndaddrs = 0;
+	struct in6_addr *saddrs = NULL, *smasks = NULL;
+	struct in6_addr *daddrs = NULL, *dmasks = NULL;
+	const char *shostnetworkmask = "::0/0", *dhostnetworkmask = "::0/0";
+	const char *chain = NULL;
+	struct fast_match fm[FAST_MAX_MATCHES], *f;
+	unsigned int nfm = 0, k;
+	struct xtables_target *text = NULL;
+	const struct xt_entry_target *tblob = NULL, *target;
+	int tstart = 0, tend = 0, twin = 0;
+	uint32_t tctx = 0;
+	struct xtables_match *m;
+	struct xtables_target *t;
+	unsigned long long cnt;
+	size_t size;
+	void *ext;
+	int i, ret;
+
+	/* Lines of tables skipped with -T have no handle */
+	if (handle == NULL)
+		return -1;
+
+	memset(&cs, 0, sizeof(cs));
+	cs.jumpto = "";
+	cs.argv = argv;
+
+	for (m = xtables_matches; m; m = m->next)
+		m->mflags = 0;
+	for (t = xtables_targets; t; t = t->next) {
+		t->tflags = 0;
+		t->used = 0;
+	}
+
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		char *val = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (strcmp(arg, "!") == 0) {
+			if (cs.invert)
+				goto fallback;
+			cs.invert = TRUE;
+			continue;
+		}
+
+		/* Options of the extensions loaded so far */
+		if (arg[0] == '-' && arg[1] == '-' && !fast_is_base_opt(arg + 2)) {
+			int c, has_arg, first = cs.invert ? i - 1 : i;
+			bool found = false;
+
+			f = NULL;
+			for (k = 0; k < nfm; k++) {
+				m = fm[k].match;
+				if (fm[k].completed ||
+				    !fast_find_ext_opt(m->x6_options,
+						       m->extra_opts, arg + 2,
+						       &c, &has_arg))
+					continue;
+				if (found)
+					goto fallback;
+				found = true;
+				f = &fm[k];
+			}
+			if (text != NULL &&
+			    fast_find_ext_opt(text->x6_options,
+					      text->extra_opts, arg + 2,
+					      &c, &has_arg)) {
+				if (found)
+					goto fallback;
+				found = true;
+			}
+			if (!found || has_arg == optional_argument)
+				goto fallback;
+			/* more options for a fragment taken from the cache */
+			if (f != NULL ? f->blob != NULL : tblob != NULL)
+				goto fallback;
+
+			optarg = NULL;
+			if (has_arg == required_argument) {
+				if (val == NULL || strcmp(val, "!") == 0)
+					goto fallback;
+				optarg = val;
+				i++;
+			}
+			/* old-style parsers may take more words via optind */
+			optind = i + 1;
+			if (f != NULL) {
+				if (first != f->end)
+					f->cacheable = false;
+				xtables_option_mpcall(c + f->match->option_offset,
+						      argv, cs.invert, f->match,
+						      &cs.fw6);
+				f->end = optind;
+			} else {
+				if (first != tend)
+					twin = 0;
+				xtables_option_tpcall(c +
+						      cs.target->option_offset,
+						      argv, cs.invert, cs.target,
+						      &cs.fw6);
+				tend = optind;
+			}
+			i = optind - 1;
+			cs.invert = FALSE;
+			continue;
+		}
+
+		/* Every other option handled here takes an argument */
+		if (val == NULL)
+			goto fallback;
+
+		if (fast_is_opt(arg, 'A', "append")) {
+			if (chain != NULL || cs.invert)
+				goto fallback;
+			chain = val;
+		} else if (fast_is_opt(arg, 't', "table")) {
+			/* the caller already picked the handle */
+			if (cs.invert)
+				goto fallback;
+		} else if (fast_is_opt(arg, 'c', "set-counters")) {
+			if (i + 2 >= argc || strchr(val, ',') != NULL)
+				goto fallback;
+			set_option(&cs.options, OPT_COUNTERS,
+				   &cs.fw6.ipv6.invflags, cs.invert);
+			if (sscanf(val, "%llu", &cnt) != 1)
+				goto fallback;
+			cs.fw6.counters.pcnt = cnt;
+			if (sscanf(argv[i + 2], "%llu", &cnt) != 1)
+				goto fallback;
+			cs.fw6.counters.bcnt = cnt;
+			i++;
+		} else if (fast_is_opt(arg, 'p', "protocol")) {
+			set_option(&cs.options, OPT_PROTOCOL,
+				   &cs.fw6.ipv6.invflags, cs.invert);
+			for (cs.protocol = val; *cs.protocol; cs.protocol++)
+				*cs.protocol = tolower(*cs.protocol);
+			cs.protocol = val;
+			cs.fw6.ipv6.proto = xtables_parse_protocol(cs.protocol);
+			cs.fw6.ipv6.flags |= IP6T_F_PROTO;
+
+			if (cs.fw6.ipv6.proto == 0
+			    && (cs.fw6.ipv6.invflags & XT_INV_PROTO))
+				xtables_error(PARAMETER_PROBLEM,
+					   "rule would never match protocol");
+
+			if (is_exthdr(cs.fw6.ipv6.proto)
+			    && (cs.fw6.ipv6.invflags & XT_INV_PROTO) == 0)
+				fprintf(stderr,
+					"Warning: never matched protocol: %s. "
+					"use extension match instead.\n",
+					cs.protocol);
+		} else if (fast_is_opt(arg, 's', "source")) {
+			set_option(&cs.options, OPT_SOURCE,
+				   &cs.fw6.ipv6.invflags, cs.invert);
+			shostnetworkmask = val;
+		} else if (fast_is_opt(arg, 'd', "destination")) {
+			set_option(&cs.options, OPT_DESTINATION,
+				   &cs.fw6.ipv6.invflags, cs.invert);
+			dhostnetworkmask = val;
+		} else if (fast_is_opt(arg, 'i', "in-interface")) {
+			if (*val == '\0')
+				goto fallback;
+			set_option(&cs.options, OPT_VIANAMEIN,
+				   &cs.fw6.ipv6.invflags, cs.invert);
+			xtables_parse_interface(val, cs.fw6.ipv6.iniface,
+						cs.fw6.ipv6.iniface_mask);
+		} else if (fast_is_opt(arg, 'o', "out-interface")) {
+			if (*val == '\0')
+				goto fallback;
+			set_option(&cs.options, OPT_VIANAMEOUT,
+				   &cs.fw6.ipv6.invflags, cs.invert);
+			xtables_parse_interface(val, cs.fw6.ipv6.outiface,
+						cs.fw6.ipv6.outiface_mask);
+#ifdef IP6T_F_GOTO
+		} else if (fast_is_opt(arg, 'g', "goto")) {
+			set_option(&cs.options, OPT_JUMP,
+				   &cs.fw6.ipv6.invflags, cs.invert);
+			cs.fw6.ipv6.flags |= IP6T_F_GOTO;
+			cs.jumpto = parse_target(val);
+#endif
+		} else if (fast_is_opt(arg, 'j', "jump")) {
+			set_option(&cs.options, OPT_JUMP,
+				   &cs.fw6.ipv6.invflags, cs.invert);
+			cs.jumpto = parse_target(val);
+			tstart = i;
+			tend = i + 2;
+			twin = xs_parse_window(argc, argv, i,
+					       ip6tables_globals.orig_opts);
+			tctx = FAST_CTX(cs.fw6);
+			tblob = xs_parse_cache_get(&argv[i], twin - i, tctx,
+						   &ext, NULL);
+			if (tblob != NULL) {
+				text = ext;
+				if (fast_clash(argv, i, twin, fm, nfm, NULL))
+					goto fallback;
+				i = twin - 1;
+				continue;
+			}
+			cs.target = xtables_find_target(cs.jumpto,
+							XTF_TRY_LOAD);
+			if (cs.target != NULL) {
+				size = XT_ALIGN(sizeof(struct xt_entry_target))
+					+ cs.target->size;
+				cs.target->t = xtables_calloc(1, size);
+				cs.target->t->u.target_size = size;
+				if (cs.target->real_name == NULL) {
+					strcpy(cs.target->t->u.user.name,
+					       cs.jumpto);
+				} else {
+					strcpy(cs.target->t->u.user.name,
+					       cs.target->real_name);
+					if (!(cs.target->ext_flags &
+					      XTABLES_EXT_ALIAS))
+						fprintf(stderr, "Notice: The %s target is converted into %s target "
+							"in rule listing and saving.\n",
+							cs.jumpto, cs.target->real_name);
+				}
+				cs.target->t->u.user.revision =
+					cs.target->revision;
+				xs_init_target(cs.target);
+				text = cs.target;
+			}
+		} else if (fast_is_opt(arg, 'm', "match")) {
+			if (cs.invert || nfm == FAST_MAX_MATCHES)
+				goto fallback;
+			/* naming a match again completes the earlier ones */
+			for (k = 0; k < nfm; k++)
+				if (strcmp(fm[k].match->name, val) == 0)
+					fm[k].completed = true;
+			f = &fm[nfm++];
+			memset(f, 0, sizeof(*f));
+			f->start = i;
+			f->end = i + 2;
+			f->win = xs_parse_window(argc, argv, i,
+						 ip6tables_globals.orig_opts);
+			f->ctx = FAST_CTX(cs.fw6);
+			f->blob = xs_parse_cache_get(&argv[i], f->win - i,
+						     f->ctx, &ext, NULL);
+			if (f->blob != NULL) {
+				f->match = ext;
+				if (fast_clash(argv, i, f->win, fm, nfm - 1,
+					       text))
+					goto fallback;
+				i = f->win - 1;
+				continue;
+			}
+
+			m = xtables_find_match(val, XTF_LOAD_MUST_SUCCEED,
+					       &cs.matches);
+			size = XT_ALIGN(sizeof(struct xt_entry_match))
+				+ m->size;
+			m->m = xtables_calloc(1, size);
+			m->m->u.match_size = size;
+			if (m->real_name == NULL) {
+				strcpy(m->m->u.user.name, m->name);
+			} else {
+				strcpy(m->m->u.user.name, m->real_name);
+				if (!(m->ext_flags & XTABLES_EXT_ALIAS))
+					fprintf(stderr, "Notice: the %s match is converted into %s match "
+						"in rule listing and saving.\n", m->name, m->real_name);
+			}
+			m->m->u.user.revision = m->revision;
+			xs_init_match(m);
+			f->match = m;
+			f->cacheable = true;
+		} else {
+			goto fallback;
+		}
+		i++;
+		cs.invert = FALSE;
+	}
+
+	if (chain == NULL || cs.invert)
+		goto fallback;
+
+	/* -i/-o on chains that cannot have them, the full path says why */
+	if ((cs.options & OPT_VIANAMEOUT &&
+	     (strcmp(chain, "PREROUTING") == 0 ||
+	      strcmp(chain, "INPUT") == 0)) ||
+	    (cs.options & OPT_VIANAMEIN &&
+	     (strcmp(chain, "POSTROUTING") == 0 ||
+	      strcmp(chain, "OUTPUT") == 0)))
+		goto fallback;
+
+	/* Targets named like a chain, or neither target nor chain */
+	if (text != NULL && ip6tc_is_chain(cs.jumpto, handle))
+		goto fallback;
+	if (text == NULL && *cs.jumpto != '\0' &&
+	    !ip6tc_is_chain(cs.jumpto, handle))
+		goto fallback;
+
+	for (k = 0; k < nfm; k++)
+		if (fm[k].blob == NULL)
+			xtables_option_mfcall(fm[k].match);
+	if (cs.target != NULL)
+		xtables_option_tfcall(cs.target);
+
+	/* Keep what was parsed from a whole fragment for the next rules */
+	for (k = 0; k < nfm; k++) {
+		f = &fm[k];
+		if (f->blob != NULL || !f->cacheable || f->end != f->win)
+			continue;
+		m = f->match;
+		xs_parse_cache_put(&argv[f->start], f->win - f->start, f->ctx,
+				   m != m->next ? m :
+				   xtables_find_match(m->name, XTF_DONT_LOAD,
+						      NULL),
+				   m->mflags, m->m, m->m->u.match_size);
+	}
+	if (cs.target != NULL && tend == twin)
+		xs_parse_cache_put(&argv[tstart], twin - tstart, tctx,
+				   cs.target, cs.target->tflags, cs.target->t,
+				   cs.target->t->u.target_size);
+
+	if (text == NULL) {
+		cs.target = xtables_find_target(XT_STANDARD_TARGET,
+						XTF_LOAD_MUST_SUCCEED);
+		size = sizeof(struct xt_entry_target) + cs.target->size;
+		cs.target->t = xtables_calloc(1, size);
+		cs.target->t->u.target_size = size;
+		strcpy(cs.target->t->u.user.name, cs.jumpto);
+		if (!ip6tc_is_chain(cs.jumpto, handle))
+			cs.target->t->u.user.revision = cs.target->revision;
+		xs_init_target(cs.target);
+	}
+
+	xtables_ip6parse_multiple(shostnetworkmask, &saddrs, &smasks, &nsaddrs);
+	xtables_ip6parse_multiple(dhostnetworkmask, &daddrs, &dmasks, &ndaddrs);
+	if ((nsaddrs > 1 || ndaddrs > 1) &&
+	    (cs.fw6.ipv6.invflags & (IP6T_INV_SRCIP | IP6T_INV_DSTIP)))
+		xtables_error(PARAMETER_PROBLEM, "! not allowed with multiple"
+			   " source or destination IP addresses");
+
+	/* As generate_entry(), with some blobs from the parse cache */
+	target = tblob != NULL ? tblob : cs.target->t;
+	size = sizeof(struct ip6t_entry);
+	for (k = 0; k < nfm; k++)
+		size += fm[k].blob != NULL ? fm[k].blob->u.match_size :
+			fm[k].match->m->u.match_size;
+	e = xtables_malloc(size + target->u.target_size);
+	*e = cs.fw6;
+	e->target_offset = size;
+	e->next_offset = size + target->u.target_size;
+	size = 0;
+	for (k = 0; k < nfm; k++) {
+		const struct xt_entry_match *em = fm[k].blob != NULL ?
+			fm[k].blob : fm[k].match->m;
+
+		memcpy(e->elems + size, em, em->u.match_size);
+		size += em->u.match_size;
+	}
+	memcpy(e->elems + size, target, target->u.target_size);
+	if (cs.target != NULL) {
+		free(cs.target->t);
+		cs.target->t = NULL;
+	}
+
+	ret = append_entry(chain, e, nsaddrs, saddrs, smasks,
+			   ndaddrs, daddrs, dmasks, 0, handle);
+
+	xtables_rule_matches_free(&cs.matches);
+	free(e);
+	free(saddrs);
+	free(smasks);
+	free(daddrs);
+	free(dmasks);
+	return ret;
+
+fallback:
+	xtables_rule_matches_free(&cs.matches);
+	if (cs.target != NULL) {
+		free(cs.target->t);
+		cs.target->t = NULL;
+	}
+	return -1;
+}
@@ -11,10 +11,15 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "iptables.h"
 #include "xtables.h"
 #include "libiptc/libiptc.h"
 #include "iptables-multi.h"
+#include "xshared.h"
 
 #ifdef DEBUG
 #define DEBUGP(x, args...) fprintf(stderr, x, ## args)
@@ -22,15 +27,17 @@
 #define DEBUGP(x, args...)
 #endif
 
-static int counters = 0, verbose = 0, noflush = 0;
+static int binary = 0, counters = 0, verbose = 0, noflush = 0, parallel = 0;
 
 /* Keeping track of external matches and targets.  */
 static const struct option options[] = {
+	{.name = "binary",   .has_arg = false, .val = 'b'},
 	{.name = "counters", .has_arg = false, .val = 'c'},
 	{.name = "verbose",  .has_arg = false, .val = 'v'},
 	{.name = "test",     .has_arg = false, .val = 't'},
 	{.name = "help",     .has_arg = false, .val = 'h'},
 	{.name = "noflush",  .has_arg = false, .val = 'n'},
+	{.name = "parallel", .has_arg = false, .val = 'P'},
 	{.name = "modprobe", .has_arg = true,  .val = 'M'},
 	{.name = "table",    .has_arg = true,  .val = 'T'},
 	{NULL},
@@ -42,12 +49,14 @@ static void print_usage(const char *name, const char *version) __attribute__((no
 
 static void print_usage(const char *name, const char *version)
 {
-	fprintf(stderr, "Usage: %s [-c] [-v] [-t] [-h]\n"
+	fprintf(stderr, "Usage: %s [-b] [-c] [-v] [-t] [-h] [-P]\n"
+			"	   [ --binary ]\n"
 			"	   [ --counters ]\n"
 			"	   [ --verbose ]\n"
 			"	   [ --test ]\n"
 			"	   [ --help ]\n"
 			"	   [ --noflush ]\n"
+			"	   [ --parallel ]\n"
 			"	   [ --table=<TABLE> ]\n"
 			"          [ --modprobe=<command>]\n", name);
 
@@ -89,12 +98,12 @@ static int parse_counters(char *string, struct xt_counters *ctr)
 static char *newargv[255];
 static int newargc;
 
-/* function adding one argument to newargv, updating newargc 
+/* function adding one argument to newargv, updating newargc
  * returns true if argument added, false otherwise */
 static int add_argv(char *what) {
 	DEBUGP("add_argv: %s\n", what);
 	if (what && newargc + 1 < ARRAY_SIZE(newargv)) {
-		newargv[newargc] = strdup(what);
+		newargv[newargc] = what;
 		newargv[++newargc] = NULL;
 		return 1;
 	} else {
@@ -104,88 +113,287 @@ static int add_argv(char *what) {
 	}
 }
 
-static void free_argv(void) {
-	int i;
+/* Split the rest of the line in place, newargv points into the buffer */
+static void add_param_to_argv(char *parsestart)
+{
+	int i, n;
+
+	n = xs_split_line(parsestart, &newargv[newargc],
+			  ARRAY_SIZE(newargv) - 1 - newargc);
+
+	for (i = newargc; i < newargc + n; i++) {
+		/* check if table name specified */
+		if (!strncmp(newargv[i], "-t", 2)
+		    || !strncmp(newargv[i], "--table", 8)) {
+			xtables_error(PARAMETER_PROBLEM,
+			"The -t option (seen in line %u) cannot be "
+			"used in iptables-restore.\n", line);
+			exit(1);
+		}
+	}
+	newargc += n;
+}
 
-	for (i = 0; i < newargc; i++)
-		free(newargv[i]);
+/* Map or read all of `in', for -b and --parallel */
+static void *read_input(FILE *in, size_t *len, int *mapped)
+{
+	struct stat st;
+	size_t size = 0, alloc = 0;
+	char *data = NULL;
+
+	if (fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode)
+	    && st.st_size > 0) {
+		/* Private and writable: restoring patches it in place */
+		data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE, fileno(in), 0);
+		if (data != MAP_FAILED) {
+			*len = st.st_size;
+			*mapped = 1;
+			return data;
+		}
+		data = NULL;
+	}
+
+	/* Pipes and the like */
+	for (;;) {
+		size_t n;
+
+		if (size == alloc) {
+			alloc = alloc ? alloc * 2 : 65536;
+			data = realloc(data, alloc);
+			if (!data)
+				xtables_error(OTHER_PROBLEM,
+					   "Cannot allocate memory\n");
+		}
+		n = fread(data + size, 1, alloc - size, in);
+		if (n == 0)
+			break;
+		size += n;
+	}
+	if (ferror(in))
+		xtables_error(OTHER_PROBLEM, "Cannot read input: %s\n",
+			   strerror(errno));
+
+	*len = size;
+	*mapped = 0;
+	return data;
 }
 
-static void add_param_to_argv(char *parsestart)
+static int restore_binary(FILE *in, const char *tablename, int testing)
 {
-	int quote_open = 0, escaped = 0, param_len = 0;
-	char param_buffer[1024], *curchar;
-
-	/* After fighting with strtok enough, here's now
-	 * a 'real' parser. According to Rusty I'm now no
-	 * longer a real hacker, but I can live with that */
-
-	for (curchar = parsestart; *curchar; curchar++) {
-		if (quote_open) {
-			if (escaped) {
-				param_buffer[param_len++] = *curchar;
-				escaped = 0;
-				continue;
-			} else if (*curchar == '\\') {
-				escaped = 1;
-				continue;
-			} else if (*curchar == '"') {
-				quote_open = 0;
-				*curchar = ' ';
+	size_t len, off, used;
+	int mapped, loaded = 0;
+	char *data;
+
+	data = read_input(in, &len, &mapped);
+
+	for (off = 0; off < len; off += used) {
+		used = iptc_restore_blob(data + off, len - off, tablename,
+					counters, testing);
+		if (!used && errno == ENOPROTOOPT && !loaded) {
+			/* try to insmod the module if the kernel lacks it */
+			xtables_load_ko(xtables_modprobe_program, false);
+			loaded = 1;
+			used = iptc_restore_blob(data + off, len - off,
+						tablename, counters, testing);
+		}
+		if (!used)
+			xtables_error(OTHER_PROBLEM,
+				   "table at offset %zu failed: %s\n", off,
+				   iptc_strerror(errno));
+	}
+
+	if (mapped)
+		munmap(data, len);
+	else
+		free(data);
+	fclose(in);
+	return 0;
+}
+
+/* With --parallel, the tables are read from the kernel and committed
+ * on a thread each.  Rules are still applied here one line at a time,
+ * as extension parsing is not thread safe, and nothing is committed
+ * before the whole input has been parsed. */
+struct restore_table {
+	char name[XT_TABLE_MAXNAMELEN + 1];
+	struct xtc_handle *handle;
+	unsigned int line;		/* line of its COMMIT */
+	int ret, err;
+	pthread_t thread;
+	bool running;
+};
+
+static struct restore_table *tables;
+static unsigned int num_tables;
+
+static void *init_table(void *data)
+{
+	struct restore_table *t = data;
+
+	t->handle = iptc_init(t->name);
+	t->err = errno;
+	return NULL;
+}
+
+static void *commit_table(void *data)
+{
+	struct restore_table *t = data;
+
+	t->ret = iptc_commit(t->handle);
+	t->err = errno;
+	iptc_free(t->handle);
+	t->handle = NULL;
+	return NULL;
+}
+
+static struct restore_table *find_table(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_tables; i++)
+		if (strcmp(tables[i].name, name) == 0)
+			return &tables[i];
+	return NULL;
+}
+
+static void join_table(struct restore_table *t)
+{
+	if (t->running) {
+		pthread_join(t->thread, NULL);
+		t->running = false;
+	}
+}
+
+/* Start reading every table of the input from the kernel.  Input with
+ * a table appearing twice is restored one table after another, as the
+ * second part has to see the first one committed. */
+static void prepare_tables(const char *data, size_t len,
+			   const char *tablename)
+{
+	const char *p, *end = data + len;
+	struct restore_table *t;
+	unsigned int i;
+
+	for (p = data; p < end; p = memchr(p, '\n', end - p) + 1) {
+		char name[XT_TABLE_MAXNAMELEN + 1];
+		size_t n;
+
+		if (*p == '*') {
+			n = strcspn(p + 1, " \t\n");
+			if (n > XT_TABLE_MAXNAMELEN)
+				n = XT_TABLE_MAXNAMELEN;
+			memcpy(name, p + 1, n);
+			name[n] = '\0';
+
+			if (n == 0 || (tablename && strcmp(tablename, name)))
+				;
+			else if (find_table(name)) {
+				free(tables);
+				tables = NULL;
+				num_tables = 0;
+				return;
 			} else {
-				param_buffer[param_len++] = *curchar;
-				continue;
-			}
-		} else {
-			if (*curchar == '"') {
-				quote_open = 1;
-				continue;
+				tables = realloc(tables, (num_tables + 1) *
+						 sizeof(*tables));
+				if (!tables)
+					xtables_error(OTHER_PROBLEM,
+						   "Cannot allocate memory\n");
+				t = &tables[num_tables++];
+				memset(t, 0, sizeof(*t));
+				strcpy(t->name, name);
 			}
 		}
+		if (!memchr(p, '\n', end - p))
+			break;
+	}
 
-		if (*curchar == ' '
-		    || *curchar == '\t'
-		    || * curchar == '\n') {
-			if (!param_len) {
-				/* two spaces? */
-				continue;
-			}
+	for (i = 0; i < num_tables; i++)
+		tables[i].running = pthread_create(&tables[i].thread, NULL,
+						   init_table, &tables[i]) == 0;
+}
 
-			param_buffer[param_len] = '\0';
+/* The handle read on the table's thread, or a new one if that failed */
+static struct xtc_handle *take_handle(const char *tablename)
+{
+	struct restore_table *t = find_table(tablename);
+	struct xtc_handle *handle;
 
-			/* check if table name specified */
-			if (!strncmp(param_buffer, "-t", 2)
-			    || !strncmp(param_buffer, "--table", 8)) {
-				xtables_error(PARAMETER_PROBLEM,
-				"The -t option (seen in line %u) cannot be "
-				"used in iptables-restore.\n", line);
-				exit(1);
-			}
+	if (!t)
+		return create_handle(tablename);
 
-			add_argv(param_buffer);
-			param_len = 0;
-		} else {
-			/* regular character, copy to buffer */
-			param_buffer[param_len++] = *curchar;
+	join_table(t);
+	if (!t->handle)
+		t->handle = create_handle(tablename);
 
-			if (param_len >= sizeof(param_buffer))
-				xtables_error(PARAMETER_PROBLEM,
-				   "Parameter too long!");
-		}
+	handle = t->handle;
+	t->handle = NULL;
+	return handle;
+}
+
+/* Hand the handle over for commit_tables(), if its table was prepared */
+static bool queue_commit(const char *tablename, struct xtc_handle *handle,
+			 unsigned int lineno)
+{
+	struct restore_table *t = find_table(tablename);
+
+	if (!t)
+		return false;
+
+	t->handle = handle;
+	t->line = lineno;
+	return true;
+}
+
+/* Commit all tables at once, report the first failure in input order */
+static void commit_tables(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_tables; i++) {
+		struct restore_table *t = &tables[i];
+
+		join_table(t);
+		if (!t->handle)
+			continue;
+		t->running = pthread_create(&t->thread, NULL, commit_table,
+					    t) == 0;
+		if (!t->running)
+			commit_table(t);
 	}
+
+	for (i = 0; i < num_tables; i++)
+		join_table(&tables[i]);
+
+	for (i = 0; i < num_tables; i++) {
+		if (!tables[i].line || tables[i].ret)
+			continue;
+		fprintf(stderr, "%s: line %u failed: %s\n",
+			xt_params->program_name, tables[i].line,
+			iptc_strerror(tables[i].err));
+		exit(1);
+	}
+
+	free(tables);
+	tables = NULL;
+	num_tables = 0;
 }
 
 int
 iptables_restore_main(int argc, char *argv[])
 {
 	struct xtc_handle *handle = NULL;
-	char buffer[10240];
+	char *buffer = NULL;
+	size_t bufsz = 0;
 	int c;
 	char curtable[XT_TABLE_MAXNAMELEN + 1];
 	FILE *in;
 	int in_table = 0, testing = 0;
 	const char *tablename = NULL;
 	const struct xtc_ops *ops = &iptc_ops;
+	size_t input_len = 0;
+	int input_mapped = 0;
+	char *input = NULL;
 
 	line = 0;
 
@@ -201,11 +409,12 @@ iptables_restore_main(int argc, char *argv[])
 	init_extensions();
 	init_extensions4();
 #endif
+	xs_parse_cache_enabled = true;
 
-	while ((c = getopt_long(argc, argv, "bcvthnM:T:", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "bcvthnPM:T:", options, NULL)) != -1) {
 		switch (c) {
 			case 'b':
-				fprintf(stderr, "-b/--binary option is not implemented\n");
+				binary = 1;
 				break;
 			case 'c':
 				counters = 1;
@@ -223,6 +432,9 @@ iptables_restore_main(int argc, char *argv[])
 			case 'n':
 				noflush = 1;
 				break;
+			case 'P':
+				parallel = 1;
+				break;
 			case 'M':
 				xtables_modprobe_program = optarg;
 				break;
@@ -246,8 +458,36 @@ iptables_restore_main(int argc, char *argv[])
 	}
 	else in = stdin;
 
+	if (binary) {
+		if (noflush) {
+			fprintf(stderr, "--binary replaces whole tables, it "
+				"cannot be used with --noflush\n");
+			exit(1);
+		}
+		return restore_binary(in, tablename, testing);
+	}
+
+	if (parallel) {
+		input = read_input(in, &input_len, &input_mapped);
+		if (input_len > 0) {
+			prepare_tables(input, input_len, tablename);
+			fclose(in);
+			in = fmemopen(input, input_len, "r");
+			if (!in)
+				xtables_error(OTHER_PROBLEM,
+					   "Cannot read input: %s\n",
+					   strerror(errno));
+		}
+	}
+
+	/* Resolve the host names of all rules up front, concurrently */
+	if (input_len > 0)
+		xs_prefetch_hosts(input, input_len, AF_INET);
+	else
+		xs_prefetch_hosts_file(in, AF_INET);
+
 	/* Grab standard input. */
-	while (fgets(buffer, sizeof(buffer), in)) {
+	while (getline(&buffer, &bufsz, in) != -1) {
 		int ret = 0;
 
 		line++;
@@ -258,7 +498,12 @@ iptables_restore_main(int argc, char *argv[])
 				fputs(buffer, stdout);
 			continue;
 		} else if ((strcmp(buffer, "COMMIT\n") == 0) && (in_table)) {
-			if (!testing) {
+			if (!testing && parallel &&
+			    queue_commit(curtable, handle, line)) {
+				DEBUGP("Deferring commit\n");
+				handle = NULL;
+				ret = 1;
+			} else if (!testing) {
 				DEBUGP("Calling commit\n");
 				ret = ops->commit(handle);
 				ops->free(handle);
@@ -288,7 +533,10 @@ iptables_restore_main(int argc, char *argv[])
 			if (handle)
 				ops->free(handle);
 
-			handle = create_handle(table);
+			if (parallel)
+				handle = take_handle(table);
+			else
+				handle = create_handle(table);
 			if (noflush == 0) {
 				DEBUGP("Cleaning all chains of table '%s'\n",
 					table);
@@ -435,10 +683,12 @@ iptables_restore_main(int argc, char *argv[])
 			for (a = 0; a < newargc; a++)
 				DEBUGP("argv[%u]: %s\n", a, newargv[a]);
 
-			ret = do_command4(newargc, newargv,
-					 &newargv[2], &handle, true);
+			/* Plain appends skip the getopt parser */
+			ret = do_command4_fast(newargc, newargv, handle);
+			if (ret < 0)
+				ret = do_command4(newargc, newargv,
+						 &newargv[2], &handle, true);
 
-			free_argv();
 			fflush(stdout);
 		}
 		if (tablename && (strcmp(tablename, curtable) != 0))
@@ -455,6 +705,16 @@ iptables_restore_main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (parallel)
+		commit_tables();
+	if (verbose)
+		xs_parse_cache_stats(stdout);
+
+	free(buffer);
 	fclose(in);
+	if (input_mapped)
+		munmap(input, input_len);
+	else
+		free(input);
 	return 0;
 }
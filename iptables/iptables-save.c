@@ -13,13 +13,15 @@
 #include <string.h>
 #include <time.h>
 #include <netdb.h>
+#include <unistd.h>
 #include "libiptc/libiptc.h"
 #include "iptables.h"
 #include "iptables-multi.h"
 
-static int show_counters = 0;
+static int show_counters = 0, binary = 0;
 
 static const struct option options[] = {
+	{.name = "binary",   .has_arg = false, .val = 'b'},
 	{.name = "counters", .has_arg = false, .val = 'c'},
 	{.name = "dump",     .has_arg = false, .val = 'd'},
 	{.name = "table",    .has_arg = true,  .val = 't'},
@@ -69,6 +71,14 @@ static int do_output(const char *tablename)
 		xtables_error(OTHER_PROBLEM, "Cannot initialize: %s\n",
 			   iptc_strerror(errno));
 
+	if (binary) {
+		if (!iptc_save_blob(h, STDOUT_FILENO))
+			xtables_error(OTHER_PROBLEM, "Cannot save table `%s': %s\n",
+				   tablename, iptc_strerror(errno));
+		iptc_free(h);
+		return 1;
+	}
+
 	time_t now = time(NULL);
 
 	printf("# Generated by iptables-save v%s on %s",
@@ -81,14 +91,19 @@ static int do_output(const char *tablename)
 	     chain;
 	     chain = iptc_next_chain(h)) {
 
-		printf(":%s ", chain);
+		putchar(':');
+		fputs(chain, stdout);
+		putchar(' ');
 		if (iptc_builtin(chain, h)) {
 			struct xt_counters count;
-			printf("%s ",
-			       iptc_get_policy(chain, &count, h));
-			printf("[%llu:%llu]\n", (unsigned long long)count.pcnt, (unsigned long long)count.bcnt);
+			fputs(iptc_get_policy(chain, &count, h), stdout);
+			fputs(" [", stdout);
+			xtables_print_u64(count.pcnt);
+			putchar(':');
+			xtables_print_u64(count.bcnt);
+			fputs("]\n", stdout);
 		} else {
-			printf("- [0:0]\n");
+			fputs("- [0:0]\n", stdout);
 		}
 	}
 
@@ -139,7 +154,7 @@ iptables_save_main(int argc, char *argv[])
 	while ((c = getopt_long(argc, argv, "bcdt:M:", options, NULL)) != -1) {
 		switch (c) {
 		case 'b':
-			fprintf(stderr, "-b/--binary option is not implemented\n");
+			binary = 1;
 			break;
 		case 'c':
 			show_counters = 1;
@@ -36,6 +36,7 @@
 #include <errno.h>
 #include <string.h>
 #include <iptables.h>
+#include "xshared.h"
 #include "iptables-multi.h"
 
 int
@@ -58,6 +59,9 @@ iptables_main(int argc, char *argv[])
 	init_extensions4();
 #endif
 
+	if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+		exit(xs_batch_main(argc - 1, argv + 1, &iptc_ops, do_command4));
+
 	ret = do_command4(argc, argv, &table, &handle, false);
 	if (ret) {
 		ret = iptc_commit(handle);
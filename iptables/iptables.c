@@ -99,7 +99,7 @@ static struct option original_opts[] = {
 	{.name = "numeric",       .has_arg = 0, .val = 'n'},
 	{.name = "out-interface", .has_arg = 1, .val = 'o'},
 	{.name = "verbose",       .has_arg = 0, .val = 'v'},
-	{.name = "wait",          .has_arg = 0, .val = 'w'},
+	{.name = "wait",          .has_arg = 2, .val = 'w'},
 	{.name = "exact",         .has_arg = 0, .val = 'x'},
 	{.name = "fragments",     .has_arg = 0, .val = 'f'},
 	{.name = "version",       .has_arg = 0, .val = 'V'},
@@ -229,6 +229,7 @@ exit_printhelp(const struct xtables_rule_match *matches)
 "  --rename-chain\n"
 "            -E old-chain new-chain\n"
 "				Change chain name, (moving any references)\n"
+"  --batch [-w] [file]		Run the command lines in file (default: stdin)\n"
 
 "Options:\n"
 "    --ipv4	-4		Nothing (line is ignored by ip6tables-restore)\n"
@@ -253,7 +254,7 @@ exit_printhelp(const struct xtables_rule_match *matches)
 "				network interface name ([+] for wildcard)\n"
 "  --table	-t table	table to manipulate (default: `filter')\n"
 "  --verbose	-v		verbose mode\n"
-"  --wait	-w		wait for the xtables lock\n"
+"  --wait	-w [seconds]	wait for the xtables lock\n"
 "  --line-numbers		print line numbers when listing\n"
 "  --exact	-x		expand numbers (display exact values)\n"
 "[!] --fragment	-f		match second or further fragments only\n"
@@ -535,24 +536,39 @@ print_firewall(const struct ipt_entry *fw,
 	t = ipt_get_target((struct ipt_entry *)fw);
 	flags = fw->ip.flags;
 
-	if (format & FMT_LINENUMBERS)
-		printf(FMT("%-4u ", "%u "), num);
+	if (format & FMT_LINENUMBERS) {
+		char *p = buf + sizeof(buf) - 1;
+
+		*p = '\0';
+		do {
+			*--p = '0' + num % 10;
+			num /= 10;
+		} while (num != 0);
+		xtables_print_field(p, FMT(4, 0));
+		fputc(' ', stdout);
+	}
 
 	if (!(format & FMT_NOCOUNTS)) {
 		xtables_print_num(fw->counters.pcnt, format);
 		xtables_print_num(fw->counters.bcnt, format);
 	}
 
-	if (!(format & FMT_NOTARGET))
-		printf(FMT("%-9s ", "%s "), targname);
+	if (!(format & FMT_NOTARGET)) {
+		xtables_print_field(targname, FMT(9, 0));
+		fputc(' ', stdout);
+	}
 
 	fputc(fw->ip.invflags & XT_INV_PROTO ? '!' : ' ', stdout);
 	{
 		const char *pname = proto_to_name(fw->ip.proto, format&FMT_NUMERIC);
 		if (pname)
-			printf(FMT("%-5s", "%s "), pname);
+			xtables_print_field(pname, FMT(5, 0));
+		else if (format & FMT_NOTABLE)
+			xtables_print_u64(fw->ip.proto);
 		else
-			printf(FMT("%-5hu", "%hu "), fw->ip.proto);
+			printf("%-5hu", fw->ip.proto);
+		if (format & FMT_NOTABLE)
+			fputc(' ', stdout);
 	}
 
 	if (format & FMT_OPTIONS) {
@@ -577,7 +593,9 @@ print_firewall(const struct ipt_entry *fw,
 		}
 		else if (format & FMT_NUMERIC) strcat(iface, "*");
 		else strcat(iface, "any");
-		printf(FMT(" %-6s ","in %s "), iface);
+		fputs(FMT(" ", "in "), stdout);
+		xtables_print_field(iface, FMT(6, 0));
+		fputc(' ', stdout);
 
 		if (fw->ip.invflags & IPT_INV_VIA_OUT) {
 			iface[0] = '!';
@@ -590,32 +608,40 @@ print_firewall(const struct ipt_entry *fw,
 		}
 		else if (format & FMT_NUMERIC) strcat(iface, "*");
 		else strcat(iface, "any");
-		printf(FMT("%-6s ","out %s "), iface);
+		if (format & FMT_NOTABLE)
+			fputs("out ", stdout);
+		xtables_print_field(iface, FMT(6, 0));
+		fputc(' ', stdout);
 	}
 
 	fputc(fw->ip.invflags & IPT_INV_SRCIP ? '!' : ' ', stdout);
 	if (fw->ip.smsk.s_addr == 0L && !(format & FMT_NUMERIC))
-		printf(FMT("%-19s ","%s "), "anywhere");
+		xtables_print_field("anywhere", FMT(19, 0));
 	else {
 		if (format & FMT_NUMERIC)
 			strcpy(buf, xtables_ipaddr_to_numeric(&fw->ip.src));
 		else
 			strcpy(buf, xtables_ipaddr_to_anyname(&fw->ip.src));
 		strcat(buf, xtables_ipmask_to_numeric(&fw->ip.smsk));
-		printf(FMT("%-19s ","%s "), buf);
+		xtables_print_field(buf, FMT(19, 0));
 	}
+	fputc(' ', stdout);
 
 	fputc(fw->ip.invflags & IPT_INV_DSTIP ? '!' : ' ', stdout);
+	if (format & FMT_NOTABLE)
+		fputs("-> ", stdout);
 	if (fw->ip.dmsk.s_addr == 0L && !(format & FMT_NUMERIC))
-		printf(FMT("%-19s ","-> %s"), "anywhere");
+		xtables_print_field("anywhere", FMT(19, 0));
 	else {
 		if (format & FMT_NUMERIC)
 			strcpy(buf, xtables_ipaddr_to_numeric(&fw->ip.dst));
 		else
 			strcpy(buf, xtables_ipaddr_to_anyname(&fw->ip.dst));
 		strcat(buf, xtables_ipmask_to_numeric(&fw->ip.dmsk));
-		printf(FMT("%-19s ","-> %s"), buf);
+		xtables_print_field(buf, FMT(19, 0));
 	}
+	if (!(format & FMT_NOTABLE))
+		fputc(' ', stdout);
 
 	if (format & FMT_NOTABLE)
 		fputs("  ", stdout);
@@ -649,6 +675,30 @@ print_firewall_line(const struct ipt_entry *fw,
 	print_firewall(fw, t->u.user.name, 0, FMT_PRINT_RULE, h);
 }
 
+/* Print the rules an append or insert of `fw' is about to add */
+static void
+print_entries(struct ipt_entry *fw,
+	      unsigned int nsaddrs,
+	      const struct in_addr saddrs[],
+	      const struct in_addr smasks[],
+	      unsigned int ndaddrs,
+	      const struct in_addr daddrs[],
+	      const struct in_addr dmasks[],
+	      struct xtc_handle *handle)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < nsaddrs; i++) {
+		fw->ip.src.s_addr = saddrs[i].s_addr;
+		fw->ip.smsk.s_addr = smasks[i].s_addr;
+		for (j = 0; j < ndaddrs; j++) {
+			fw->ip.dst.s_addr = daddrs[j].s_addr;
+			fw->ip.dmsk.s_addr = dmasks[j].s_addr;
+			print_firewall_line(fw, handle);
+		}
+	}
+}
+
 static int
 append_entry(const xt_chainlabel chain,
 	     struct ipt_entry *fw,
@@ -661,22 +711,12 @@ append_entry(const xt_chainlabel chain,
 	     int verbose,
 	     struct xtc_handle *handle)
 {
-	unsigned int i, j;
-	int ret = 1;
-
-	for (i = 0; i < nsaddrs; i++) {
-		fw->ip.src.s_addr = saddrs[i].s_addr;
-		fw->ip.smsk.s_addr = smasks[i].s_addr;
-		for (j = 0; j < ndaddrs; j++) {
-			fw->ip.dst.s_addr = daddrs[j].s_addr;
-			fw->ip.dmsk.s_addr = dmasks[j].s_addr;
-			if (verbose)
-				print_firewall_line(fw, handle);
-			ret &= iptc_append_entry(chain, fw, handle);
-		}
-	}
+	if (verbose)
+		print_entries(fw, nsaddrs, saddrs, smasks,
+			      ndaddrs, daddrs, dmasks, handle);
 
-	return ret;
+	return iptc_append_entries(chain, fw, nsaddrs, saddrs, smasks,
+				   ndaddrs, daddrs, dmasks, handle);
 }
 
 static int
@@ -711,22 +751,13 @@ insert_entry(const xt_chainlabel chain,
 	     int verbose,
 	     struct xtc_handle *handle)
 {
-	unsigned int i, j;
-	int ret = 1;
-
-	for (i = 0; i < nsaddrs; i++) {
-		fw->ip.src.s_addr = saddrs[i].s_addr;
-		fw->ip.smsk.s_addr = smasks[i].s_addr;
-		for (j = 0; j < ndaddrs; j++) {
-			fw->ip.dst.s_addr = daddrs[j].s_addr;
-			fw->ip.dmsk.s_addr = dmasks[j].s_addr;
-			if (verbose)
-				print_firewall_line(fw, handle);
-			ret &= iptc_insert_entry(chain, fw, rulenum, handle);
-		}
-	}
+	if (verbose)
+		print_entries(fw, nsaddrs, saddrs, smasks,
+			      ndaddrs, daddrs, dmasks, handle);
 
-	return ret;
+	return iptc_insert_entries(chain, fw, rulenum,
+				   nsaddrs, saddrs, smasks,
+				   ndaddrs, daddrs, dmasks, handle);
 }
 
 static unsigned char *
@@ -900,6 +931,45 @@ delete_chain4(const xt_chainlabel chain, int verbose,
 	return iptc_delete_chain(chain, handle);
 }
 
+/* Look up the names of all addresses a listing is going to show at once,
+ * instead of one rule at a time while printing */
+static void
+prefetch_names(const xt_chainlabel chain, int rulenum,
+	       struct xtc_handle *handle)
+{
+	const struct ipt_entry *e;
+	struct in_addr *addrs = NULL;
+	unsigned int n = 0, alloc = 0;
+	const char *this;
+	int num;
+
+	for (this = iptc_first_chain(handle);
+	     this;
+	     this = iptc_next_chain(handle)) {
+		if (chain && strcmp(chain, this) != 0)
+			continue;
+
+		num = 0;
+		for (e = iptc_first_rule(this, handle); e;
+		     e = iptc_next_rule(e, handle)) {
+			if (rulenum && ++num != rulenum)
+				continue;
+			if (n + 2 > alloc) {
+				alloc = alloc ? alloc * 2 : 64;
+				addrs = xtables_realloc(addrs,
+						alloc * sizeof(*addrs));
+			}
+			if (e->ip.smsk.s_addr != 0)
+				addrs[n++] = e->ip.src;
+			if (e->ip.dmsk.s_addr != 0)
+				addrs[n++] = e->ip.dst;
+		}
+	}
+
+	xtables_addr_prefetch(addrs, n, AF_INET);
+	free(addrs);
+}
+
 static int
 list_entries(const xt_chainlabel chain, int rulenum, int verbose, int numeric,
 	     int expanded, int linenumbers, struct xtc_handle *handle)
@@ -923,6 +993,9 @@ list_entries(const xt_chainlabel chain, int rulenum, int verbose, int numeric,
 	if (linenumbers)
 		format |= FMT_LINENUMBERS;
 
+	if (!numeric)
+		prefetch_names(chain, rulenum, handle);
+
 	for (this = iptc_first_chain(handle);
 	     this;
 	     this = iptc_next_chain(handle)) {
@@ -959,34 +1032,17 @@ list_entries(const xt_chainlabel chain, int rulenum, int verbose, int numeric,
 static void print_proto(uint16_t proto, int invert)
 {
 	if (proto) {
-		unsigned int i;
-		const char *invertstr = invert ? " !" : "";
+		const char *pname = proto <= UINT8_MAX ?
+				    proto_to_name(proto, 0) : NULL;
 
-		const struct protoent *pent = getprotobynumber(proto);
-		if (pent) {
-			printf("%s -p %s", invertstr, pent->p_name);
-			return;
-		}
-
-		for (i = 0; xtables_chain_protos[i].name != NULL; ++i)
-			if (xtables_chain_protos[i].num == proto) {
-				printf("%s -p %s",
-				       invertstr, xtables_chain_protos[i].name);
-				return;
-			}
-
-		printf("%s -p %u", invertstr, proto);
+		fputs(invert ? " ! -p " : " -p ", stdout);
+		if (pname != NULL)
+			fputs(pname, stdout);
+		else
+			xtables_print_u64(proto);
 	}
 }
 
-#define IP_PARTS_NATIVE(n)			\
-(unsigned int)((n)>>24)&0xFF,			\
-(unsigned int)((n)>>16)&0xFF,			\
-(unsigned int)((n)>>8)&0xFF,			\
-(unsigned int)((n)&0xFF)
-
-#define IP_PARTS(n) IP_PARTS_NATIVE(ntohl(n))
-
 /* This assumes that mask is contiguous, and byte-bounded. */
 static void
 print_iface(char letter, const char *iface, const unsigned char *mask,
@@ -997,17 +1053,22 @@ print_iface(char letter, const char *iface, const unsigned char *mask,
 	if (mask[0] == 0)
 		return;
 
-	printf("%s -%c ", invert ? " !" : "", letter);
+	if (invert)
+		fputs(" !", stdout);
+	putchar(' ');
+	putchar('-');
+	putchar(letter);
+	putchar(' ');
 
 	for (i = 0; i < IFNAMSIZ; i++) {
 		if (mask[i] != 0) {
 			if (iface[i] != '\0')
-				printf("%c", iface[i]);
+				putchar(iface[i]);
 		} else {
 			/* we can access iface[i-1] here, because
 			 * a few lines above we make sure that mask[0] != 0 */
 			if (iface[i-1] != '\0')
-				printf("+");
+				putchar('+');
 			break;
 		}
 	}
@@ -1020,8 +1081,8 @@ static int print_match_save(const struct xt_entry_match *e,
 		xtables_find_match(e->u.user.name, XTF_TRY_LOAD, NULL);
 
 	if (match) {
-		printf(" -m %s",
-			match->alias ? match->alias(e) : e->u.user.name);
+		fputs(" -m ", stdout);
+		fputs(match->alias ? match->alias(e) : e->u.user.name, stdout);
 
 		/* some matches don't provide a save function */
 		if (match->save)
@@ -1041,30 +1102,22 @@ static int print_match_save(const struct xt_entry_match *e,
 static void print_ip(const char *prefix, uint32_t ip,
 		     uint32_t mask, int invert)
 {
-	uint32_t bits, hmask = ntohl(mask);
-	int i;
+	struct in_addr addr = { .s_addr = ip };
+	const char *cidr;
 
 	if (!mask && !ip && !invert)
 		return;
 
-	printf("%s %s %u.%u.%u.%u",
-		invert ? " !" : "",
-		prefix,
-		IP_PARTS(ip));
-
-	if (mask == 0xFFFFFFFFU) {
-		printf("/32");
-		return;
-	}
-
-	i    = 32;
-	bits = 0xFFFFFFFEU;
-	while (--i >= 0 && hmask != bits)
-		bits <<= 1;
-	if (i >= 0)
-		printf("/%u", i);
-	else
-		printf("/%u.%u.%u.%u", IP_PARTS(mask));
+	if (invert)
+		fputs(" !", stdout);
+	putchar(' ');
+	fputs(prefix, stdout);
+	putchar(' ');
+	fputs(xtables_ipaddr_to_numeric(&addr), stdout);
+
+	addr.s_addr = mask;
+	cidr = xtables_ipmask_to_numeric(&addr);
+	fputs(*cidr != '\0' ? cidr : "/32", stdout);
 }
 
 /* We want this to be readable, so only print out neccessary fields.
@@ -1076,11 +1129,17 @@ void print_rule4(const struct ipt_entry *e,
 	const char *target_name;
 
 	/* print counters for iptables-save */
-	if (counters > 0)
-		printf("[%llu:%llu] ", (unsigned long long)e->counters.pcnt, (unsigned long long)e->counters.bcnt);
+	if (counters > 0) {
+		putchar('[');
+		xtables_print_u64(e->counters.pcnt);
+		putchar(':');
+		xtables_print_u64(e->counters.bcnt);
+		fputs("] ", stdout);
+	}
 
 	/* print chain name */
-	printf("-A %s", chain);
+	fputs("-A ", stdout);
+	fputs(chain, stdout);
 
 	/* Print IP part. */
 	print_ip("-s", e->ip.src.s_addr,e->ip.smsk.s_addr,
@@ -1098,8 +1157,7 @@ void print_rule4(const struct ipt_entry *e,
 	print_proto(e->ip.proto, e->ip.invflags & XT_INV_PROTO);
 
 	if (e->ip.flags & IPT_F_FRAG)
-		printf("%s -f",
-		       e->ip.invflags & IPT_INV_FRAG ? " !" : "");
+		fputs(e->ip.invflags & IPT_INV_FRAG ? " ! -f" : " -f", stdout);
 
 	/* Print matchinfo part */
 	if (e->target_offset) {
@@ -1107,8 +1165,12 @@ void print_rule4(const struct ipt_entry *e,
 	}
 
 	/* print counters for iptables -R */
-	if (counters < 0)
-		printf(" -c %llu %llu", (unsigned long long)e->counters.pcnt, (unsigned long long)e->counters.bcnt);
+	if (counters < 0) {
+		fputs(" -c ", stdout);
+		xtables_print_u64(e->counters.pcnt);
+		putchar(' ');
+		xtables_print_u64(e->counters.bcnt);
+	}
 
 	/* Print target name and targinfo part */
 	target_name = iptc_get_target(e, h);
@@ -1123,7 +1185,8 @@ void print_rule4(const struct ipt_entry *e,
 			exit(1);
 		}
 
-		printf(" -j %s", target->alias ? target->alias(t) : target_name);
+		fputs(" -j ", stdout);
+		fputs(target->alias ? target->alias(t) : target_name, stdout);
 		if (target->save)
 			target->save(&e->ip, t);
 		else {
@@ -1139,13 +1202,16 @@ void print_rule4(const struct ipt_entry *e,
 			}
 		}
 	} else if (target_name && (*target_name != '\0'))
+	{
 #ifdef IPT_F_GOTO
-		printf(" -%c %s", e->ip.flags & IPT_F_GOTO ? 'g' : 'j', target_name);
+		fputs(e->ip.flags & IPT_F_GOTO ? " -g " : " -j ", stdout);
 #else
-		printf(" -j %s", target_name);
+		fputs(" -j ", stdout);
 #endif
+		fputs(target_name, stdout);
+	}
 
-	printf("\n");
+	putchar('\n');
 }
 
 static int
@@ -1319,7 +1385,7 @@ int do_command4(int argc, char *argv[], char **table,
 	struct in_addr *daddrs = NULL, *dmasks = NULL;
 
 	int verbose = 0;
-	bool wait = false;
+	int wait = 0;
 	const char *chain = NULL;
 	const char *shostnetworkmask = NULL, *dhostnetworkmask = NULL;
 	const char *policy = NULL, *newname = NULL;
@@ -1355,7 +1421,7 @@ int do_command4(int argc, char *argv[], char **table,
 
 	opts = xt_params->orig_opts;
 	while ((cs.c = getopt_long(argc, argv,
-	   "-:A:C:D:R:I:L::S::M:F::Z::N:X::E:P:Vh::o:p:s:d:j:i:fbvwnt:m:xc:g:46",
+	   "-:A:C:D:R:I:L::S::M:F::Z::N:X::E:P:Vh::o:p:s:d:j:i:fbvw::nt:m:xc:g:46",
 					   opts, NULL)) != -1) {
 		switch (cs.c) {
 			/*
@@ -1597,7 +1663,7 @@ int do_command4(int argc, char *argv[], char **table,
 					      "You cannot use `-w' from "
 					      "iptables-restore");
 			}
-			wait = true;
+			wait = xs_parse_wait(argc, argv);
 			break;
 
 		case 'm':
@@ -1750,12 +1816,8 @@ int do_command4(int argc, char *argv[], char **table,
 	generic_opt_check(command, cs.options);
 
 	/* Attempt to acquire the xtables lock */
-	if (!restore && !xtables_lock(wait)) {
-		fprintf(stderr, "Another app is currently holding the xtables lock. "
-			"Perhaps you want to use the -w option?\n");
-		xtables_free_opts(1);
-		exit(RESOURCE_PROBLEM);
-	}
+	if (!restore && !xtables_lock(wait, verbose > 1))
+		xs_lock_failed(wait);
 
 	/* only allocate handle if we weren't called with a handle */
 	if (!*handle)
@@ -1954,3 +2016,490 @@ int do_command4(int argc, char *argv[], char **table,
 
 	return ret;
 }
+
+/* Long (--name) or short (-c) spelling of a base option */
+static bool fast_is_opt(const char *arg, char c, const char *name)
+{
+	if (arg[0] != '-')
+		return false;
+	if (arg[1] == '-')
+		return strcmp(arg + 2, name) == 0;
+	return arg[1] == c && arg[2] == '\0';
+}
+
+static bool fast_is_base_opt(const char *name)
+{
+	const struct option *o;
+
+	for (o = iptables_globals.orig_opts; o->name != NULL; ++o)
+		if (strcmp(o->name, name) == 0)
+			return true;
+	return false;
+}
+
+/*
+ * Look `name' up in the options an extension would have merged, and
+ * return its code before the option offset and whether it takes an
+ * argument.
+ */
+static bool fast_find_ext_opt(const struct xt_option_entry *entry,
+			      const struct option *opt, const char *name,
+			      int *c, int *has_arg)
+{
+	if (entry != NULL) {
+		for (; entry->name != NULL; ++entry) {
+			if (strcmp(entry->name, name) != 0)
+				continue;
+			*c = entry->id;
+			*has_arg = entry->type == XTTYPE_NONE ?
+				   no_argument : required_argument;
+			return true;
+		}
+		return false;
+	}
+	for (; opt != NULL && opt->name != NULL; ++opt) {
+		if (strcmp(opt->name, name) != 0)
+			continue;
+		*c = opt->val;
+		*has_arg = opt->has_arg;
+		return true;
+	}
+	return false;
+}
+
+/* A rule line has at most 255 words, each match takes two or more */
+#define FAST_MAX_MATCHES	128
+
+/* A match of the rule built by do_command4_fast() */
+struct fast_match {
+	struct xtables_match *match;		/* for its options */
+	const struct xt_entry_match *blob;	/* reused from the parse cache */
+	int start, end, win;			/* words used, words it may use */
+	uint32_t ctx;
+	bool completed, cacheable;
+};
+
+/* What extension parsers see of the entry, part of the parse cache key */
+#define FAST_CTX(fw) ((fw).ip.proto | \
+		      ((fw).ip.flags & ~IPT_F_GOTO) << 16 | \
+		      ((fw).ip.invflags & XT_INV_PROTO) << 24)
+
+/* Whether an option in a cached fragment might belong to another extension */
+static bool fast_clash(char **argv, int start, int end,
+		       const struct fast_match *fm, unsigned int nfm,
+		       const struct xtables_target *t)
+{
+	unsigned int k;
+	int c, has_arg;
+
+	for (start += 2; start < end; start++) {
+		const char *w = argv[start] + 2;
+
+		if (argv[start][0] != '-' || argv[start][1] != '-')
+			continue;
+		for (k = 0; k < nfm; k++)
+			if (!fm[k].completed &&
+			    fast_find_ext_opt(fm[k].match->x6_options,
+					      fm[k].match->extra_opts, w,
+					      &c, &has_arg))
+				return true;
+		if (t != NULL &&
+		    fast_find_ext_opt(t->x6_options, t->extra_opts, w,
+				      &c, &has_arg))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Fast path for the "-A chain rule-specification" lines iptables-save
+ * writes: builds the entry straight from the words of the line, without
+ * getopt and without merging the options of every extension used.
+ * Extension options go to their parse callbacks directly, and with
+ * xs_parse_cache_enabled, match and target fragments seen before are
+ * copied from the parse cache instead of being parsed again.  Anything
+ * else (other commands, abbreviated or ambiguous options, lines that
+ * fail a check) returns -1 before touching the handle, so that the
+ * caller can run do_command4() for the complete behaviour and error messages.
+ * Otherwise returns the result of appending the rule.
+ */
+int do_command4_fast(int argc, char *argv[], struct xtc_handle *handle)
+{
+	struct iptables_command_state cs;
+	struct ipt_entry *e;
+	unsigned int nsaddrs = 0, ndaddrs = 0;
+	struct in_addr *saddrs = NULL, *smasks = NULL;
+	struct in_addr *daddrs = NULL, *dmasks = NULL;
+	const char *shostnetworkmask = "0.0.0.0/0", *dhostnetworkmask = "0.0.0.0/0";
+	const char *chain = NULL, *table = "filter";
+	struct fast_match fm[FAST_MAX_MATCHES], *f;
+	unsigned int nfm = 0, k;
+	struct xtables_target *text = NULL;
+	const struct xt_entry_target *tblob = NULL, *target;
+	int tstart = 0, tend = 0, twin = 0;
+	uint32_t tctx = 0;
+	struct xtables_match *m;
+	struct xtables_target *t;
+	unsigned long long cnt;
+	size_t size;
+	void *ext;
+	int i, ret;
+
+	/* Lines of tables skipped with -T have no handle */
+	if (handle == NULL)
+		return -1;
+
+	memset(&cs, 0, sizeof(cs));
+	cs.jumpto = "";
+	cs.argv = argv;
+
+	for (m = xtables_matches; m; m = m->next)
+		m->mflags = 0;
+	for (t = xtables_targets; t; t = t->next) {
+		t->tflags = 0;
+		t->used = 0;
+	}
+
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		char *val = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (strcmp(arg, "!") == 0) {
+			if (cs.invert)
+				goto fallback;
+			cs.invert = TRUE;
+			continue;
+		}
+
+		if (fast_is_opt(arg, 'f', "fragment")) {
+			set_option(&cs.options, OPT_FRAGMENT,
+				   &cs.fw.ip.invflags, cs.invert);
+			cs.fw.ip.flags |= IPT_F_FRAG;
+			cs.invert = FALSE;
+			continue;
+		}
+
+		/* Options of the extensions loaded so far */
+		if (arg[0] == '-' && arg[1] == '-' && !fast_is_base_opt(arg + 2)) {
+			int c, has_arg, first = cs.invert ? i - 1 : i;
+			bool found = false;
+
+			f = NULL;
+			for (k = 0; k < nfm; k++) {
+				m = fm[k].match;
+				if (fm[k].completed ||
+				    !fast_find_ext_opt(m->x6_options,
+						       m->extra_opts, arg + 2,
+						       &c, &has_arg))
+					continue;
+				if (found)
+					goto fallback;
+				found = true;
+				f = &fm[k];
+			}
+			if (text != NULL &&
+			    fast_find_ext_opt(text->x6_options,
+					      text->extra_opts, arg + 2,
+					      &c, &has_arg)) {
+				if (found)
+					goto fallback;
+				found = true;
+			}
+			if (!found || has_arg == optional_argument)
+				goto fallback;
+			/* more options for a fragment taken from the cache */
+			if (f != NULL ? f->blob != NULL : tblob != NULL)
+				goto fallback;
+
+			optarg = NULL;
+			if (has_arg == required_argument) {
+				if (val == NULL || strcmp(val, "!") == 0)
+					goto fallback;
+				optarg = val;
+				i++;
+			}
+			/* old-style parsers may take more words via optind */
+			optind = i + 1;
+			if (f != NULL) {
+				if (first != f->end)
+					f->cacheable = false;
+				xtables_option_mpcall(c + f->match->option_offset,
+						      argv, cs.invert, f->match,
+						      &cs.fw);
+				f->end = optind;
+			} else {
+				if (first != tend)
+					twin = 0;
+				xtables_option_tpcall(c +
+						      cs.target->option_offset,
+						      argv, cs.invert, cs.target,
+						      &cs.fw);
+				tend = optind;
+			}
+			i = optind - 1;
+			cs.invert = FALSE;
+			continue;
+		}
+
+		/* Every other option handled here takes an argument */
+		if (val == NULL)
+			goto fallback;
+
+		if (fast_is_opt(arg, 'A', "append")) {
+			if (chain != NULL || cs.invert)
+				goto fallback;
+			chain = val;
+		} else if (fast_is_opt(arg, 't', "table")) {
+			if (cs.invert)
+				goto fallback;
+			table = val;
+		} else if (fast_is_opt(arg, 'c', "set-counters")) {
+			if (i + 2 >= argc || strchr(val, ',') != NULL)
+				goto fallback;
+			set_option(&cs.options, OPT_COUNTERS,
+				   &cs.fw.ip.invflags, cs.invert);
+			if (sscanf(val, "%llu", &cnt) != 1)
+				goto fallback;
+			cs.fw.counters.pcnt = cnt;
+			if (sscanf(argv[i + 2], "%llu", &cnt) != 1)
+				goto fallback;
+			cs.fw.counters.bcnt = cnt;
+			i++;
+		} else if (fast_is_opt(arg, 'p', "protocol")) {
+			set_option(&cs.options, OPT_PROTOCOL,
+				   &cs.fw.ip.invflags, cs.invert);
+			for (cs.protocol = val; *cs.protocol; cs.protocol++)
+				*cs.protocol = tolower(*cs.protocol);
+			cs.protocol = val;
+			cs.fw.ip.proto = xtables_parse_protocol(cs.protocol);
+			if (cs.fw.ip.proto == 0
+			    && (cs.fw.ip.invflags & XT_INV_PROTO))
+				xtables_error(PARAMETER_PROBLEM,
+					   "rule would never match protocol");
+		} else if (fast_is_opt(arg, 's', "source")) {
+			set_option(&cs.options, OPT_SOURCE,
+				   &cs.fw.ip.invflags, cs.invert);
+			shostnetworkmask = val;
+		} else if (fast_is_opt(arg, 'd', "destination")) {
+			set_option(&cs.options, OPT_DESTINATION,
+				   &cs.fw.ip.invflags, cs.invert);
+			dhostnetworkmask = val;
+		} else if (fast_is_opt(arg, 'i', "in-interface")) {
+			if (*val == '\0')
+				goto fallback;
+			set_option(&cs.options, OPT_VIANAMEIN,
+				   &cs.fw.ip.invflags, cs.invert);
+			xtables_parse_interface(val, cs.fw.ip.iniface,
+						cs.fw.ip.iniface_mask);
+		} else if (fast_is_opt(arg, 'o', "out-interface")) {
+			if (*val == '\0')
+				goto fallback;
+			set_option(&cs.options, OPT_VIANAMEOUT,
+				   &cs.fw.ip.invflags, cs.invert);
+			xtables_parse_interface(val, cs.fw.ip.outiface,
+						cs.fw.ip.outiface_mask);
+#ifdef IPT_F_GOTO
+		} else if (fast_is_opt(arg, 'g', "goto")) {
+			set_option(&cs.options, OPT_JUMP,
+				   &cs.fw.ip.invflags, cs.invert);
+			cs.fw.ip.flags |= IPT_F_GOTO;
+			cs.jumpto = parse_target(val);
+#endif
+		} else if (fast_is_opt(arg, 'j', "jump")) {
+			set_option(&cs.options, OPT_JUMP,
+				   &cs.fw.ip.invflags, cs.invert);
+			cs.jumpto = parse_target(val);
+			tstart = i;
+			tend = i + 2;
+			twin = xs_parse_window(argc, argv, i,
+					       iptables_globals.orig_opts);
+			tctx = FAST_CTX(cs.fw);
+			tblob = xs_parse_cache_get(&argv[i], twin - i, tctx,
+						   &ext, NULL);
+			if (tblob != NULL) {
+				text = ext;
+				if (fast_clash(argv, i, twin, fm, nfm, NULL))
+					goto fallback;
+				i = twin - 1;
+				continue;
+			}
+			cs.target = xtables_find_target(cs.jumpto,
+							XTF_TRY_LOAD);
+			if (cs.target != NULL) {
+				size = XT_ALIGN(sizeof(struct xt_entry_target))
+					+ cs.target->size;
+				cs.target->t = xtables_calloc(1, size);
+				cs.target->t->u.target_size = size;
+				if (cs.target->real_name == NULL) {
+					strcpy(cs.target->t->u.user.name,
+					       cs.jumpto);
+				} else {
+					strcpy(cs.target->t->u.user.name,
+					       cs.target->real_name);
+					if (!(cs.target->ext_flags &
+					      XTABLES_EXT_ALIAS))
+						fprintf(stderr, "Notice: The %s target is converted into %s target "
+							"in rule listing and saving.\n",
+							cs.jumpto, cs.target->real_name);
+				}
+				cs.target->t->u.user.revision =
+					cs.target->revision;
+				xs_init_target(cs.target);
+				text = cs.target;
+			}
+		} else if (fast_is_opt(arg, 'm', "match")) {
+			if (cs.invert || nfm == FAST_MAX_MATCHES)
+				goto fallback;
+			/* naming a match again completes the earlier ones */
+			for (k = 0; k < nfm; k++)
+				if (strcmp(fm[k].match->name, val) == 0)
+					fm[k].completed = true;
+			f = &fm[nfm++];
+			memset(f, 0, sizeof(*f));
+			f->start = i;
+			f->end = i + 2;
+			f->win = xs_parse_window(argc, argv, i,
+						 iptables_globals.orig_opts);
+			f->ctx = FAST_CTX(cs.fw);
+			f->blob = xs_parse_cache_get(&argv[i], f->win - i,
+						     f->ctx, &ext, NULL);
+			if (f->blob != NULL) {
+				f->match = ext;
+				if (fast_clash(argv, i, f->win, fm, nfm - 1,
+					       text))
+					goto fallback;
+				i = f->win - 1;
+				continue;
+			}
+
+			m = xtables_find_match(val, XTF_LOAD_MUST_SUCCEED,
+					       &cs.matches);
+			size = XT_ALIGN(sizeof(struct xt_entry_match))
+				+ m->size;
+			m->m = xtables_calloc(1, size);
+			m->m->u.match_size = size;
+			if (m->real_name == NULL) {
+				strcpy(m->m->u.user.name, m->name);
+			} else {
+				strcpy(m->m->u.user.name, m->real_name);
+				if (!(m->ext_flags & XTABLES_EXT_ALIAS))
+					fprintf(stderr, "Notice: the %s match is converted into %s match "
+						"in rule listing and saving.\n", m->name, m->real_name);
+			}
+			m->m->u.user.revision = m->revision;
+			xs_init_match(m);
+			f->match = m;
+			f->cacheable = true;
+		} else {
+			goto fallback;
+		}
+		i++;
+		cs.invert = FALSE;
+	}
+
+	if (chain == NULL || cs.invert)
+		goto fallback;
+	if (strcmp(table, "nat") == 0 && strcmp(cs.jumpto, "DROP") == 0)
+		goto fallback;
+
+	/* -i/-o on chains that cannot have them, the full path says why */
+	if ((cs.options & OPT_VIANAMEOUT &&
+	     (strcmp(chain, "PREROUTING") == 0 ||
+	      strcmp(chain, "INPUT") == 0)) ||
+	    (cs.options & OPT_VIANAMEIN &&
+	     (strcmp(chain, "POSTROUTING") == 0 ||
+	      strcmp(chain, "OUTPUT") == 0)))
+		goto fallback;
+
+	/* Targets named like a chain, or neither target nor chain */
+	if (text != NULL && iptc_is_chain(cs.jumpto, handle))
+		goto fallback;
+	if (text == NULL && *cs.jumpto != '\0' &&
+	    !iptc_is_chain(cs.jumpto, handle))
+		goto fallback;
+
+	for (k = 0; k < nfm; k++)
+		if (fm[k].blob == NULL)
+			xtables_option_mfcall(fm[k].match);
+	if (cs.target != NULL)
+		xtables_option_tfcall(cs.target);
+
+	/* Keep what was parsed from a whole fragment for the next rules */
+	for (k = 0; k < nfm; k++) {
+		f = &fm[k];
+		if (f->blob != NULL || !f->cacheable || f->end != f->win)
+			continue;
+		m = f->match;
+		xs_parse_cache_put(&argv[f->start], f->win - f->start, f->ctx,
+				   m != m->next ? m :
+				   xtables_find_match(m->name, XTF_DONT_LOAD,
+						      NULL),
+				   m->mflags, m->m, m->m->u.match_size);
+	}
+	if (cs.target != NULL && tend == twin)
+		xs_parse_cache_put(&argv[tstart], twin - tstart, tctx,
+				   cs.target, cs.target->tflags, cs.target->t,
+				   cs.target->t->u.target_size);
+
+	if (text == NULL) {
+		cs.target = xtables_find_target(XT_STANDARD_TARGET,
+						XTF_LOAD_MUST_SUCCEED);
+		size = sizeof(struct xt_entry_target) + cs.target->size;
+		cs.target->t = xtables_calloc(1, size);
+		cs.target->t->u.target_size = size;
+		strcpy(cs.target->t->u.user.name, cs.jumpto);
+		if (!iptc_is_chain(cs.jumpto, handle))
+			cs.target->t->u.user.revision = cs.target->revision;
+		xs_init_target(cs.target);
+	}
+
+	xtables_ipparse_multiple(shostnetworkmask, &saddrs, &smasks, &nsaddrs);
+	xtables_ipparse_multiple(dhostnetworkmask, &daddrs, &dmasks, &ndaddrs);
+	if ((nsaddrs > 1 || ndaddrs > 1) &&
+	    (cs.fw.ip.invflags & (IPT_INV_SRCIP | IPT_INV_DSTIP)))
+		xtables_error(PARAMETER_PROBLEM, "! not allowed with multiple"
+			   " source or destination IP addresses");
+
+	/* As generate_entry(), with some blobs from the parse cache */
+	target = tblob != NULL ? tblob : cs.target->t;
+	size = sizeof(struct ipt_entry);
+	for (k = 0; k < nfm; k++)
+		size += fm[k].blob != NULL ? fm[k].blob->u.match_size :
+			fm[k].match->m->u.match_size;
+	e = xtables_malloc(size + target->u.target_size);
+	*e = cs.fw;
+	e->target_offset = size;
+	e->next_offset = size + target->u.target_size;
+	size = 0;
+	for (k = 0; k < nfm; k++) {
+		const struct xt_entry_match *em = fm[k].blob != NULL ?
+			fm[k].blob : fm[k].match->m;
+
+		memcpy(e->elems + size, em, em->u.match_size);
+		size += em->u.match_size;
+	}
+	memcpy(e->elems + size, target, target->u.target_size);
+	if (cs.target != NULL) {
+		free(cs.target->t);
+		cs.target->t = NULL;
+	}
+
+	ret = append_entry(chain, e, nsaddrs, saddrs, smasks,
+			   ndaddrs, daddrs, dmasks, 0, handle);
+
+	xtables_rule_matches_free(&cs.matches);
+	free(e);
+	free(saddrs);
+	free(smasks);
+	free(daddrs);
+	free(dmasks);
+	return ret;
+
+fallback:
+	xtables_rule_matches_free(&cs.matches);
+	if (cs.target != NULL) {
+		free(cs.target->t);
+		cs.target->t = NULL;
+	}
+	return -1;
+}
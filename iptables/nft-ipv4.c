@@ -28,7 +28,6 @@
 static int nft_ipv4_add(struct nft_rule *r, void *data)
 {
 	struct iptables_command_state *cs = data;
-	struct xtables_rule_match *matchp;
 	uint32_t op;
 
 	if (cs->fw.ip.iniface[0] != '\0')
@@ -65,10 +64,9 @@ static int nft_ipv4_add(struct nft_rule *r, void *data)
 
 	add_compat(r, cs->fw.ip.proto, cs->fw.ip.invflags);
 
-	for (matchp = cs->matches; matchp; matchp = matchp->next) {
-		if (add_match(r, matchp->match->m) < 0)
-			break;
-	}
+	if (add_matches(r, cs->matches, cs->fw.ip.proto,
+			cs->fw.ip.invflags & XT_INV_PROTO) < 0)
+		return -1;
 
 	/* Counters need to me added before the target, otherwise they are
 	 * increased for each rule because of the way nf_tables works.
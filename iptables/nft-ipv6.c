@@ -26,7 +26,6 @@
 static int nft_ipv6_add(struct nft_rule *r, void *data)
 {
 	struct iptables_command_state *cs = data;
-	struct xtables_rule_match *matchp;
 
 	if (cs->fw6.ipv6.iniface[0] != '\0')
 		add_iniface(r, cs->fw6.ipv6.iniface, cs->fw6.ipv6.invflags);
@@ -48,10 +47,9 @@ static int nft_ipv6_add(struct nft_rule *r, void *data)
 
 	add_compat(r, cs->fw6.ipv6.proto, cs->fw6.ipv6.invflags);
 
-	for (matchp = cs->matches; matchp; matchp = matchp->next) {
-		if (add_match(r, matchp->match->m) < 0)
-			break;
-	}
+	if (add_matches(r, cs->matches, cs->fw6.ipv6.proto,
+			cs->fw6.ipv6.invflags & XT_INV_PROTO) < 0)
+		return -1;
 
 	/* Counters need to me added before the target, otherwise they are
 	 * increased for each rule because of the way nf_tables works.
@@ -16,10 +16,14 @@
 #include <stdbool.h>
 #include <netdb.h>
 #include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include <xtables.h>
 
 #include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/xt_mark.h>
+#include <linux/netfilter/xt_tcpudp.h>
 
 #include <libmnl/libmnl.h>
 #include <libnftnl/rule.h>
@@ -47,7 +51,8 @@ void add_meta(struct nft_rule *r, uint32_t key)
 	nft_rule_add_expr(r, expr);
 }
 
-void add_payload(struct nft_rule *r, int offset, int len)
+static void __add_payload(struct nft_rule *r, uint32_t base, int offset,
+			  int len)
 {
 	struct nft_rule_expr *expr;
 
@@ -55,8 +60,7 @@ void add_payload(struct nft_rule *r, int offset, int len)
 	if (expr == NULL)
 		return;
 
-	nft_rule_expr_set_u32(expr, NFT_EXPR_PAYLOAD_BASE,
-			      NFT_PAYLOAD_NETWORK_HEADER);
+	nft_rule_expr_set_u32(expr, NFT_EXPR_PAYLOAD_BASE, base);
 	nft_rule_expr_set_u32(expr, NFT_EXPR_PAYLOAD_DREG, NFT_REG_1);
 	nft_rule_expr_set_u32(expr, NFT_EXPR_PAYLOAD_OFFSET, offset);
 	nft_rule_expr_set_u32(expr, NFT_EXPR_PAYLOAD_LEN, len);
@@ -64,6 +68,11 @@ void add_payload(struct nft_rule *r, int offset, int len)
 	nft_rule_add_expr(r, expr);
 }
 
+void add_payload(struct nft_rule *r, int offset, int len)
+{
+	__add_payload(r, NFT_PAYLOAD_NETWORK_HEADER, offset, len);
+}
+
 /* bitwise operation is = sreg & mask ^ xor */
 void add_bitwise_u16(struct nft_rule *r, int mask, int xor)
 {
@@ -82,6 +91,23 @@ void add_bitwise_u16(struct nft_rule *r, int mask, int xor)
 	nft_rule_add_expr(r, expr);
 }
 
+void add_bitwise_u32(struct nft_rule *r, uint32_t mask, uint32_t xor)
+{
+	struct nft_rule_expr *expr;
+
+	expr = nft_rule_expr_alloc("bitwise");
+	if (expr == NULL)
+		return;
+
+	nft_rule_expr_set_u32(expr, NFT_EXPR_BITWISE_SREG, NFT_REG_1);
+	nft_rule_expr_set_u32(expr, NFT_EXPR_BITWISE_DREG, NFT_REG_1);
+	nft_rule_expr_set_u32(expr, NFT_EXPR_BITWISE_LEN, sizeof(uint32_t));
+	nft_rule_expr_set(expr, NFT_EXPR_BITWISE_MASK, &mask, sizeof(uint32_t));
+	nft_rule_expr_set(expr, NFT_EXPR_BITWISE_XOR, &xor, sizeof(uint32_t));
+
+	nft_rule_add_expr(r, expr);
+}
+
 void add_cmp_ptr(struct nft_rule *r, uint32_t op, void *data, size_t len)
 {
 	struct nft_rule_expr *expr;
@@ -180,6 +206,143 @@ void add_proto(struct nft_rule *r, int offset, size_t len,
 	add_cmp_u8(r, proto, op);
 }
 
+static bool port_is_native(const uint16_t *pts, bool inv)
+{
+	/* Inverted ranges need two disjoint comparisons, leave them to the
+	 * compat match.
+	 */
+	if (pts[0] == pts[1])
+		return true;
+
+	return pts[0] < pts[1] && !inv;
+}
+
+static bool port_is_any(const uint16_t *pts)
+{
+	return pts[0] == 0 && pts[1] == 0xFFFF;
+}
+
+static void add_port(struct nft_rule *r, int offset, const uint16_t *pts,
+		     bool inv)
+{
+	if (port_is_any(pts) && !inv)
+		return;
+
+	__add_payload(r, NFT_PAYLOAD_TRANSPORT_HEADER, offset,
+		      sizeof(uint16_t));
+
+	if (pts[0] == pts[1]) {
+		add_cmp_u16(r, htons(pts[0]), inv ? NFT_CMP_NEQ : NFT_CMP_EQ);
+		return;
+	}
+
+	/* cmp compares in network byte order, so this is a plain range */
+	add_cmp_u16(r, htons(pts[0]), NFT_CMP_GTE);
+	add_cmp_u16(r, htons(pts[1]), NFT_CMP_LTE);
+}
+
+/* Both tcp and udp headers start with the source and destination ports */
+static int add_ports(struct nft_rule *r, const uint16_t *spts,
+		     const uint16_t *dpts, bool sinv, bool dinv)
+{
+	if (!port_is_native(spts, sinv) || !port_is_native(dpts, dinv))
+		return -1;
+
+	/* Nothing left of "-m tcp" if neither port is restricted */
+	if (port_is_any(spts) && port_is_any(dpts))
+		return -1;
+
+	add_port(r, 0, spts, sinv);
+	add_port(r, 2, dpts, dinv);
+
+	return 0;
+}
+
+static int add_nft_tcp(struct nft_rule *r, struct xt_entry_match *m)
+{
+	struct xt_tcp *tcp = (void *)m->data;
+
+	if (tcp->option || tcp->flg_mask ||
+	    tcp->invflags & ~(XT_TCP_INV_SRCPT | XT_TCP_INV_DSTPT))
+		return -1;
+
+	return add_ports(r, tcp->spts, tcp->dpts,
+			 tcp->invflags & XT_TCP_INV_SRCPT,
+			 tcp->invflags & XT_TCP_INV_DSTPT);
+}
+
+static int add_nft_udp(struct nft_rule *r, struct xt_entry_match *m)
+{
+	struct xt_udp *udp = (void *)m->data;
+
+	return add_ports(r, udp->spts, udp->dpts,
+			 udp->invflags & XT_UDP_INV_SRCPT,
+			 udp->invflags & XT_UDP_INV_DSTPT);
+}
+
+static int add_nft_mark(struct nft_rule *r, struct xt_entry_match *m)
+{
+	struct xt_mark_mtinfo1 *mark = (void *)m->data;
+
+	if (m->u.user.revision != 1)
+		return -1;
+
+	add_meta(r, NFT_META_MARK);
+	if (mark->mask != 0xffffffff)
+		add_bitwise_u32(r, mark->mask, 0);
+	add_cmp_u32(r, mark->mark, mark->invert ? NFT_CMP_NEQ : NFT_CMP_EQ);
+
+	return 0;
+}
+
+static const char *transport_match_name(uint16_t proto)
+{
+	switch (proto) {
+	case IPPROTO_TCP:
+		return "tcp";
+	case IPPROTO_UDP:
+		return "udp";
+	}
+	return NULL;
+}
+
+/*
+ * Matches with a plain nf_tables equivalent are expressed natively so the
+ * kernel does not have to go through the xt compat layer, the rest is added
+ * as compat matches. Only the first tcp/udp match of a rule is translated,
+ * so its ports can be folded back into a single match when listing.
+ */
+int add_matches(struct nft_rule *r, struct xtables_rule_match *matches,
+		uint16_t proto, bool inv_proto)
+{
+	const char *l4name = inv_proto ? NULL : transport_match_name(proto);
+	struct xtables_rule_match *matchp;
+	bool l4_seen = false;
+
+	for (matchp = matches; matchp; matchp = matchp->next) {
+		struct xt_entry_match *m = matchp->match->m;
+		int ret = -1;
+
+		if (l4name && !l4_seen && strcmp(m->u.user.name, l4name) == 0) {
+			l4_seen = true;
+			if (proto == IPPROTO_TCP)
+				ret = add_nft_tcp(r, m);
+			else
+				ret = add_nft_udp(r, m);
+		} else if (strcmp(m->u.user.name, "mark") == 0) {
+			ret = add_nft_mark(r, m);
+		}
+
+		if (ret == 0)
+			continue;
+
+		if (add_match(r, m) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
 bool is_same_interfaces(const char *a_iniface, const char *a_outiface,
 			unsigned const char *a_iniface_mask,
 			unsigned const char *a_outiface_mask,
@@ -338,6 +501,185 @@ nft_parse_match(struct nft_rule_expr *e, struct nft_rule_expr_iter *iter,
 	match->m = m;
 }
 
+static struct xt_entry_match *
+nft_native_match(const char *name, struct iptables_command_state *cs)
+{
+	struct xtables_match *match;
+	struct xt_entry_match *m;
+	size_t size;
+
+	match = xtables_find_match(name, XTF_TRY_LOAD, &cs->matches);
+	if (match == NULL)
+		return NULL;
+
+	size = XT_ALIGN(sizeof(struct xt_entry_match)) + match->size;
+
+	m = calloc(1, size);
+	if (m == NULL) {
+		fprintf(stderr, "OOM");
+		exit(EXIT_FAILURE);
+	}
+
+	m->u.match_size = size;
+	m->u.user.revision = match->revision;
+	strcpy(m->u.user.name, match->name);
+
+	match->m = m;
+
+	return m;
+}
+
+static void nft_parse_mark(struct nft_rule_expr_iter *iter,
+			   struct iptables_command_state *cs)
+{
+	struct xt_mark_mtinfo1 *mark;
+	struct xt_entry_match *m;
+	struct nft_rule_expr *e;
+	uint32_t mask = 0xffffffff;
+	const void *data;
+	const char *name;
+	uint32_t len;
+
+	e = nft_rule_expr_iter_next(iter);
+	if (e == NULL)
+		return;
+
+	name = nft_rule_expr_get_str(e, NFT_RULE_EXPR_ATTR_NAME);
+	if (strcmp(name, "bitwise") == 0) {
+		data = nft_rule_expr_get(e, NFT_EXPR_BITWISE_MASK, &len);
+		memcpy(&mask, data, sizeof(mask));
+
+		e = nft_rule_expr_iter_next(iter);
+		if (e == NULL)
+			return;
+
+		name = nft_rule_expr_get_str(e, NFT_RULE_EXPR_ATTR_NAME);
+	}
+
+	if (strcmp(name, "cmp") != 0) {
+		DEBUGP("skipping no cmp after mark\n");
+		return;
+	}
+
+	m = nft_native_match("mark", cs);
+	if (m == NULL)
+		return;
+
+	/* only revision 1 is ever translated, see add_nft_mark() */
+	if (m->u.user.revision != 1)
+		return;
+
+	mark = (void *)m->data;
+	mark->mark = nft_rule_expr_get_u32(e, NFT_EXPR_CMP_DATA);
+	mark->mask = mask;
+	if (nft_rule_expr_get_u32(e, NFT_EXPR_CMP_OP) == NFT_CMP_NEQ)
+		mark->invert = 1;
+}
+
+static void nft_parse_port(struct nft_rule_expr_iter *iter, uint16_t *pts,
+			   bool *inv)
+{
+	struct nft_rule_expr *e;
+	const char *name;
+	uint32_t op;
+
+	e = nft_rule_expr_iter_next(iter);
+	if (e == NULL)
+		return;
+
+	/* we assume correct data */
+	name = nft_rule_expr_get_str(e, NFT_RULE_EXPR_ATTR_NAME);
+	if (strcmp(name, "cmp") != 0) {
+		DEBUGP("skipping no cmp after port\n");
+		return;
+	}
+
+	op = nft_rule_expr_get_u32(e, NFT_EXPR_CMP_OP);
+	pts[0] = ntohs(nft_rule_expr_get_u16(e, NFT_EXPR_CMP_DATA));
+
+	switch (op) {
+	case NFT_CMP_NEQ:
+		*inv = true;
+		/* fall through */
+	case NFT_CMP_EQ:
+		pts[1] = pts[0];
+		break;
+	case NFT_CMP_GTE:
+		e = nft_rule_expr_iter_next(iter);
+		if (e == NULL)
+			return;
+
+		pts[1] = ntohs(nft_rule_expr_get_u16(e, NFT_EXPR_CMP_DATA));
+		break;
+	}
+}
+
+static void nft_parse_transport(struct nft_rule_expr_iter *iter,
+				uint32_t offset, int family,
+				struct iptables_command_state *cs)
+{
+	struct xtables_rule_match *matchp;
+	struct xt_entry_match *m = NULL;
+	uint16_t *pts, proto;
+	const char *name;
+	uint8_t *invflags;
+	uint8_t invflag;
+	bool inv = false;
+
+	if (family == NFPROTO_IPV6)
+		proto = cs->fw6.ipv6.proto;
+	else
+		proto = cs->fw.ip.proto;
+
+	name = transport_match_name(proto);
+	if (name == NULL) {
+		DEBUGP("unknown transport protocol %u\n", proto);
+		return;
+	}
+
+	/* source and destination port end up in the same match */
+	for (matchp = cs->matches; matchp; matchp = matchp->next) {
+		if (strcmp(matchp->match->m->u.user.name, name) == 0) {
+			m = matchp->match->m;
+			break;
+		}
+	}
+
+	if (m == NULL) {
+		m = nft_native_match(name, cs);
+		if (m == NULL)
+			return;
+
+		if (proto == IPPROTO_TCP) {
+			struct xt_tcp *tcp = (void *)m->data;
+
+			tcp->spts[1] = tcp->dpts[1] = 0xFFFF;
+		} else {
+			struct xt_udp *udp = (void *)m->data;
+
+			udp->spts[1] = udp->dpts[1] = 0xFFFF;
+		}
+	}
+
+	if (proto == IPPROTO_TCP) {
+		struct xt_tcp *tcp = (void *)m->data;
+
+		pts = offset == 0 ? tcp->spts : tcp->dpts;
+		invflags = &tcp->invflags;
+		invflag = offset == 0 ? XT_TCP_INV_SRCPT : XT_TCP_INV_DSTPT;
+	} else {
+		struct xt_udp *udp = (void *)m->data;
+
+		pts = offset == 0 ? udp->spts : udp->dpts;
+		invflags = &udp->invflags;
+		invflag = offset == 0 ? XT_UDP_INV_SRCPT : XT_UDP_INV_DSTPT;
+	}
+
+	nft_parse_port(iter, pts, &inv);
+	if (inv)
+		*invflags |= invflag;
+}
+
 void print_proto(uint16_t proto, int invert)
 {
 	const struct protoent *pent = getprotobynumber(proto);
@@ -387,6 +729,11 @@ nft_parse_meta(struct nft_rule_expr *e, struct nft_rule_expr_iter *iter,
 	struct nft_family_ops *ops = nft_family_ops_lookup(family);
 	const char *name;
 
+	if (key == NFT_META_MARK && family != NFPROTO_ARP) {
+		nft_parse_mark(iter, data);
+		return;
+	}
+
 	e = nft_rule_expr_iter_next(iter);
 	if (e == NULL)
 		return;
@@ -409,6 +756,12 @@ nft_parse_payload(struct nft_rule_expr *e, struct nft_rule_expr_iter *iter,
 
 	offset = nft_rule_expr_get_u32(e, NFT_EXPR_PAYLOAD_OFFSET);
 
+	if (nft_rule_expr_get_u32(e, NFT_EXPR_PAYLOAD_BASE) ==
+	    NFT_PAYLOAD_TRANSPORT_HEADER && family != NFPROTO_ARP) {
+		nft_parse_transport(iter, offset, family, data);
+		return;
+	}
+
 	ops->parse_payload(iter, offset, data);
 }
 
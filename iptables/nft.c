@@ -9,8 +9,10 @@
  * This code has been sponsored by Sophos Astaro <http://www.sophos.com>
  */
 
+#define _GNU_SOURCE 1 /* recvmmsg */
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdbool.h>
@@ -21,6 +23,7 @@
 #include <inttypes.h>
 
 #include <xtables.h>
+#include <iptables/internal.h>
 #include <libiptc/libxtc.h>
 #include <libiptc/xtcshared.h>
 
@@ -53,6 +56,8 @@
 
 static void *nft_fn;
 
+static void nft_rule_cache_flush(struct nft_handle *h);
+
 int mnl_talk(struct nft_handle *h, struct nlmsghdr *nlh,
 	     int (*cb)(const struct nlmsghdr *nlh, void *data),
 	     void *data)
@@ -80,58 +85,151 @@ int mnl_talk(struct nft_handle *h, struct nlmsghdr *nlh,
 	return 0;
 }
 
-static LIST_HEAD(batch_page_list);
-static int batch_num_pages;
+/* The kernel only applies a transaction that arrives in one sendmsg(), so
+ * the whole batch has to be in memory at commit time. Messages are written
+ * into the batch pages as rules are queued, and the pages are kept for the
+ * next transaction. Each page is twice the size of the previous one, up to
+ * BATCH_PAGE_ORDER_MAX, which keeps the iovec short (and below IOV_MAX) for
+ * millions of rules.
+ */
+#define BATCH_PAGE_SIZE		(getpagesize() * 32)
+#define BATCH_PAGE_ORDER_MAX	8
+
+static struct mnl_nlmsg_batch **batch_pages;
+static unsigned int batch_max_pages;
+static unsigned int batch_cur_page;
 
-struct batch_page {
-	struct list_head	head;
-	struct mnl_nlmsg_batch	*batch;
+/* Where each update in the batch came from, indexed by sequence number */
+struct batch_origin {
+	unsigned int	lineno;
+	int		type;
 };
 
-/* selected batch page is 256 Kbytes long to load ruleset of
- * half a million rules without hitting -EMSGSIZE due to large
- * iovec.
- */
-#define BATCH_PAGE_SIZE getpagesize() * 32
+static struct batch_origin *batch_origins;
+static unsigned int batch_max_origins;
+static struct nlmsghdr *batch_last_nlh;
+
+static size_t mnl_nft_batch_page_size(unsigned int i)
+{
+	if (i > BATCH_PAGE_ORDER_MAX)
+		i = BATCH_PAGE_ORDER_MAX;
+
+	return (size_t)BATCH_PAGE_SIZE << i;
+}
+
+static struct mnl_nlmsg_batch *mnl_nft_batch_page(unsigned int i)
+{
+	struct mnl_nlmsg_batch **pages;
+	char *buf;
+
+	if (i >= batch_max_pages) {
+		unsigned int max = batch_max_pages ? batch_max_pages * 2 : 16;
+
+		pages = realloc(batch_pages, max * sizeof(*pages));
+		if (pages == NULL)
+			return NULL;
+		memset(pages + batch_max_pages, 0,
+		       (max - batch_max_pages) * sizeof(*pages));
+		batch_pages = pages;
+		batch_max_pages = max;
+	}
+
+	if (batch_pages[i] == NULL) {
+		/* libmnl needs room for the message that overflows the page */
+		buf = malloc(mnl_nft_batch_page_size(i) +
+			     MNL_SOCKET_BUFFER_SIZE);
+		if (buf == NULL)
+			return NULL;
+
+		batch_pages[i] = mnl_nlmsg_batch_start(buf,
+						mnl_nft_batch_page_size(i));
+		if (batch_pages[i] == NULL) {
+			free(buf);
+			return NULL;
+		}
+	}
+
+	return batch_pages[i];
+}
 
 static struct mnl_nlmsg_batch *mnl_nft_batch_alloc(void)
 {
-	static char *buf;
+	batch_cur_page = 0;
+	return mnl_nft_batch_page(0);
+}
 
-	/* libmnl needs higher buffer to handle batch overflows */
-	buf = malloc(BATCH_PAGE_SIZE + getpagesize());
-	if (buf == NULL)
-		return NULL;
+/* Restart all pages used by the last transaction, keeping their buffers */
+static void mnl_nft_batch_recycle(struct nft_handle *h)
+{
+	unsigned int i;
+	void *buf;
 
-	return mnl_nlmsg_batch_start(buf, BATCH_PAGE_SIZE);
+	for (i = 0; i <= batch_cur_page; i++) {
+		if (batch_pages[i] == NULL)
+			continue;
+		buf = mnl_nlmsg_batch_head(batch_pages[i]);
+		mnl_nlmsg_batch_stop(batch_pages[i]);
+		batch_pages[i] = mnl_nlmsg_batch_start(buf,
+						mnl_nft_batch_page_size(i));
+		if (batch_pages[i] == NULL)
+			free(buf);
+	}
+	h->batch = mnl_nft_batch_alloc();
 }
 
-static struct mnl_nlmsg_batch *
-mnl_nft_batch_page_add(struct mnl_nlmsg_batch *batch)
+static void mnl_nft_batch_free(void)
 {
-	struct batch_page *batch_page;
+	unsigned int i;
 
-	batch_page = malloc(sizeof(struct batch_page));
-	if (batch_page == NULL)
-		return NULL;
+	for (i = 0; i < batch_max_pages; i++) {
+		if (batch_pages[i] == NULL)
+			continue;
+		free(mnl_nlmsg_batch_head(batch_pages[i]));
+		mnl_nlmsg_batch_stop(batch_pages[i]);
+	}
+	free(batch_pages);
+	batch_pages = NULL;
+	batch_max_pages = batch_cur_page = 0;
+
+	free(batch_origins);
+	batch_origins = NULL;
+	batch_max_origins = 0;
+}
 
-	batch_page->batch = batch;
-	list_add_tail(&batch_page->head, &batch_page_list);
-	batch_num_pages++;
+/* Account for the message just written at the current position */
+static int mnl_nft_batch_next(struct nft_handle *h)
+{
+	struct mnl_nlmsg_batch *next;
+	struct nlmsghdr *nlh;
 
-	return mnl_nft_batch_alloc();
+	if (mnl_nlmsg_batch_next(h->batch))
+		return 0;
+
+	/* It did not fit, move it over to the next page */
+	next = mnl_nft_batch_page(batch_cur_page + 1);
+	if (next == NULL)
+		return -1;
+
+	nlh = mnl_nlmsg_batch_current(h->batch);
+	memcpy(mnl_nlmsg_batch_current(next), nlh, nlh->nlmsg_len);
+	mnl_nlmsg_batch_next(next);
+
+	batch_cur_page++;
+	h->batch = next;
+
+	return 0;
 }
 
 static int nlbuffsiz;
 
-static void mnl_nft_set_sndbuffer(const struct mnl_socket *nl)
+static void mnl_nft_set_sndbuffer(const struct mnl_socket *nl, size_t len)
 {
 	int newbuffsiz;
 
-	if (batch_num_pages * BATCH_PAGE_SIZE <= nlbuffsiz)
+	if (len <= nlbuffsiz)
 		return;
 
-	newbuffsiz = batch_num_pages * BATCH_PAGE_SIZE;
+	newbuffsiz = len;
 
 	/* Rise sender buffer length to avoid hitting -EMSGSIZE */
 	if (setsockopt(mnl_socket_get_fd(nl), SOL_SOCKET, SO_SNDBUFFORCE,
@@ -146,58 +244,90 @@ static ssize_t mnl_nft_socket_sendmsg(const struct mnl_socket *nl)
 	static const struct sockaddr_nl snl = {
 		.nl_family = AF_NETLINK
 	};
-	struct iovec iov[batch_num_pages];
+	struct iovec iov[batch_cur_page + 1];
 	struct msghdr msg = {
 		.msg_name	= (struct sockaddr *) &snl,
 		.msg_namelen	= sizeof(snl),
 		.msg_iov	= iov,
-		.msg_iovlen	= batch_num_pages,
+		.msg_iovlen	= batch_cur_page + 1,
 	};
-	struct batch_page *batch_page, *next;
-	int i = 0;
-
-	mnl_nft_set_sndbuffer(nl);
+	size_t len = 0;
+	unsigned int i;
 
-	list_for_each_entry_safe(batch_page, next, &batch_page_list, head) {
-		iov[i].iov_base = mnl_nlmsg_batch_head(batch_page->batch);
-		iov[i].iov_len = mnl_nlmsg_batch_size(batch_page->batch);
-		i++;
+	for (i = 0; i <= batch_cur_page; i++) {
+		iov[i].iov_base = mnl_nlmsg_batch_head(batch_pages[i]);
+		iov[i].iov_len = mnl_nlmsg_batch_size(batch_pages[i]);
+		len += iov[i].iov_len;
 #ifdef NL_DEBUG
 		mnl_nlmsg_fprintf(stdout,
-				  mnl_nlmsg_batch_head(batch_page->batch),
-				  mnl_nlmsg_batch_size(batch_page->batch),
+				  mnl_nlmsg_batch_head(batch_pages[i]),
+				  mnl_nlmsg_batch_size(batch_pages[i]),
 				  sizeof(struct nfgenmsg));
 #endif
-		list_del(&batch_page->head);
-		free(batch_page->batch);
-		free(batch_page);
-		batch_num_pages--;
 	}
 
+	mnl_nft_set_sndbuffer(nl, len);
+
 	return sendmsg(mnl_socket_get_fd(nl), &msg, 0);
 }
 
+/* Only the last update in a batch asks for an acknowledgment, the kernel
+ * reports errors for the others as it processes them, in order.
+ */
+struct nft_batch_ack {
+	uint32_t	last_seq;
+	bool		done;
+	int		err;	/* first error reported by the kernel */
+	void		(*report)(uint32_t seq, int err);
+};
+
 static int cb_err(const struct nlmsghdr *nlh, void *data)
 {
-	/* We can provide better error reporting than iptables-restore */
-	errno = EINVAL;
-	return MNL_CB_ERROR;
+	const struct nlmsgerr *err = mnl_nlmsg_get_payload(nlh);
+	struct nft_batch_ack *ack = data;
+	uint32_t seq;
+
+	if (nlh->nlmsg_len < mnl_nlmsg_size(sizeof(*err))) {
+		errno = EBADMSG;
+		return MNL_CB_ERROR;
+	}
+	seq = err->msg.nlmsg_seq;
+
+	if (err->error != 0) {
+		if (ack->err == 0)
+			ack->err = -err->error;
+		ack->report(seq, -err->error);
+	}
+
+	/* An error on the batch header means nothing else was processed */
+	if (seq <= 1 || seq >= ack->last_seq)
+		ack->done = true;
+
+	return MNL_CB_OK;
 }
 
 static mnl_cb_t cb_ctl_array[NLMSG_MIN_TYPE] = {
 	[NLMSG_ERROR] = cb_err,
 };
 
-static int mnl_nft_batch_talk(struct nft_handle *h)
+#define NFT_BATCH_ACK_BUFS	16
+#define NFT_BATCH_ACK_TIMEOUT	5000	/* ms */
+
+static int mnl_nft_batch_talk(struct nft_handle *h, uint32_t last_seq,
+			      void (*report)(uint32_t seq, int err))
 {
-	int ret, fd = mnl_socket_get_fd(h->nl);
-	char rcv_buf[MNL_SOCKET_BUFFER_SIZE];
-	fd_set readfds;
-	struct timeval tv = {
-		.tv_sec		= 0,
-		.tv_usec	= 0
+	static char rcv_buf[NFT_BATCH_ACK_BUFS][MNL_SOCKET_BUFFER_SIZE];
+	struct mmsghdr msgs[NFT_BATCH_ACK_BUFS];
+	struct iovec iov[NFT_BATCH_ACK_BUFS];
+	struct nft_batch_ack ack = {
+		.last_seq	= last_seq,
+		.report		= report,
 	};
-	int err = 0;
+	struct pollfd pfd = {
+		.fd		= mnl_socket_get_fd(h->nl),
+		.events		= POLLIN,
+	};
+	int i, n, ret;
 
 	ret = mnl_nft_socket_sendmsg(h->nl);
 	if (ret == -1) {
@@ -205,47 +335,62 @@ static int mnl_nft_batch_talk(struct nft_handle *h)
 		return -1;
 	}
 
-	FD_ZERO(&readfds);
-	FD_SET(fd, &readfds);
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < NFT_BATCH_ACK_BUFS; i++) {
+		iov[i].iov_base = rcv_buf[i];
+		iov[i].iov_len = sizeof(rcv_buf[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
 
 	/* receive and digest all the acknowledgments from the kernel. */
-	ret = select(fd+1, &readfds, NULL, NULL, &tv);
-	if (ret == -1) {
-		perror("select");
-		return -1;
-	}
-	while (ret > 0 && FD_ISSET(fd, &readfds)) {
-		ret = mnl_socket_recvfrom(h->nl, rcv_buf, sizeof(rcv_buf));
-		if (ret == -1) {
-			perror("mnl_socket_recvfrom");
-			return -1;
-		}
+	while (!ack.done) {
+		n = recvmmsg(pfd.fd, msgs, NFT_BATCH_ACK_BUFS, MSG_DONTWAIT,
+			     NULL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("recvmmsg");
+				return -1;
+			}
 
-		ret = mnl_cb_run2(rcv_buf, ret, 0, h->portid,
-				  NULL, NULL, cb_ctl_array,
-				  MNL_ARRAY_SIZE(cb_ctl_array));
-		/* Continue on error, make sure we get all acknoledgments */
-		if (ret == -1)
-			err = errno;
+			ret = poll(&pfd, 1, NFT_BATCH_ACK_TIMEOUT);
+			if (ret == -1 && errno != EINTR) {
+				perror("poll");
+				return -1;
+			}
+			if (ret == 0) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			continue;
+		}
 
-		ret = select(fd+1, &readfds, NULL, NULL, &tv);
-		if (ret == -1) {
-			perror("select");
-			return -1;
+		for (i = 0; i < n; i++) {
+			ret = mnl_cb_run2(rcv_buf[i], msgs[i].msg_len, 0,
+					  h->portid, NULL, &ack, cb_ctl_array,
+					  MNL_ARRAY_SIZE(cb_ctl_array));
+			if (ret == -1) {
+				perror("mnl_cb_run2");
+				return -1;
+			}
 		}
-		FD_ZERO(&readfds);
-		FD_SET(fd, &readfds);
 	}
-	return err ? -1 : 0;
+
+	if (ack.err != 0) {
+		errno = ack.err;
+		return -1;
+	}
+	return 0;
 }
 
-static void mnl_nft_batch_put(struct mnl_nlmsg_batch *batch, int type,
-			      uint32_t seq)
+static int mnl_nft_batch_put(struct nft_handle *h, int type, uint32_t seq)
 {
 	struct nlmsghdr *nlh;
 	struct nfgenmsg *nfg;
 
-	nlh = mnl_nlmsg_put_header(mnl_nlmsg_batch_current(batch));
+	nlh = mnl_nlmsg_put_header(mnl_nlmsg_batch_current(h->batch));
 	nlh->nlmsg_type = type;
 	nlh->nlmsg_flags = NLM_F_REQUEST;
 	nlh->nlmsg_seq = seq;
@@ -255,18 +400,17 @@ static void mnl_nft_batch_put(struct mnl_nlmsg_batch *batch, int type,
 	nfg->version = NFNETLINK_V0;
 	nfg->res_id = NFNL_SUBSYS_NFTABLES;
 
-	if (!mnl_nlmsg_batch_next(batch))
-		mnl_nft_batch_page_add(batch);
+	return mnl_nft_batch_next(h);
 }
 
-static void mnl_nft_batch_begin(struct mnl_nlmsg_batch *batch, uint32_t seq)
+static int mnl_nft_batch_begin(struct nft_handle *h, uint32_t seq)
 {
-	mnl_nft_batch_put(batch, NFNL_MSG_BATCH_BEGIN, seq);
+	return mnl_nft_batch_put(h, NFNL_MSG_BATCH_BEGIN, seq);
 }
 
-static void mnl_nft_batch_end(struct mnl_nlmsg_batch *batch, uint32_t seq)
+static int mnl_nft_batch_end(struct nft_handle *h, uint32_t seq)
 {
-	mnl_nft_batch_put(batch, NFNL_MSG_BATCH_END, seq);
+	return mnl_nft_batch_put(h, NFNL_MSG_BATCH_END, seq);
 }
 
 struct builtin_table xtables_ipv4[TABLES_MAX] = {
@@ -582,12 +726,17 @@ nft_chain_builtin_init(struct nft_handle *h, const char *table,
 		ret = -1;
 		goto out;
 	}
+	if (t->chains_initialized)
+		goto out;
 	if (nft_table_builtin_add(h, t, false) < 0) {
 		/* Built-in table already initialized, skip. */
-		if (errno == EEXIST)
+		if (errno == EEXIST) {
+			t->chains_initialized = true;
 			goto out;
+		}
 	}
 	__nft_chain_builtin_init(h, t, chain, policy);
+	t->chains_initialized = true;
 out:
 	return ret;
 }
@@ -615,18 +764,20 @@ int nft_init(struct nft_handle *h, struct builtin_table *t)
 	h->portid = mnl_socket_get_portid(h->nl);
 	h->tables = t;
 
-	INIT_LIST_HEAD(&h->rule_list);
+	h->rule_cache = NULL;
 
 	h->batch = mnl_nft_batch_alloc();
+	h->batch_seq = 1;
+	h->batch_num_rules = 0;
 
 	return 0;
 }
 
 void nft_fini(struct nft_handle *h)
 {
+	nft_rule_cache_flush(h);
 	mnl_socket_close(h->nl);
-	free(mnl_nlmsg_batch_head(h->batch));
-	mnl_nlmsg_batch_stop(h->batch);
+	mnl_nft_batch_free();
 }
 
 int nft_table_add(struct nft_handle *h, const struct nft_table *t)
@@ -959,27 +1110,80 @@ enum rule_update_type {
        NFT_DO_ABORT,
 };
 
-struct rule_update {
-       struct list_head        head;
-       enum rule_update_type   type;
-       struct nft_rule	       *rule;
-};
-
+/* Serialize the update into the batch right away, the rule is released on
+ * success.
+ */
 static int rule_update_add(struct nft_handle *h, enum rule_update_type type,
 			  struct nft_rule *r)
 {
-       struct rule_update *rupd;
+	int flags = NLM_F_CREATE, msg_type;
+	struct batch_origin *origins;
+	unsigned int page;
+	struct nlmsghdr *nlh;
+
+	switch (type) {
+	case NFT_DO_APPEND:
+		msg_type = NFT_MSG_NEWRULE;
+		flags |= NLM_F_APPEND;
+		break;
+	case NFT_DO_INSERT:
+		msg_type = NFT_MSG_NEWRULE;
+		break;
+	case NFT_DO_REPLACE:
+		msg_type = NFT_MSG_NEWRULE;
+		flags |= NLM_F_REPLACE;
+		break;
+	case NFT_DO_DELETE:
+	case NFT_DO_FLUSH:
+		msg_type = NFT_MSG_DELRULE;
+		break;
+	default:
+		return -1;
+	}
 
-       rupd = calloc(1, sizeof(struct rule_update));
-       if (rupd == NULL)
-	       return -1;
+	if (h->batch == NULL)
+		return -1;
+
+	if (h->batch_seq >= batch_max_origins) {
+		unsigned int max = batch_max_origins ?
+				   batch_max_origins * 2 : 1024;
+
+		origins = realloc(batch_origins, max * sizeof(*origins));
+		if (origins == NULL)
+			return -1;
+		batch_origins = origins;
+		batch_max_origins = max;
+	}
+
+	/* Open the transaction with the first update */
+	if (h->batch_seq == 1) {
+		if (mnl_nft_batch_begin(h, h->batch_seq) < 0)
+			return -1;
+		h->batch_seq++;
+	}
+
+	page = batch_cur_page;
+	nlh = nft_rule_nlmsg_build_hdr(mnl_nlmsg_batch_current(h->batch),
+				       msg_type, h->family, flags,
+				       h->batch_seq++);
+	nft_rule_nlmsg_build_payload(nlh, r);
+	nft_rule_print_debug(r, nlh);
+
+	if (mnl_nft_batch_next(h) < 0)
+		return -1;
+
+	/* The message may have been moved to a new page */
+	if (batch_cur_page != page)
+		nlh = mnl_nlmsg_batch_head(h->batch);
+	batch_last_nlh = nlh;
 
-       rupd->rule = r;
-       rupd->type = type;
-       list_add_tail(&rupd->head, &h->rule_list);
-       h->rule_list_num++;
+	batch_origins[nlh->nlmsg_seq].lineno = h->restore ? line : 0;
+	batch_origins[nlh->nlmsg_seq].type = type;
 
-       return 0;
+	h->batch_num_rules++;
+	nft_rule_free(r);
+
+	return 0;
 }
 
 int
@@ -1192,6 +1396,234 @@ static struct nft_rule_list *nft_rule_list_get(struct nft_handle *h)
 	return list;
 }
 
+/*
+ * Rule cache for delete/check/replace. It holds the rules of one chain as
+ * dumped from the kernel, in ruleset order for lookups by rule number and
+ * hashed by a fingerprint of their expressions for lookups by rule, so a
+ * batch of -D/-C does not dump the ruleset and decode every rule for each
+ * command. It is dropped on commit/abort and on chain-level changes.
+ */
+struct nft_rule_cache_slot {
+	struct nft_rule		*rule;		/* NULL once deleted */
+	uint32_t		fp;
+	int			next;		/* next slot in bucket, or -1 */
+};
+
+struct nft_rule_cache {
+	char			*table;
+	char			*chain;
+	struct nft_rule_cache_slot *slots;
+	unsigned int		num_slots;
+	unsigned int		max_slots;
+	int			*buckets;
+	unsigned int		hash_size;
+};
+
+static uint32_t nft_fp_add(uint32_t fp, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len-- > 0) {
+		fp ^= *p++;
+		fp *= 16777619;
+	}
+	return fp;
+}
+
+static uint32_t nft_fp_str(uint32_t fp, const char *str)
+{
+	if (str == NULL)
+		return fp;
+
+	return nft_fp_add(fp, str, strlen(str) + 1);
+}
+
+static uint32_t nft_fp_attr(uint32_t fp, struct nft_rule_expr *e,
+			    uint16_t type)
+{
+	const void *data;
+	uint32_t len;
+
+	data = nft_rule_expr_get(e, type, &len);
+	if (data == NULL)
+		return fp;
+
+	return nft_fp_add(fp, data, len);
+}
+
+/*
+ * Fingerprint of the parts of a rule that ops->rule_find() compares: the
+ * expression sequence, the cmp operands, the match and target names and
+ * the verdict. Counters are skipped, and so are the match and target
+ * payloads, which the kernel may hand back with private data appended.
+ * Rules that compare equal have the same fingerprint; the converse is
+ * checked with ops->rule_find() on each hit.
+ */
+static uint32_t nft_rule_fingerprint(struct nft_rule *r)
+{
+	struct nft_rule_expr_iter *iter;
+	struct nft_rule_expr *e;
+	uint32_t fp = 2166136261U;
+
+	iter = nft_rule_expr_iter_create(r);
+	if (iter == NULL)
+		return fp;
+
+	e = nft_rule_expr_iter_next(iter);
+	while (e != NULL) {
+		const char *name =
+			nft_rule_expr_get_str(e, NFT_RULE_EXPR_ATTR_NAME);
+
+		if (strcmp(name, "counter") == 0)
+			goto next;
+
+		fp = nft_fp_str(fp, name);
+		if (strcmp(name, "cmp") == 0) {
+			fp = nft_fp_attr(fp, e, NFT_EXPR_CMP_OP);
+			fp = nft_fp_attr(fp, e, NFT_EXPR_CMP_DATA);
+		} else if (strcmp(name, "immediate") == 0) {
+			fp = nft_fp_attr(fp, e, NFT_EXPR_IMM_VERDICT);
+			fp = nft_fp_str(fp,
+				nft_rule_expr_get_str(e, NFT_EXPR_IMM_CHAIN));
+		} else if (strcmp(name, "match") == 0) {
+			fp = nft_fp_str(fp,
+				nft_rule_expr_get_str(e, NFT_EXPR_MT_NAME));
+		} else if (strcmp(name, "target") == 0) {
+			fp = nft_fp_str(fp,
+				nft_rule_expr_get_str(e, NFT_EXPR_TG_NAME));
+		}
+next:
+		e = nft_rule_expr_iter_next(iter);
+	}
+
+	nft_rule_expr_iter_destroy(iter);
+
+	return fp;
+}
+
+static void nft_rule_cache_flush(struct nft_handle *h)
+{
+	struct nft_rule_cache *cache = h->rule_cache;
+	unsigned int i;
+
+	if (cache == NULL)
+		return;
+
+	for (i = 0; i < cache->num_slots; i++) {
+		if (cache->slots[i].rule != NULL)
+			nft_rule_free(cache->slots[i].rule);
+	}
+	free(cache->slots);
+	free(cache->buckets);
+	free(cache->table);
+	free(cache->chain);
+	free(cache);
+	h->rule_cache = NULL;
+}
+
+static int nft_rule_cache_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct nft_rule_cache *cache = data;
+	struct nft_rule_cache_slot *slots;
+	struct nft_rule *r;
+
+	r = nft_rule_alloc();
+	if (r == NULL) {
+		perror("OOM");
+		return MNL_CB_OK;
+	}
+
+	if (nft_rule_nlmsg_parse(nlh, r) < 0) {
+		perror("nft_rule_nlmsg_parse");
+		goto out;
+	}
+
+	/* the dump covers every chain, only keep the one we were asked for */
+	if (strcmp(cache->table,
+		   nft_rule_attr_get_str(r, NFT_RULE_ATTR_TABLE)) != 0 ||
+	    strcmp(cache->chain,
+		   nft_rule_attr_get_str(r, NFT_RULE_ATTR_CHAIN)) != 0)
+		goto out;
+
+	if (cache->num_slots == cache->max_slots) {
+		unsigned int max = cache->max_slots ? cache->max_slots * 2 : 64;
+
+		slots = realloc(cache->slots, max * sizeof(*slots));
+		if (slots == NULL) {
+			perror("OOM");
+			goto out;
+		}
+		cache->slots = slots;
+		cache->max_slots = max;
+	}
+
+	cache->slots[cache->num_slots].rule = r;
+	cache->slots[cache->num_slots].fp = nft_rule_fingerprint(r);
+	cache->num_slots++;
+
+	return MNL_CB_OK;
+out:
+	nft_rule_free(r);
+	return MNL_CB_OK;
+}
+
+static struct nft_rule_cache *
+nft_rule_cache_get(struct nft_handle *h, const char *table, const char *chain)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nft_rule_cache *cache = h->rule_cache;
+	struct nlmsghdr *nlh;
+	unsigned int i;
+	int ret;
+
+	if (cache != NULL) {
+		if (strcmp(cache->table, table) == 0 &&
+		    strcmp(cache->chain, chain) == 0)
+			return cache;
+		nft_rule_cache_flush(h);
+	}
+
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+		return NULL;
+	h->rule_cache = cache;
+
+	cache->table = strdup(table);
+	cache->chain = strdup(chain);
+	if (cache->table == NULL || cache->chain == NULL)
+		goto err;
+
+	nlh = nft_rule_nlmsg_build_hdr(buf, NFT_MSG_GETRULE, h->family,
+					NLM_F_DUMP, h->seq);
+
+	ret = mnl_talk(h, nlh, nft_rule_cache_cb, cache);
+	if (ret < 0)
+		goto err;
+
+	cache->hash_size = 16;
+	while (cache->hash_size < cache->num_slots)
+		cache->hash_size <<= 1;
+
+	cache->buckets = malloc(cache->hash_size * sizeof(*cache->buckets));
+	if (cache->buckets == NULL)
+		goto err;
+	memset(cache->buckets, -1, cache->hash_size * sizeof(*cache->buckets));
+
+	/* link back to front so each bucket lists rules in ruleset order */
+	for (i = cache->num_slots; i-- > 0; ) {
+		struct nft_rule_cache_slot *slot = &cache->slots[i];
+		int *bucket = &cache->buckets[slot->fp & (cache->hash_size - 1)];
+
+		slot->next = *bucket;
+		*bucket = i;
+	}
+
+	return cache;
+err:
+	nft_rule_cache_flush(h);
+	return NULL;
+}
+
 int nft_rule_save(struct nft_handle *h, const char *table, bool counters)
 {
 	struct nft_rule_list *list;
@@ -1245,6 +1677,8 @@ __nft_rule_flush(struct nft_handle *h, const char *table, const char *chain)
 
 	if (rule_update_add(h, NFT_DO_FLUSH, r) < 0)
 		nft_rule_free(r);
+
+	nft_rule_cache_flush(h);
 }
 
 int nft_rule_flush(struct nft_handle *h, const char *chain, const char *table)
@@ -1333,6 +1767,8 @@ static int __nft_chain_del(struct nft_handle *h, struct nft_chain *c)
 					NLM_F_ACK, h->seq);
 	nft_chain_nlmsg_build_payload(nlh, c);
 
+	nft_rule_cache_flush(h);
+
 	return mnl_talk(h, nlh, NULL, NULL);
 }
 
@@ -1473,6 +1909,8 @@ int nft_chain_user_rename(struct nft_handle *h,const char *chain,
 	nft_chain_nlmsg_build_payload(nlh, c);
 	nft_chain_free(c);
 
+	nft_rule_cache_flush(h);
+
 	ret = mnl_talk(h, nlh, NULL, NULL);
 
 	/* the core expects 1 for success and 0 for error */
@@ -1623,12 +2061,13 @@ next:
 	return 0;
 }
 
-static int __nft_rule_del(struct nft_handle *h, struct nft_rule_list *list,
-			  struct nft_rule *r)
+static int __nft_rule_del(struct nft_handle *h,
+			  struct nft_rule_cache_slot *slot)
 {
+	struct nft_rule *r = slot->rule;
 	int ret;
 
-	nft_rule_list_del(r);
+	slot->rule = NULL;
 
 	ret = rule_update_add(h, NFT_DO_DELETE, r);
 	if (ret < 0) {
@@ -1648,71 +2087,74 @@ void nft_rule_list_destroy(struct nft_rule_list *list)
 	nft_rule_list_free(list);
 }
 
-static struct nft_rule *
-nft_rule_find(struct nft_handle *h, struct nft_rule_list *list,
-	      const char *chain, const char *table, void *data, int rulenum)
+static struct nft_rule_cache_slot *
+nft_rule_find(struct nft_handle *h, struct nft_rule_cache *cache,
+	      void *data, int rulenum)
 {
-	struct nft_rule *r;
-	struct nft_rule_list_iter *iter;
+	struct nft_rule_cache_slot *slot;
+	struct nft_rule *r = NULL;
 	int rule_ctr = 0;
-	bool found = false;
-
-	iter = nft_rule_list_iter_create(list);
-	if (iter == NULL)
-		return 0;
-
-	r = nft_rule_list_iter_next(iter);
-	while (r != NULL) {
-		const char *rule_table =
-			nft_rule_attr_get_str(r, NFT_RULE_ATTR_TABLE);
-		const char *rule_chain =
-			nft_rule_attr_get_str(r, NFT_RULE_ATTR_CHAIN);
-
-		if (strcmp(table, rule_table) != 0 ||
-		    strcmp(chain, rule_chain) != 0) {
-			DEBUGP("different chain / table\n");
-			goto next;
+	unsigned int i;
+	uint32_t fp;
+	int idx;
+
+	if (rulenum >= 0) {
+		/* Delete by rule number case */
+		for (i = 0; i < cache->num_slots; i++) {
+			if (cache->slots[i].rule == NULL)
+				continue;
+			if (rule_ctr++ == rulenum)
+				return &cache->slots[i];
 		}
+		return NULL;
+	}
 
-		if (rulenum >= 0) {
-			/* Delete by rule number case */
-			if (rule_ctr != rulenum)
-				goto next;
-			found = true;
-			break;
-		} else {
-			found = h->ops->rule_find(h->ops, r, data);
-			if (found)
-				break;
+	/* arptables compares fewer fields than it encodes, no index there */
+	if (h->family != NFPROTO_ARP)
+		r = nft_rule_new(h, cache->chain, cache->table, data);
+
+	if (r == NULL) {
+		for (i = 0; i < cache->num_slots; i++) {
+			slot = &cache->slots[i];
+			if (slot->rule != NULL &&
+			    h->ops->rule_find(h->ops, slot->rule, data))
+				return slot;
 		}
-next:
-		rule_ctr++;
-		r = nft_rule_list_iter_next(iter);
+		return NULL;
 	}
 
-	nft_rule_list_iter_destroy(iter);
+	fp = nft_rule_fingerprint(r);
+	nft_rule_free(r);
+
+	idx = cache->buckets[fp & (cache->hash_size - 1)];
+	while (idx >= 0) {
+		slot = &cache->slots[idx];
+		if (slot->rule != NULL && slot->fp == fp &&
+		    h->ops->rule_find(h->ops, slot->rule, data))
+			return slot;
+		DEBUGP("different rule\n");
+		idx = slot->next;
+	}
 
-	return found ? r : NULL;
+	return NULL;
 }
 
 int nft_rule_check(struct nft_handle *h, const char *chain,
 		   const char *table, void *data, bool verbose)
 {
-	struct nft_rule_list *list;
+	struct nft_rule_cache *cache;
 	int ret;
 
 	nft_fn = nft_rule_check;
 
-	list = nft_rule_list_create(h);
-	if (list == NULL)
+	cache = nft_rule_cache_get(h, table, chain);
+	if (cache == NULL)
 		return 0;
 
-	ret = nft_rule_find(h, list, chain, table, data, -1) ? 1 : 0;
+	ret = nft_rule_find(h, cache, data, -1) ? 1 : 0;
 	if (ret == 0)
 		errno = ENOENT;
 
-	nft_rule_list_destroy(list);
-
 	return ret;
 }
 
@@ -1720,25 +2162,23 @@ int nft_rule_delete(struct nft_handle *h, const char *chain,
 		    const char *table, void *data, bool verbose)
 {
 	int ret = 0;
-	struct nft_rule *r;
-	struct nft_rule_list *list;
+	struct nft_rule_cache_slot *slot;
+	struct nft_rule_cache *cache;
 
 	nft_fn = nft_rule_delete;
 
-	list = nft_rule_list_create(h);
-	if (list == NULL)
+	cache = nft_rule_cache_get(h, table, chain);
+	if (cache == NULL)
 		return 0;
 
-	r = nft_rule_find(h, list, chain, table, data, -1);
-	if (r != NULL) {
-		ret =__nft_rule_del(h, list, r);
+	slot = nft_rule_find(h, cache, data, -1);
+	if (slot != NULL) {
+		ret =__nft_rule_del(h, slot);
 		if (ret < 0)
 			errno = ENOMEM;
 	} else
 		errno = ENOENT;
 
-	nft_rule_list_destroy(list);
-
 	return ret;
 }
 
@@ -1767,8 +2207,8 @@ nft_rule_add(struct nft_handle *h, const char *chain,
 int nft_rule_insert(struct nft_handle *h, const char *chain,
 		    const char *table, void *data, int rulenum, bool verbose)
 {
-	struct nft_rule_list *list;
-	struct nft_rule *r;
+	struct nft_rule_cache_slot *slot;
+	struct nft_rule_cache *cache;
 	uint64_t handle = 0;
 
 	/* If built-in chains don't exist for this table, create them */
@@ -1778,54 +2218,48 @@ int nft_rule_insert(struct nft_handle *h, const char *chain,
 	nft_fn = nft_rule_insert;
 
 	if (rulenum > 0) {
-		list = nft_rule_list_create(h);
-		if (list == NULL)
-			goto err;
+		cache = nft_rule_cache_get(h, table, chain);
+		if (cache == NULL)
+			return 0;
 
-		r = nft_rule_find(h, list, chain, table, data, rulenum);
-		if (r == NULL) {
+		slot = nft_rule_find(h, cache, data, rulenum);
+		if (slot == NULL) {
 			errno = ENOENT;
-			goto err;
+			return 0;
 		}
 
-		handle = nft_rule_attr_get_u64(r, NFT_RULE_ATTR_HANDLE);
+		handle = nft_rule_attr_get_u64(slot->rule,
+					       NFT_RULE_ATTR_HANDLE);
 		DEBUGP("adding after rule handle %"PRIu64"\n", handle);
-
-		nft_rule_list_destroy(list);
 	}
 
 	return nft_rule_add(h, chain, table, data, handle, verbose);
-err:
-	nft_rule_list_destroy(list);
-	return 0;
 }
 
 int nft_rule_delete_num(struct nft_handle *h, const char *chain,
 			const char *table, int rulenum, bool verbose)
 {
 	int ret = 0;
-	struct nft_rule *r;
-	struct nft_rule_list *list;
+	struct nft_rule_cache_slot *slot;
+	struct nft_rule_cache *cache;
 
 	nft_fn = nft_rule_delete_num;
 
-	list = nft_rule_list_create(h);
-	if (list == NULL)
+	cache = nft_rule_cache_get(h, table, chain);
+	if (cache == NULL)
 		return 0;
 
-	r = nft_rule_find(h, list, chain, table, NULL, rulenum);
-	if (r != NULL) {
+	slot = nft_rule_find(h, cache, NULL, rulenum);
+	if (slot != NULL) {
 		ret = 1;
 
 		DEBUGP("deleting rule by number %d\n", rulenum);
-		ret = __nft_rule_del(h, list, r);
+		ret = __nft_rule_del(h, slot);
 		if (ret < 0)
 			errno = ENOMEM;
 	} else
 		errno = ENOENT;
 
-	nft_rule_list_destroy(list);
-
 	return ret;
 }
 
@@ -1833,17 +2267,19 @@ int nft_rule_replace(struct nft_handle *h, const char *chain,
 		     const char *table, void *data, int rulenum, bool verbose)
 {
 	int ret = 0;
+	struct nft_rule_cache_slot *slot;
+	struct nft_rule_cache *cache;
 	struct nft_rule *r;
-	struct nft_rule_list *list;
 
 	nft_fn = nft_rule_replace;
 
-	list = nft_rule_list_create(h);
-	if (list == NULL)
+	cache = nft_rule_cache_get(h, table, chain);
+	if (cache == NULL)
 		return 0;
 
-	r = nft_rule_find(h, list, chain, table, data, rulenum);
-	if (r != NULL) {
+	slot = nft_rule_find(h, cache, data, rulenum);
+	if (slot != NULL) {
+		r = slot->rule;
 		DEBUGP("replacing rule with handle=%llu\n",
 			(unsigned long long)
 			nft_rule_attr_get_u64(r, NFT_RULE_ATTR_HANDLE));
@@ -1854,8 +2290,6 @@ int nft_rule_replace(struct nft_handle *h, const char *chain,
 	} else
 		errno = ENOENT;
 
-	nft_rule_list_destroy(list);
-
 	return ret;
 }
 
@@ -2146,98 +2580,86 @@ int nft_rule_zero_counters(struct nft_handle *h, const char *chain,
 			   const char *table, int rulenum)
 {
 	struct iptables_command_state cs = {};
-	struct nft_rule_list *list;
+	struct nft_rule_cache_slot *slot;
+	struct nft_rule_cache *cache;
 	struct nft_rule *r;
-	int ret = 0;
 
 	nft_fn = nft_rule_delete;
 
-	list = nft_rule_list_create(h);
-	if (list == NULL)
+	cache = nft_rule_cache_get(h, table, chain);
+	if (cache == NULL)
 		return 0;
 
-	r = nft_rule_find(h, list, chain, table, NULL, rulenum);
-	if (r == NULL) {
+	slot = nft_rule_find(h, cache, NULL, rulenum);
+	if (slot == NULL) {
 		errno = ENOENT;
-		ret = 1;
-		goto error;
+		return 1;
 	}
+	r = slot->rule;
 
 	nft_rule_to_iptables_command_state(r, &cs);
 
 	cs.counters.pcnt = cs.counters.bcnt = 0;
 
-	ret =  nft_rule_append(h, chain, table, &cs,
+	return nft_rule_append(h, chain, table, &cs,
 			       nft_rule_attr_get_u64(r, NFT_RULE_ATTR_HANDLE),
 			       false);
-
-error:
-	nft_rule_list_destroy(list);
-
-	return ret;
 }
 
-static int nft_action(struct nft_handle *h, int action)
+static void nft_batch_report(uint32_t seq, int err)
 {
-	int flags = NLM_F_CREATE, type;
-	struct rule_update *n, *tmp;
-	struct nlmsghdr *nlh;
-	uint32_t seq = 1;
-	int ret;
+	static const char *const update_name[] = {
+		[NFT_DO_APPEND]		= "append",
+		[NFT_DO_INSERT]		= "insert",
+		[NFT_DO_REPLACE]	= "replace",
+		[NFT_DO_DELETE]		= "delete",
+		[NFT_DO_FLUSH]		= "flush",
+	};
+	const struct batch_origin *o;
 
-	mnl_nft_batch_begin(h->batch, seq++);
+	/* Errors on the batch itself are left to the caller */
+	if (seq < 2 || seq > batch_last_nlh->nlmsg_seq ||
+	    batch_origins[seq].lineno == 0)
+		return;
 
-	list_for_each_entry_safe(n, tmp, &h->rule_list, head) {
-		switch (n->type) {
-		case NFT_DO_APPEND:
-			type = NFT_MSG_NEWRULE;
-			flags |= NLM_F_APPEND;
-			break;
-		case NFT_DO_INSERT:
-			type = NFT_MSG_NEWRULE;
-			break;
-		case NFT_DO_REPLACE:
-			type = NFT_MSG_NEWRULE;
-			flags |= NLM_F_REPLACE;
-			break;
-		case NFT_DO_DELETE:
-		case NFT_DO_FLUSH:
-			type = NFT_MSG_DELRULE;
-			break;
-		default:
-			return 0;
-		}
+	o = &batch_origins[seq];
+	fprintf(stderr, "%s: line %u: rule %s failed: %s\n",
+		xt_params->program_name, o->lineno, update_name[o->type],
+		strerror(err));
+}
 
-		nlh = nft_rule_nlmsg_build_hdr(mnl_nlmsg_batch_current(h->batch),
-					       type, h->family, flags, seq++);
-		nft_rule_nlmsg_build_payload(nlh, n->rule);
-		nft_rule_print_debug(n->rule, nlh);
+static int nft_action(struct nft_handle *h, int action)
+{
+	uint32_t last_seq;
+	int ret = 0;
 
-		h->rule_list_num--;
-		list_del(&n->head);
-		nft_rule_free(n->rule);
-		free(n);
+	nft_rule_cache_flush(h);
 
-		if (!mnl_nlmsg_batch_next(h->batch))
-			h->batch = mnl_nft_batch_page_add(h->batch);
-	}
+	if (h->batch_num_rules == 0)
+		goto out;
 
 	switch (action) {
 	case NFT_DO_COMMIT:
-		mnl_nft_batch_end(h->batch, seq++);
+		/* Have the kernel tell us when it is done with the batch */
+		batch_last_nlh->nlmsg_flags |= NLM_F_ACK;
+		last_seq = batch_last_nlh->nlmsg_seq;
+
+		ret = mnl_nft_batch_end(h, h->batch_seq++);
+		if (ret < 0)
+			break;
+
+		ret = mnl_nft_batch_talk(h, last_seq, nft_batch_report);
+		if (ret < 0)
+			perror("mnl_nft_batch_talk:");
 		break;
 	case NFT_DO_ABORT:
+		/* Nothing has been sent yet, just drop the batch */
 		break;
 	}
-
-	if (!mnl_nlmsg_batch_is_empty(h->batch))
-		h->batch = mnl_nft_batch_page_add(h->batch);
-
-	ret = mnl_nft_batch_talk(h);
-	if (ret < 0)
-		perror("mnl_nft_batch_talk:");
-
-	mnl_nlmsg_batch_reset(h->batch);
+out:
+	mnl_nft_batch_recycle(h);
+	h->batch_seq = 1;
+	h->batch_num_rules = 0;
 
 	return ret == 0 ? 1 : 0;
 }
@@ -2374,36 +2796,111 @@ static void xtables_config_perror(uint32_t flags, const char *fmt, ...)
 	va_end(args);
 }
 
+/*
+ * xtables.conf is parsed once per process, the lists are kept around for
+ * every handle and every later call.
+ */
+static struct {
+	char			*filename;
+	int			err;
+	struct nft_table_list	*table_list;
+	struct nft_chain_list	*chain_list;
+} xtables_config;
+
+static int xtables_config_get(const char *filename, uint32_t flags)
+{
+	if (xtables_config.filename == NULL ||
+	    strcmp(xtables_config.filename, filename) != 0) {
+		if (xtables_config.table_list != NULL)
+			nft_table_list_free(xtables_config.table_list);
+		if (xtables_config.chain_list != NULL)
+			nft_chain_list_free(xtables_config.chain_list);
+		free(xtables_config.filename);
+
+		xtables_config.filename = strdup(filename);
+		xtables_config.table_list = nft_table_list_alloc();
+		xtables_config.chain_list = nft_chain_list_alloc();
+		xtables_config.err = 0;
+
+		if (xtables_config.filename == NULL ||
+		    xtables_config.table_list == NULL ||
+		    xtables_config.chain_list == NULL)
+			xtables_config.err = ENOMEM;
+		else if (xtables_config_parse(xtables_config.filename,
+					      xtables_config.table_list,
+					      xtables_config.chain_list) < 0)
+			xtables_config.err = errno;
+	}
+
+	if (xtables_config.err == 0)
+		return 0;
+
+	if (xtables_config.err == ENOENT) {
+		xtables_config_perror(flags,
+			"configuration file `%s' does not exists\n",
+			filename);
+	} else {
+		xtables_config_perror(flags,
+			"Fatal error parsing config file: %s\n",
+			 strerror(xtables_config.err));
+	}
+	errno = xtables_config.err;
+	return -1;
+}
+
+static bool nft_table_list_find(struct nft_table_list *list, const char *name)
+{
+	struct nft_table_list_iter *iter;
+	struct nft_table *t;
+	bool found = false;
+
+	iter = nft_table_list_iter_create(list);
+	if (iter == NULL)
+		return false;
+
+	t = nft_table_list_iter_next(iter);
+	while (t != NULL) {
+		const char *this_tablename =
+			nft_table_attr_get(t, NFT_TABLE_ATTR_NAME);
+
+		if (strcmp(name, this_tablename) == 0) {
+			found = true;
+			break;
+		}
+		t = nft_table_list_iter_next(iter);
+	}
+	nft_table_list_iter_destroy(iter);
+
+	return found;
+}
+
 int nft_xtables_config_load(struct nft_handle *h, const char *filename,
 			    uint32_t flags)
 {
-	struct nft_table_list *table_list = nft_table_list_alloc();
-	struct nft_chain_list *chain_list = nft_chain_list_alloc();
+	struct nft_table_list *table_list = NULL;
+	struct nft_chain_list *chain_list = NULL;
 	struct nft_table_list_iter *titer = NULL;
 	struct nft_chain_list_iter *citer = NULL;
 	struct nft_table *table;
 	struct nft_chain *chain;
 	uint32_t table_family, chain_family;
 	bool found = false;
+	int ret = -1;
 
-	if (h->restore)
+	if (h->restore || h->config_loaded)
 		return 0;
 
-	if (xtables_config_parse(filename, table_list, chain_list) < 0) {
-		if (errno == ENOENT) {
-			xtables_config_perror(flags,
-				"configuration file `%s' does not exists\n",
-				filename);
-		} else {
-			xtables_config_perror(flags,
-				"Fatal error parsing config file: %s\n",
-				 strerror(errno));
-		}
+	if (xtables_config_get(filename, flags) < 0)
+		return -1;
+
+	/* Only create what the kernel does not have yet */
+	table_list = nft_table_list_get(h);
+	chain_list = nft_chain_list_get(h);
+	if (table_list == NULL || chain_list == NULL)
 		goto err;
-	}
 
 	/* Stage 1) create tables */
-	titer = nft_table_list_iter_create(table_list);
+	titer = nft_table_list_iter_create(xtables_config.table_list);
 	while ((table = nft_table_list_iter_next(titer)) != NULL) {
 		table_family = nft_table_attr_get_u32(table,
 						      NFT_TABLE_ATTR_FAMILY);
@@ -2412,73 +2909,81 @@ int nft_xtables_config_load(struct nft_handle *h, const char *filename,
 
 		found = true;
 
-		if (nft_table_add(h, table) < 0) {
-			if (errno == EEXIST) {
-				xtables_config_perror(flags,
-					"table `%s' already exists, skipping\n",
-					(char *)nft_table_attr_get(table, NFT_TABLE_ATTR_NAME));
-			} else {
-				xtables_config_perror(flags,
-					"table `%s' cannot be create, reason `%s'. Exitting\n",
-					(char *)nft_table_attr_get(table, NFT_TABLE_ATTR_NAME),
-					strerror(errno));
-				goto err;
-			}
+		if (nft_table_list_find(table_list,
+				nft_table_attr_get(table, NFT_TABLE_ATTR_NAME)))
+			errno = EEXIST;
+		else if (nft_table_add(h, table) == 0) {
+			xtables_config_perror(flags,
+				"table `%s' has been created\n",
+				(char *)nft_table_attr_get(table, NFT_TABLE_ATTR_NAME));
 			continue;
 		}
-		xtables_config_perror(flags, "table `%s' has been created\n",
-			(char *)nft_table_attr_get(table, NFT_TABLE_ATTR_NAME));
+
+		if (errno == EEXIST) {
+			xtables_config_perror(flags,
+				"table `%s' already exists, skipping\n",
+				(char *)nft_table_attr_get(table, NFT_TABLE_ATTR_NAME));
+		} else {
+			xtables_config_perror(flags,
+				"table `%s' cannot be create, reason `%s'. Exitting\n",
+				(char *)nft_table_attr_get(table, NFT_TABLE_ATTR_NAME),
+				strerror(errno));
+			goto err;
+		}
 	}
 	nft_table_list_iter_destroy(titer);
-	nft_table_list_free(table_list);
+	titer = NULL;
 
 	if (!found)
 		goto err;
 
 	/* Stage 2) create chains */
-	citer = nft_chain_list_iter_create(chain_list);
+	citer = nft_chain_list_iter_create(xtables_config.chain_list);
 	while ((chain = nft_chain_list_iter_next(citer)) != NULL) {
 		chain_family = nft_chain_attr_get_u32(chain,
 						      NFT_CHAIN_ATTR_TABLE);
 		if (h->family != chain_family)
 			continue;
 
-		if (nft_chain_add(h, chain) < 0) {
-			if (errno == EEXIST) {
-				xtables_config_perror(flags,
-					"chain `%s' already exists in table `%s', skipping\n",
-					(char *)nft_chain_attr_get(chain, NFT_CHAIN_ATTR_NAME),
-					(char *)nft_chain_attr_get(chain, NFT_CHAIN_ATTR_TABLE));
-			} else {
-				xtables_config_perror(flags,
-					"chain `%s' cannot be create, reason `%s'. Exitting\n",
-					(char *)nft_chain_attr_get(chain, NFT_CHAIN_ATTR_NAME),
-					strerror(errno));
-				goto err;
-			}
+		if (nft_chain_list_find(chain_list,
+				nft_chain_attr_get(chain, NFT_CHAIN_ATTR_TABLE),
+				nft_chain_attr_get(chain, NFT_CHAIN_ATTR_NAME)))
+			errno = EEXIST;
+		else if (nft_chain_add(h, chain) == 0) {
+			xtables_config_perror(flags,
+				"chain `%s' in table `%s' has been created\n",
+				(char *)nft_chain_attr_get(chain, NFT_CHAIN_ATTR_NAME),
+				(char *)nft_chain_attr_get(chain, NFT_CHAIN_ATTR_TABLE));
 			continue;
 		}
 
-		xtables_config_perror(flags,
-			"chain `%s' in table `%s' has been created\n",
-			(char *)nft_chain_attr_get(chain, NFT_CHAIN_ATTR_NAME),
-			(char *)nft_chain_attr_get(chain, NFT_CHAIN_ATTR_TABLE));
+		if (errno == EEXIST) {
+			xtables_config_perror(flags,
+				"chain `%s' already exists in table `%s', skipping\n",
+				(char *)nft_chain_attr_get(chain, NFT_CHAIN_ATTR_NAME),
+				(char *)nft_chain_attr_get(chain, NFT_CHAIN_ATTR_TABLE));
+		} else {
+			xtables_config_perror(flags,
+				"chain `%s' cannot be create, reason `%s'. Exitting\n",
+				(char *)nft_chain_attr_get(chain, NFT_CHAIN_ATTR_NAME),
+				strerror(errno));
+			goto err;
+		}
 	}
-	nft_chain_list_iter_destroy(citer);
-	nft_chain_list_free(chain_list);
-
-	return 0;
 
+	h->config_loaded = true;
+	ret = 0;
 err:
-	nft_table_list_free(table_list);
-	nft_chain_list_free(chain_list);
-
 	if (titer != NULL)
 		nft_table_list_iter_destroy(titer);
 	if (citer != NULL)
 		nft_chain_list_iter_destroy(citer);
+	if (table_list != NULL)
+		nft_table_list_free(table_list);
+	if (chain_list != NULL)
+		nft_chain_list_free(chain_list);
 
-	return -1;
+	return ret;
 }
 
 int nft_chain_zero_counters(struct nft_handle *h, const char *chain, 
@@ -23,18 +23,23 @@ struct builtin_table {
 	const char *name;
 	struct builtin_chain chains[NF_INET_NUMHOOKS];
 	bool initialized;
+	bool chains_initialized;
 };
 
+struct nft_rule_cache;
+
 struct nft_handle {
 	int			family;
 	struct mnl_socket	*nl;
 	uint32_t		portid;
 	uint32_t		seq;
-	struct list_head	rule_list;
-	int			rule_list_num;
 	struct mnl_nlmsg_batch	*batch;
+	uint32_t		batch_seq;
+	unsigned int		batch_num_rules;
 	struct nft_family_ops	*ops;
 	struct builtin_table	*tables;
+	struct nft_rule_cache	*rule_cache;
+	bool			config_loaded;
 	bool			restore;
 };
 
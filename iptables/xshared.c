@@ -1,20 +1,25 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <limits.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
-#include <sys/un.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <xtables.h>
+#include <iptables/internal.h>
+#include <libiptc/xtcshared.h>
 #include "xshared.h"
 
-#define XT_SOCKET_NAME "xtables"
-#define XT_SOCKET_LEN 8
-
 /*
  * Print out any special helps. A user might like to be able to add a --help
  * to the commandline, and see expected results. So we call help for all
@@ -43,15 +48,27 @@ void print_extension_helps(const struct xtables_target *t,
 	}
 }
 
+/*
+ * getprotobynumber() rereads /etc/protocols on every call, which is most
+ * of the cost of listing a large ruleset, so remember what it said.
+ */
 const char *
 proto_to_name(uint8_t proto, int nolookup)
 {
+	static char *names[UINT8_MAX + 1];
+	static bool looked_up[UINT8_MAX + 1];
 	unsigned int i;
 
 	if (proto && !nolookup) {
-		struct protoent *pent = getprotobynumber(proto);
-		if (pent)
-			return pent->p_name;
+		if (!looked_up[proto]) {
+			struct protoent *pent = getprotobynumber(proto);
+
+			if (pent != NULL)
+				names[proto] = strdup(pent->p_name);
+			looked_up[proto] = true;
+		}
+		if (names[proto] != NULL)
+			return names[proto];
 	}
 
 	for (i = 0; xtables_chain_protos[i].name != NULL; ++i)
@@ -243,29 +260,696 @@ void xs_init_match(struct xtables_match *match)
 		match->init(match->m);
 }
 
-bool xtables_lock(bool wait)
+/*
+ * The xtables lock is a set of record locks on XT_LOCK_NAME:
+ *
+ *   [0, 4)        ticket counter, locked only while drawing a ticket
+ *   4             the lock proper
+ *   5 + n         queue slot of ticket n, held from drawing the ticket
+ *                 until exit
+ *
+ * A waiter sleeps in F_SETLKW on the slot of the ticket before its own,
+ * so the kernel wakes it the moment its predecessor is gone, and the lock
+ * is passed on in the order the waiters arrived. The lock byte itself is
+ * what excludes, the queue only orders; a predecessor that gave up early
+ * just lets its successor contend a little sooner. Record locks are
+ * dropped by the kernel on exit and are not inherited by modprobe.
+ */
+#ifndef XT_LOCK_NAME
+#define XT_LOCK_NAME	"/run/xtables.lock"
+#endif
+#define XT_LOCK_TICKET	0
+#define XT_LOCK_BYTE	4
+#define XT_LOCK_QUEUE	5
+#define XT_LOCK_SLOTS	(1U << 20)
+
+static struct timespec xt_lock_start, xt_lock_taken;
+
+static void xt_lock_alarm(int sig)
+{
+}
+
+static int xt_lock_range(int fd, int cmd, short type, off_t start, off_t len)
+{
+	struct flock fl = {
+		.l_type   = type,
+		.l_whence = SEEK_SET,
+		.l_start  = start,
+		.l_len    = len,
+	};
+
+	return fcntl(fd, cmd, &fl);
+}
+
+static int xt_lock_slot(int fd, int cmd, short type, uint32_t ticket)
+{
+	return xt_lock_range(fd, cmd, type,
+			     XT_LOCK_QUEUE + ticket % XT_LOCK_SLOTS, 1);
+}
+
+static long xt_lock_msecs(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000 +
+	       (b->tv_nsec - a->tv_nsec) / 1000000;
+}
+
+static void xt_lock_report(void)
 {
-	int i = 0, ret, xt_socket;
-	struct sockaddr_un xt_addr;
+	struct timespec now;
+	long w, h;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	w = xt_lock_msecs(&xt_lock_start, &xt_lock_taken);
+	h = xt_lock_msecs(&xt_lock_taken, &now);
+	fprintf(stderr, "xtables lock: waited %ld.%03lds, held %ld.%03lds\n",
+		w / 1000, w % 1000, h / 1000, h % 1000);
+}
+
+/* Take a ticket and wait for the holder of the one before it to leave. */
+static int xt_lock_queue(int fd)
+{
+	uint32_t ticket = 0;
+
+	if (xt_lock_range(fd, F_SETLKW, F_WRLCK, XT_LOCK_TICKET, 4) < 0)
+		return -1;
+	if (pread(fd, &ticket, sizeof(ticket), XT_LOCK_TICKET) !=
+	    sizeof(ticket))
+		ticket = 0;
+	++ticket;
+	if (pwrite(fd, &ticket, sizeof(ticket), XT_LOCK_TICKET) !=
+	    sizeof(ticket) ||
+	    xt_lock_slot(fd, F_SETLK, F_WRLCK, ticket) < 0) {
+		xt_lock_range(fd, F_SETLK, F_UNLCK, XT_LOCK_TICKET, 4);
+		return 0;	/* no place in the queue, just contend */
+	}
+	xt_lock_range(fd, F_SETLK, F_UNLCK, XT_LOCK_TICKET, 4);
+
+	if (xt_lock_slot(fd, F_SETLKW, F_WRLCK, ticket - 1) < 0)
+		return -1;
+	xt_lock_slot(fd, F_SETLK, F_UNLCK, ticket - 1);
+	return 0;
+}
 
-	memset(&xt_addr, 0, sizeof(xt_addr));
-	xt_addr.sun_family = AF_UNIX;
-	strcpy(xt_addr.sun_path+1, XT_SOCKET_NAME);
-	xt_socket = socket(AF_UNIX, SOCK_STREAM, 0);
-	/* If we can't even create a socket, fall back to prior (lockless) behavior */
-	if (xt_socket < 0)
+/*
+ * Acquire the xtables lock. @wait is the number of seconds to wait for it,
+ * 0 to fail at once if it is taken, or -1 to wait for as long as it takes.
+ * With @report, the time spent waiting for and holding the lock is printed
+ * at exit.
+ */
+bool xtables_lock(int wait, bool report)
+{
+	struct sigaction sa = { .sa_handler = xt_lock_alarm }, old;
+	bool ret = false;
+	int fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &xt_lock_start);
+	fd = open(XT_LOCK_NAME, O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+	/* If we can't even create the lock file, fall back to lockless */
+	if (fd < 0)
 		return true;
 
-	while (1) {
-		ret = bind(xt_socket, (struct sockaddr*)&xt_addr,
-			   offsetof(struct sockaddr_un, sun_path)+XT_SOCKET_LEN);
-		if (ret == 0)
-			return true;
-		else if (wait == false)
+	if (wait == 0) {
+		ret = xt_lock_range(fd, F_SETLK, F_WRLCK, XT_LOCK_BYTE, 1) == 0;
+		goto out;
+	}
+
+	/* No SA_RESTART, so that the alarm breaks F_SETLKW with EINTR */
+	if (wait > 0) {
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGALRM, &sa, &old);
+		alarm(wait);
+	}
+	ret = xt_lock_queue(fd) == 0 &&
+	      xt_lock_range(fd, F_SETLKW, F_WRLCK, XT_LOCK_BYTE, 1) == 0;
+	if (wait > 0) {
+		alarm(0);
+		sigaction(SIGALRM, &old, NULL);
+	}
+out:
+	if (!ret) {
+		close(fd);
+		return false;
+	}
+	/* fd stays open, the locks go away with the process */
+	clock_gettime(CLOCK_MONOTONIC, &xt_lock_taken);
+	if (report)
+		atexit(xt_lock_report);
+	return true;
+}
+
+void xs_lock_failed(int wait)
+{
+	fprintf(stderr, "Another app is currently holding the xtables lock. ");
+	if (wait == 0)
+		fprintf(stderr, "Perhaps you want to use the -w option?\n");
+	else
+		fprintf(stderr, "Stopped waiting after %ds.\n", wait);
+	xtables_free_opts(1);
+	exit(RESOURCE_PROBLEM);
+}
+
+/* Parse the optional seconds argument of -w, as "-w5", "--wait=5" or "-w 5". */
+int xs_parse_wait(int argc, char **argv)
+{
+	const char *arg = optarg;
+	unsigned int secs;
+
+	if (arg == NULL && optind < argc &&
+	    argv[optind][0] >= '0' && argv[optind][0] <= '9')
+		arg = argv[optind++];
+	if (arg == NULL)
+		return -1;
+	if (!xtables_strtoui(arg, NULL, &secs, 0, INT_MAX))
+		xtables_error(PARAMETER_PROBLEM,
+			      "wait seconds not numeric: \"%s\"", arg);
+	return secs;
+}
+
+/*
+ * Batch mode: run iptables command lines read from a file against one
+ * handle per table, committing them all at COMMIT lines and at the end.
+ */
+#define XS_BATCH_MAXARGS	255
+
+struct xs_batch_table {
+	char name[XT_TABLE_MAXNAMELEN];
+	struct xtc_handle *handle;
+};
+
+static struct xs_batch_table *batch_tables;
+static unsigned int batch_num_tables;
+
+/* Split `buf' in place into words, as iptables-restore reads them: on
+ * white space, except inside double quotes, where a backslash escapes
+ * the next character.  Empty words ("") are dropped.  Stores at most
+ * `max' words plus a terminating NULL in argv and returns their number. */
+int xs_split_line(char *buf, char **argv, int max)
+{
+	char *in = buf, *out = buf;
+	int argc = 0;
+
+	for (;;) {
+		bool quoted = false;
+
+		while (*in == ' ' || *in == '\t' || *in == '\n')
+			in++;
+		if (*in == '\0')
+			break;
+
+		if (argc == max)
+			xtables_error(PARAMETER_PROBLEM,
+				   "Parser cannot handle more arguments\n");
+		argv[argc] = out;
+
+		for (; *in != '\0'; in++) {
+			if (quoted && *in == '\\' && in[1] != '\0') {
+				*out++ = *++in;
+			} else if (*in == '"') {
+				quoted = !quoted;
+			} else if (!quoted &&
+				   (*in == ' ' || *in == '\t' || *in == '\n')) {
+				in++;
+				break;
+			} else {
+				*out++ = *in;
+			}
+		}
+		if (out != argv[argc])
+			argc++;
+		*out++ = '\0';
+	}
+
+	argv[argc] = NULL;
+	return argc;
+}
+
+/* The table a command line works on, as do_command would see it */
+static const char *xs_batch_table(int argc, char **argv)
+{
+	const char *table = "filter";
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-t") == 0 ||
+		     strcmp(argv[i], "--table") == 0) && i + 1 < argc)
+			table = argv[++i];
+		else if (strncmp(argv[i], "--table=", 8) == 0)
+			table = argv[i] + 8;
+		else if (strncmp(argv[i], "-t", 2) == 0 && argv[i][2] != '\0')
+			table = argv[i] + 2;
+	}
+	return table;
+}
+
+static struct xtc_handle **xs_batch_handle(const char *table)
+{
+	struct xs_batch_table *t;
+	unsigned int i;
+
+	if (strlen(table) >= XT_TABLE_MAXNAMELEN)
+		xtables_error(PARAMETER_PROBLEM, "table name `%s' too long",
+			      table);
+
+	for (i = 0; i < batch_num_tables; i++)
+		if (strcmp(batch_tables[i].name, table) == 0)
+			return &batch_tables[i].handle;
+
+	t = realloc(batch_tables, (batch_num_tables + 1) * sizeof(*t));
+	if (t == NULL)
+		xtables_error(RESOURCE_PROBLEM, "malloc");
+	batch_tables = t;
+	t = &batch_tables[batch_num_tables++];
+	strcpy(t->name, table);
+	t->handle = NULL;
+	return &t->handle;
+}
+
+static void xs_batch_commit(const struct xtc_ops *ops)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch_num_tables; i++) {
+		struct xs_batch_table *t = &batch_tables[i];
+
+		if (t->handle == NULL)
+			continue;
+		if (!ops->commit(t->handle)) {
+			fprintf(stderr, "%s: line %d: commit of table `%s' "
+				"failed: %s.\n", xt_params->program_name,
+				line, t->name, ops->strerror(errno));
+			exit(errno == EAGAIN ? RESOURCE_PROBLEM : 1);
+		}
+		ops->free(t->handle);
+		t->handle = NULL;
+	}
+}
+
+int xs_batch_main(int argc, char *argv[], const struct xtc_ops *ops,
+		  xs_command_t do_command)
+{
+	char *buf = NULL, *args[XS_BATCH_MAXARGS + 1];
+	const char *file = NULL;
+	int wait = 0;
+	size_t bufsz = 0;
+	FILE *in = stdin;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-w") == 0 ||
+		    strcmp(argv[i], "--wait") == 0) {
+			optarg = NULL;
+			optind = i + 1;
+			wait = xs_parse_wait(argc, argv);
+			i = optind - 1;
+		} else if (strncmp(argv[i], "-w", 2) == 0) {
+			optarg = argv[i] + 2;
+			wait = xs_parse_wait(argc, argv);
+		} else if (strncmp(argv[i], "--wait=", 7) == 0) {
+			optarg = argv[i] + 7;
+			wait = xs_parse_wait(argc, argv);
+		} else if (file == NULL)
+			file = argv[i];
+		else
+			xtables_error(PARAMETER_PROBLEM,
+				      "Usage: %s --batch [--wait [seconds]] [file]",
+				      xt_params->program_name);
+	}
+
+	if (file != NULL && strcmp(file, "-") != 0) {
+		in = fopen(file, "re");
+		if (in == NULL) {
+			fprintf(stderr, "Can't open %s: %s\n", file,
+				strerror(errno));
+			exit(1);
+		}
+	}
+
+	/* One lock for the whole batch, do_command does not take it */
+	if (!xtables_lock(wait, false))
+		xs_lock_failed(wait);
+
+	line = 0;
+	while (getline(&buf, &bufsz, in) != -1) {
+		struct xtc_handle **handle;
+		char *table;
+		int nargs;
+
+		line++;
+		nargs = xs_split_line(buf, args + 1, XS_BATCH_MAXARGS - 1);
+		if (nargs == 0 || args[1][0] == '#')
+			continue;
+		if (nargs == 1 && strcmp(args[1], "COMMIT") == 0) {
+			xs_batch_commit(ops);
+			continue;
+		}
+
+		args[0] = (char *)xt_params->program_name;
+		table = (char *)xs_batch_table(nargs + 1, args);
+		handle = xs_batch_handle(table);
+
+		if (!do_command(nargs + 1, args, &table, handle, true)) {
+			fprintf(stderr, "%s: line %d: %s.\n",
+				xt_params->program_name, line,
+				ops->strerror(errno));
+			exit(errno == EAGAIN ? RESOURCE_PROBLEM : 1);
+		}
+	}
+	if (ferror(in)) {
+		fprintf(stderr, "%s: read error: %s\n",
+			xt_params->program_name, strerror(errno));
+		exit(1);
+	}
+
+	xs_batch_commit(ops);
+
+	free(buf);
+	free(batch_tables);
+	if (in != stdin)
+		fclose(in);
+	return 0;
+}
+
+/*
+ * Parse cache for restore: the match or target blob built from a run of
+ * words ("-m name --opt arg ...") is kept, keyed by those words and by
+ * the protocol fields of the entry the parser saw, so that a ruleset
+ * repeating the same fragment parses it only once.  Entries live until
+ * the process exits.
+ */
+struct xs_parse_entry {
+	struct xs_parse_entry *next;
+	uint32_t hash;
+	uint32_t ctx;
+	unsigned int nwords;
+	size_t keylen;
+	void *ext;
+	unsigned int flags;
+	void *blob;
+	char key[];
+};
+
+bool xs_parse_cache_enabled;
+static struct xs_parse_entry **parse_cache;
+static unsigned int parse_cache_size, parse_cache_count;
+static unsigned int parse_cache_lookups, parse_cache_hits;
+
+static uint32_t xs_parse_hash(char **words, unsigned int nwords, uint32_t ctx)
+{
+	uint32_t h = 2166136261U ^ ctx;
+	unsigned int i;
+	const char *p;
+
+	for (i = 0; i < nwords; i++) {
+		for (p = words[i]; *p != '\0'; p++)
+			h = (h ^ (unsigned char)*p) * 16777619U;
+		h = (h ^ 0xff) * 16777619U;
+	}
+	return h;
+}
+
+static bool xs_parse_match(const struct xs_parse_entry *pe, char **words,
+			   unsigned int nwords)
+{
+	const char *k = pe->key;
+	unsigned int i;
+	size_t len;
+
+	if (pe->nwords != nwords)
+		return false;
+	for (i = 0; i < nwords; i++) {
+		len = strlen(words[i]) + 1;
+		if (k + len > pe->key + pe->keylen ||
+		    memcmp(k, words[i], len) != 0)
 			return false;
-		if (++i % 2 == 0)
-			fprintf(stderr, "Another app is currently holding the xtables lock; "
-				"waiting for it to exit...\n");
-		sleep(1);
+		k += len;
+	}
+	return true;
+}
+
+/**
+ * xs_parse_window - words that may belong to an extension
+ * @argc, @argv:	the command line
+ * @start:		index of the -m or -j word
+ * @base:		the options of the command itself
+ *
+ * Returns the index of the first word after @start's argument that
+ * starts another option of the command (or a single-dash one), with a
+ * preceding "!" left out.
+ */
+int xs_parse_window(int argc, char **argv, int start,
+		    const struct option *base)
+{
+	const struct option *o;
+	int i, end;
+
+	for (end = start + 2; end < argc; end++) {
+		const char *w = argv[end];
+
+		i = end;
+		if (strcmp(w, "!") == 0 && end + 1 < argc)
+			w = argv[++i];
+		if (w[0] != '-' || w[1] == '\0')
+			goto next;
+		if (w[1] != '-')
+			break;
+		for (o = base; o->name != NULL; o++)
+			if (strcmp(o->name, w + 2) == 0)
+				return end;
+next:
+		end = i;
+	}
+	return end;
+}
+
+/**
+ * xs_parse_cache_get - look up an extension fragment
+ * @words, @nwords:	the words of the fragment, starting with -m or -j
+ * @ctx:		what the parser saw of the entry (protocol, flags)
+ * @ext:		returns the extension that built the blob
+ * @flags:		returns its option flags after parsing
+ *
+ * Returns the cached blob (a struct xt_entry_match or xt_entry_target)
+ * or NULL.
+ */
+const void *xs_parse_cache_get(char **words, unsigned int nwords,
+			       uint32_t ctx, void **ext, unsigned int *flags)
+{
+	struct xs_parse_entry *pe;
+	uint32_t h;
+
+	if (!xs_parse_cache_enabled)
+		return NULL;
+	parse_cache_lookups++;
+	if (parse_cache_count == 0)
+		return NULL;
+
+	h = xs_parse_hash(words, nwords, ctx);
+	for (pe = parse_cache[h & (parse_cache_size - 1)]; pe; pe = pe->next) {
+		if (pe->hash != h || pe->ctx != ctx ||
+		    !xs_parse_match(pe, words, nwords))
+			continue;
+		parse_cache_hits++;
+		*ext = pe->ext;
+		if (flags != NULL)
+			*flags = pe->flags;
+		return pe->blob;
+	}
+	return NULL;
+}
+
+/* Remember the blob (of `size' bytes) that words/ctx parsed into */
+void xs_parse_cache_put(char **words, unsigned int nwords, uint32_t ctx,
+			void *ext, unsigned int flags, const void *blob,
+			size_t size)
+{
+	struct xs_parse_entry *pe, *next;
+	unsigned int i, b;
+	size_t len = 0;
+	char *k;
+
+	if (!xs_parse_cache_enabled)
+		return;
+
+	if (parse_cache_count >= parse_cache_size) {
+		unsigned int nsize = parse_cache_size ? parse_cache_size * 2 : 256;
+		struct xs_parse_entry **ntab;
+
+		ntab = xtables_calloc(nsize, sizeof(*ntab));
+		for (i = 0; i < parse_cache_size; i++) {
+			for (pe = parse_cache[i]; pe; pe = next) {
+				next = pe->next;
+				b = pe->hash & (nsize - 1);
+				pe->next = ntab[b];
+				ntab[b] = pe;
+			}
+		}
+		free(parse_cache);
+		parse_cache = ntab;
+		parse_cache_size = nsize;
+	}
+
+	for (i = 0; i < nwords; i++)
+		len += strlen(words[i]) + 1;
+	pe = xtables_malloc(sizeof(*pe) + len);
+	pe->hash = xs_parse_hash(words, nwords, ctx);
+	pe->ctx = ctx;
+	pe->nwords = nwords;
+	pe->keylen = len;
+	pe->ext = ext;
+	pe->flags = flags;
+	pe->blob = xtables_malloc(size);
+	memcpy(pe->blob, blob, size);
+	for (k = pe->key, i = 0; i < nwords; i++) {
+		len = strlen(words[i]) + 1;
+		memcpy(k, words[i], len);
+		k += len;
 	}
+
+	b = pe->hash & (parse_cache_size - 1);
+	pe->next = parse_cache[b];
+	parse_cache[b] = pe;
+	parse_cache_count++;
+}
+
+void xs_parse_cache_stats(FILE *fp)
+{
+	fprintf(fp, "# parse cache: %u of %u extension fragments reused, "
+		"%u distinct\n", parse_cache_hits, parse_cache_lookups,
+		parse_cache_count);
+}
+
+/*
+ * Host name pre-pass for the restore tools: collect the names given to
+ * -s/-d in a whole input and have libxtables resolve them concurrently
+ * before the first rule is parsed.
+ */
+static const char *const xs_host_opts[] = {
+	"-s", "-d", "--source", "--destination", "--src", "--dst",
+};
+
+static bool xs_is_host_opt(const char *word, size_t len)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(xs_host_opts); i++)
+		if (strlen(xs_host_opts[i]) == len &&
+		    strncmp(word, xs_host_opts[i], len) == 0)
+			return true;
+	return false;
+}
+
+static int xs_strcmpp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Add the host names of the address list `word' to `names' */
+static void xs_add_hosts(const char *word, size_t len, int family,
+			 char ***names, unsigned int *count,
+			 unsigned int *alloc)
+{
+	const char *end = word + len, *next, *mask;
+	char buf[256];
+	size_t n;
+
+	for (; word < end; word = next + 1) {
+		next = memchr(word, ',', end - word);
+		if (next == NULL)
+			next = end;
+		mask = memchr(word, '/', next - word);
+		n = (mask ? mask : next) - word;
+		if (n == 0 || n >= sizeof(buf))
+			continue;
+		/* "any/0" ignores the name */
+		if (mask && next - mask == 2 && mask[1] == '0')
+			continue;
+		memcpy(buf, word, n);
+		buf[n] = '\0';
+		if (family == AF_INET ? xtables_numeric_to_ipaddr(buf) != NULL
+				      : xtables_numeric_to_ip6addr(buf) != NULL)
+			continue;
+
+		if (*count == *alloc) {
+			*alloc = *alloc ? *alloc * 2 : 64;
+			*names = xtables_realloc(*names,
+						 *alloc * sizeof(**names));
+		}
+		(*names)[*count] = strdup(buf);
+		if ((*names)[*count] == NULL)
+			xtables_error(RESOURCE_PROBLEM, "strdup");
+		++*count;
+	}
+}
+
+void xs_prefetch_hosts(const char *data, size_t len, int family)
+{
+	const char *p = data, *end = data + len, *word;
+	unsigned int count = 0, alloc = 0, i, n;
+	bool host_next = false;
+	char **names = NULL;
+
+	while (p < end) {
+		if (*p == '\n') {
+			host_next = false;
+			p++;
+			continue;
+		}
+		if (*p == ' ' || *p == '\t') {
+			p++;
+			continue;
+		}
+		/* a quoted word, e.g. a comment, is never a host option */
+		if (*p == '"') {
+			for (p++; p < end && *p != '"' && *p != '\n'; p++)
+				if (*p == '\\' && p + 1 < end)
+					p++;
+			p++;
+			host_next = false;
+			continue;
+		}
+
+		word = p;
+		while (p < end && *p != ' ' && *p != '\t' && *p != '\n')
+			p++;
+		if (host_next && !(p - word == 1 && *word == '!')) {
+			xs_add_hosts(word, p - word, family,
+				     &names, &count, &alloc);
+			host_next = false;
+		} else if (!host_next) {
+			host_next = xs_is_host_opt(word, p - word);
+		}
+	}
+	if (count == 0)
+		return;
+
+	qsort(names, count, sizeof(*names), xs_strcmpp);
+	for (i = 1, n = 1; i < count; i++) {
+		if (strcmp(names[n - 1], names[i]) == 0)
+			free(names[i]);
+		else
+			names[n++] = names[i];
+	}
+
+	xtables_host_prefetch((const char *const *)names, n, family);
+
+	for (i = 0; i < n; i++)
+		free(names[i]);
+	free(names);
+}
+
+/* The same for an input file, if it is one that can be mapped */
+void xs_prefetch_hosts_file(FILE *in, int family)
+{
+	struct stat st;
+	void *data;
+
+	if (fstat(fileno(in), &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size == 0)
+		return;
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+	if (data == MAP_FAILED)
+		return;
+	xs_prefetch_hosts(data, st.st_size, family);
+	munmap(data, st.st_size);
 }
@@ -4,6 +4,7 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <netinet/in.h>
 #include <net/if.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
@@ -24,9 +25,12 @@ enum {
 	OPT_COUNTERS    = 1 << 10,
 };
 
+struct option;
 struct xtables_globals;
 struct xtables_rule_match;
 struct xtables_target;
+struct xtc_handle;
+struct xtc_ops;
 
 /**
  * xtables_afinfo - protocol family dependent information
@@ -66,6 +70,7 @@ struct iptables_command_state {
 };
 
 typedef int (*mainfunc_t)(int, char **);
+typedef int (*xs_command_t)(int, char **, char **, struct xtc_handle **, bool);
 
 struct subcommand {
 	const char *name;
@@ -85,7 +90,21 @@ extern struct xtables_match *load_proto(struct iptables_command_state *);
 extern int subcmd_main(int, char **, const struct subcommand *);
 extern void xs_init_target(struct xtables_target *);
 extern void xs_init_match(struct xtables_match *);
-extern bool xtables_lock(bool wait);
+extern bool xtables_lock(int wait, bool report);
+extern void xs_lock_failed(int wait);
+extern int xs_parse_wait(int, char **);
+extern int xs_split_line(char *, char **, int);
+extern int xs_batch_main(int, char **, const struct xtc_ops *, xs_command_t);
+
+extern bool xs_parse_cache_enabled;
+extern int xs_parse_window(int, char **, int, const struct option *);
+extern const void *xs_parse_cache_get(char **, unsigned int, uint32_t,
+	void **, unsigned int *);
+extern void xs_parse_cache_put(char **, unsigned int, uint32_t, void *,
+	unsigned int, const void *, size_t);
+extern void xs_parse_cache_stats(FILE *);
+extern void xs_prefetch_hosts(const char *, size_t, int);
+extern void xs_prefetch_hosts_file(FILE *, int);
 
 extern const struct xtables_afinfo *afinfo;
 
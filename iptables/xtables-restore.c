@@ -15,6 +15,7 @@
 #include "xtables.h"
 #include "libiptc/libiptc.h"
 #include "xtables-multi.h"
+#include "xshared.h"
 #include "nft.h"
 #include <libnftnl/chain.h>
 
@@ -194,6 +195,7 @@ xtables_restore_main(int family, const char *progname, int argc, char *argv[])
 	init_extensions();
 	init_extensions4();
 #endif
+	xs_parse_cache_enabled = true;
 
 	if (nft_init(&h, xtables_ipv4) < 0) {
 		fprintf(stderr, "%s/%s Failed to initialize nft: %s\n",
@@ -254,6 +256,9 @@ xtables_restore_main(int family, const char *progname, int argc, char *argv[])
 	}
 	else in = stdin;
 
+	/* Resolve the host names of all rules up front, concurrently */
+	xs_prefetch_hosts_file(in, h.family);
+
 	chain_list = nft_chain_dump(&h);
 	if (chain_list == NULL)
 		xtables_error(OTHER_PROBLEM, "cannot retrieve chain list\n");
@@ -468,6 +473,8 @@ xtables_restore_main(int family, const char *progname, int argc, char *argv[])
 				xt_params->program_name, line + 1);
 		exit(1);
 	}
+	if (verbose)
+		xs_parse_cache_stats(stdout);
 
 	fclose(in);
 	return 0;
@@ -642,7 +642,7 @@ static void command_jump(struct iptables_command_state *cs)
 		xtables_error(OTHER_PROBLEM, "can't alloc memory!");
 }
 
-static void command_match(struct iptables_command_state *cs)
+static struct xtables_match *command_match(struct iptables_command_state *cs)
 {
 	struct xtables_match *m;
 	size_t size;
@@ -666,7 +666,7 @@ static void command_match(struct iptables_command_state *cs)
 	m->m->u.user.revision = m->revision;
 	xs_init_match(m);
 	if (m == m->next)
-		return;
+		return m;
 	/* Merge options for non-cloned matches */
 	if (m->x6_options != NULL)
 		opts = xtables_options_xfrm(xtables_globals.orig_opts, opts,
@@ -676,6 +676,115 @@ static void command_match(struct iptables_command_state *cs)
 					     m->extra_opts, &m->option_offset);
 	if (opts == NULL)
 		xtables_error(OTHER_PROBLEM, "can't alloc memory!");
+	return m;
+}
+
+/*
+ * With the restore parse cache, a "-m name ..." or "-j name ..." fragment
+ * seen before is copied from the cache instead of being parsed.  One
+ * parsed here is kept if the options of its extension took exactly the
+ * words of its window, see xs_parse_window().
+ */
+#define XT_FRAG_MAX	128
+
+struct xt_frag {
+	struct xtables_match *match;	/* NULL for the target */
+	int start, win, used;
+	uint32_t ctx;
+	bool keep;
+};
+
+/* What extension parsers see of the entry, part of the cache key */
+static uint32_t frag_ctx(const struct iptables_command_state *cs, int family)
+{
+	if (family == AF_INET6)
+		return cs->fw6.ipv6.proto |
+		       (cs->fw6.ipv6.invflags & XT_INV_PROTO) << 24;
+	return cs->fw.ip.proto | (cs->fw.ip.invflags & XT_INV_PROTO) << 24;
+}
+
+/*
+ * Start a fragment at the -m/-j just handled, whose blob of `size' bytes
+ * is at `data'.  Returns true if it was filled in from the cache and
+ * its words skipped.
+ */
+static bool frag_begin(struct xt_frag *f, int argc, char **argv,
+		       uint32_t ctx, void *data, size_t size,
+		       unsigned int *flags)
+{
+	const struct xt_entry_match *blob;
+	unsigned int cflags;
+	void *ext;
+
+	f->keep = false;
+	f->used = 0;
+	if (!xs_parse_cache_enabled || optind < 2 ||
+	    argv[optind - 1] != optarg)
+		return false;
+
+	f->start = optind - 2;
+	f->win = xs_parse_window(argc, argv, f->start,
+				 xtables_globals.orig_opts);
+	f->ctx = ctx;
+	blob = xs_parse_cache_get(&argv[f->start], f->win - f->start, ctx,
+				  &ext, &cflags);
+	if (blob != NULL && blob->u.match_size == size) {
+		memcpy(data, blob, size);
+		*flags = cflags;
+		optind = f->win;
+		return true;
+	}
+	f->keep = true;
+	return false;
+}
+
+/* The fragment whose extension takes option cs->c, if any */
+static struct xt_frag *frag_owner(const struct iptables_command_state *cs,
+				  struct xt_frag *frags, unsigned int nfrags,
+				  struct xt_frag *tfrag)
+{
+	struct xtables_rule_match *matchp;
+	unsigned int k;
+
+	if (cs->c < XT_OPTION_OFFSET_SCALE)
+		return NULL;
+	if (cs->target != NULL &&
+	    cs->c >= cs->target->option_offset &&
+	    cs->c < cs->target->option_offset + XT_OPTION_OFFSET_SCALE)
+		return tfrag;
+	/* same choice as command_default() */
+	for (matchp = cs->matches; matchp; matchp = matchp->next) {
+		if (matchp->completed ||
+		    cs->c < matchp->match->option_offset ||
+		    cs->c >= matchp->match->option_offset +
+			     XT_OPTION_OFFSET_SCALE)
+			continue;
+		for (k = 0; k < nfrags; k++)
+			if (frags[k].match == matchp->match)
+				return &frags[k];
+		break;
+	}
+	return NULL;
+}
+
+/* Account for words [first, last) taken by an option of the fragment */
+static void frag_track(struct xt_frag *f, int first, int last, int bang)
+{
+	if (f == NULL || !f->keep)
+		return;
+	if (bang >= 0 && bang + 1 == first)
+		first = bang;
+	if (first < f->start + 2 || last > f->win)
+		f->keep = false;
+	f->used += last - first;
+}
+
+static void frag_put(const struct xt_frag *f, char **argv, void *ext,
+		     unsigned int flags, const void *data, size_t size)
+{
+	if (f->keep && f->used == f->win - f->start - 2)
+		xs_parse_cache_put(&argv[f->start], f->win - f->start, f->ctx,
+				   ext, flags, data, size);
 }
 
 int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
@@ -693,6 +802,9 @@ int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
 	struct xtables_args args = {
 		.family	= h->family,
 	};
+	struct xt_frag frags[XT_FRAG_MAX], tfrag = { .keep = false };
+	unsigned int nfrags = 0, k;
+	int prev = 1, first, bang = -1;
 
 	memset(&cs, 0, sizeof(cs));
 	cs.jumpto = "";
@@ -724,6 +836,18 @@ int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
 	while ((cs.c = getopt_long(argc, argv,
 	   "-:A:C:D:R:I:L::S::M:F::Z::N:X::E:P:Vh::o:p:s:d:j:i:fbvnt:m:xc:g:46",
 					   opts, NULL)) != -1) {
+		/* words taken by this option, for the parse cache */
+		first = prev;
+		prev = optind;
+		if (xs_parse_cache_enabled) {
+			if (cs.c == 1 && strcmp(optarg, "!") == 0)
+				bang = first;
+			else
+				frag_track(frag_owner(&cs, frags, nfrags,
+						      &tfrag),
+					   first, optind, bang);
+		}
+
 		switch (cs.c) {
 			/*
 			 * Command selection
@@ -927,6 +1051,12 @@ int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
 
 		case 'j':
 			command_jump(&cs);
+			if (cs.target != NULL &&
+			    frag_begin(&tfrag, argc, argv,
+				       frag_ctx(&cs, args.family), cs.target->t,
+				       cs.target->t->u.target_size,
+				       &cs.target->tflags))
+				prev = optind;
 			break;
 
 
@@ -973,7 +1103,14 @@ int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
 			break;
 
 		case 'm':
-			command_match(&cs);
+			m = command_match(&cs);
+			if (nfrags == XT_FRAG_MAX)
+				break;
+			frags[nfrags].match = m;
+			if (frag_begin(&frags[nfrags++], argc, argv,
+				       frag_ctx(&cs, args.family), m->m,
+				       m->m->u.match_size, &m->mflags))
+				prev = optind;
 			break;
 
 		case 'n':
@@ -1097,6 +1234,16 @@ int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
 	if (cs.target != NULL)
 		xtables_option_tfcall(cs.target);
 
+	for (k = 0; k < nfrags; k++) {
+		m = frags[k].match;
+		frag_put(&frags[k], argv, m != m->next ? m :
+			 xtables_find_match(m->name, XTF_DONT_LOAD, NULL),
+			 m->mflags, m->m, m->m->u.match_size);
+	}
+	if (cs.target != NULL)
+		frag_put(&tfrag, argv, cs.target, cs.target->tflags,
+			 cs.target->t, cs.target->t->u.target_size);
+
 	/* Fix me: must put inverse options checking here --MN */
 
 	if (optind < argc)
@@ -58,6 +58,12 @@ typedef unsigned int socklen_t;
 
 #define IPT_CHAINLABEL		xt_chainlabel
 
+#define STRUCT_ADDR		struct in_addr
+#define SET_ENTRY_ADDRS(e, s, sm, d, dm) do {	\
+	(e)->ip.src = (s); (e)->ip.smsk = (sm);	\
+	(e)->ip.dst = (d); (e)->ip.dmsk = (dm);	\
+} while (0)
+
 #define TC_DUMP_ENTRIES		dump_entries
 #define TC_IS_CHAIN		iptc_is_chain
 #define TC_FIRST_CHAIN		iptc_first_chain
@@ -70,6 +76,8 @@ typedef unsigned int socklen_t;
 #define TC_INSERT_ENTRY		iptc_insert_entry
 #define TC_REPLACE_ENTRY	iptc_replace_entry
 #define TC_APPEND_ENTRY		iptc_append_entry
+#define TC_INSERT_ENTRIES	iptc_insert_entries
+#define TC_APPEND_ENTRIES	iptc_append_entries
 #define TC_CHECK_ENTRY		iptc_check_entry
 #define TC_DELETE_ENTRY		iptc_delete_entry
 #define TC_DELETE_NUM_ENTRY	iptc_delete_num_entry
@@ -91,6 +99,8 @@ typedef unsigned int socklen_t;
 #define TC_NUM_RULES		iptc_num_rules
 #define TC_GET_RULE		iptc_get_rule
 #define TC_OPS			iptc_ops
+#define TC_SAVE_BLOB		iptc_save_blob
+#define TC_RESTORE_BLOB		iptc_restore_blob
 
 #define TC_AF			AF_INET
 #define TC_IPPROTO		IPPROTO_IP
@@ -100,6 +110,8 @@ typedef unsigned int socklen_t;
 #define SO_GET_INFO		IPT_SO_GET_INFO
 #define SO_GET_ENTRIES		IPT_SO_GET_ENTRIES
 #define SO_GET_VERSION		IPT_SO_GET_VERSION
+#define SO_GET_REVISION_MATCH	IPT_SO_GET_REVISION_MATCH
+#define SO_GET_REVISION_TARGET	IPT_SO_GET_REVISION_TARGET
 
 #define STANDARD_TARGET		XT_STANDARD_TARGET
 #define LABEL_RETURN		IPTC_LABEL_RETURN
@@ -171,7 +183,6 @@ dump_entry(struct ipt_entry *e, struct xtc_handle *const handle)
 static unsigned char *
 is_same(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b, unsigned char *matchmask)
 {
-	unsigned int i;
 	unsigned char *mptr;
 
 	/* Always compare head structures: ignore mask here. */
@@ -184,18 +195,16 @@ is_same(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b, unsigned char *matchmask)
 	    || a->ip.invflags != b->ip.invflags)
 		return NULL;
 
-	for (i = 0; i < IFNAMSIZ; i++) {
-		if (a->ip.iniface_mask[i] != b->ip.iniface_mask[i])
-			return NULL;
-		if ((a->ip.iniface[i] & a->ip.iniface_mask[i])
-		    != (b->ip.iniface[i] & b->ip.iniface_mask[i]))
-			return NULL;
-		if (a->ip.outiface_mask[i] != b->ip.outiface_mask[i])
-			return NULL;
-		if ((a->ip.outiface[i] & a->ip.outiface_mask[i])
-		    != (b->ip.outiface[i] & b->ip.outiface_mask[i]))
-			return NULL;
-	}
+	/* Interface names only matter under their (identical) masks. */
+	if (memcmp(a->ip.iniface_mask, b->ip.iniface_mask, IFNAMSIZ)
+	    || memcmp(a->ip.outiface_mask, b->ip.outiface_mask, IFNAMSIZ)
+	    || iptcc_masked_differ((const unsigned char *)a->ip.iniface,
+				   (const unsigned char *)b->ip.iniface,
+				   a->ip.iniface_mask, IFNAMSIZ)
+	    || iptcc_masked_differ((const unsigned char *)a->ip.outiface,
+				   (const unsigned char *)b->ip.outiface,
+				   a->ip.outiface_mask, IFNAMSIZ))
+		return NULL;
 
 	if (a->target_offset != b->target_offset
 	    || a->next_offset != b->next_offset)
@@ -209,6 +218,17 @@ is_same(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b, unsigned char *matchmask)
 	return mptr;
 }
 
+/* Hash the head fields compared by is_same(), for the fingerprint index */
+static unsigned int
+head_hash(const STRUCT_ENTRY *e, unsigned int hash)
+{
+	hash = iptcc_fp_hash_bytes(hash, &e->ip.src, sizeof(e->ip.src));
+	hash = iptcc_fp_hash_bytes(hash, &e->ip.dst, sizeof(e->ip.dst));
+	hash = iptcc_fp_hash_bytes(hash, &e->ip.proto, sizeof(e->ip.proto));
+
+	return hash;
+}
+
 #if 0
 /***************************** DEBUGGING ********************************/
 static inline int
@@ -56,6 +56,12 @@ typedef unsigned int socklen_t;
 
 #define IPT_CHAINLABEL		xt_chainlabel
 
+#define STRUCT_ADDR		struct in6_addr
+#define SET_ENTRY_ADDRS(e, s, sm, d, dm) do {	\
+	(e)->ipv6.src = (s); (e)->ipv6.smsk = (sm);	\
+	(e)->ipv6.dst = (d); (e)->ipv6.dmsk = (dm);	\
+} while (0)
+
 #define TC_DUMP_ENTRIES		dump_entries6
 #define TC_IS_CHAIN		ip6tc_is_chain
 #define TC_FIRST_CHAIN		ip6tc_first_chain
@@ -68,6 +74,8 @@ typedef unsigned int socklen_t;
 #define TC_INSERT_ENTRY		ip6tc_insert_entry
 #define TC_REPLACE_ENTRY	ip6tc_replace_entry
 #define TC_APPEND_ENTRY		ip6tc_append_entry
+#define TC_INSERT_ENTRIES	ip6tc_insert_entries
+#define TC_APPEND_ENTRIES	ip6tc_append_entries
 #define TC_CHECK_ENTRY		ip6tc_check_entry
 #define TC_DELETE_ENTRY		ip6tc_delete_entry
 #define TC_DELETE_NUM_ENTRY	ip6tc_delete_num_entry
@@ -89,6 +97,8 @@ typedef unsigned int socklen_t;
 #define TC_NUM_RULES		ip6tc_num_rules
 #define TC_GET_RULE		ip6tc_get_rule
 #define TC_OPS			ip6tc_ops
+#define TC_SAVE_BLOB		ip6tc_save_blob
+#define TC_RESTORE_BLOB		ip6tc_restore_blob
 
 #define TC_AF			AF_INET6
 #define TC_IPPROTO		IPPROTO_IPV6
@@ -98,6 +108,8 @@ typedef unsigned int socklen_t;
 #define SO_GET_INFO		IP6T_SO_GET_INFO
 #define SO_GET_ENTRIES		IP6T_SO_GET_ENTRIES
 #define SO_GET_VERSION		IP6T_SO_GET_VERSION
+#define SO_GET_REVISION_MATCH	IP6T_SO_GET_REVISION_MATCH
+#define SO_GET_REVISION_TARGET	IP6T_SO_GET_REVISION_TARGET
 
 #define STANDARD_TARGET		XT_STANDARD_TARGET
 #define LABEL_RETURN		IP6TC_LABEL_RETURN
@@ -205,7 +217,6 @@ static unsigned char *
 is_same(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b,
 	unsigned char *matchmask)
 {
-	unsigned int i;
 	unsigned char *mptr;
 
 	/* Always compare head structures: ignore mask here. */
@@ -219,18 +230,16 @@ is_same(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b,
 	    || a->ipv6.invflags != b->ipv6.invflags)
 		return NULL;
 
-	for (i = 0; i < IFNAMSIZ; i++) {
-		if (a->ipv6.iniface_mask[i] != b->ipv6.iniface_mask[i])
-			return NULL;
-		if ((a->ipv6.iniface[i] & a->ipv6.iniface_mask[i])
-		    != (b->ipv6.iniface[i] & b->ipv6.iniface_mask[i]))
-			return NULL;
-		if (a->ipv6.outiface_mask[i] != b->ipv6.outiface_mask[i])
-			return NULL;
-		if ((a->ipv6.outiface[i] & a->ipv6.outiface_mask[i])
-		    != (b->ipv6.outiface[i] & b->ipv6.outiface_mask[i]))
-			return NULL;
-	}
+	/* Interface names only matter under their (identical) masks. */
+	if (memcmp(a->ipv6.iniface_mask, b->ipv6.iniface_mask, IFNAMSIZ)
+	    || memcmp(a->ipv6.outiface_mask, b->ipv6.outiface_mask, IFNAMSIZ)
+	    || iptcc_masked_differ((const unsigned char *)a->ipv6.iniface,
+				   (const unsigned char *)b->ipv6.iniface,
+				   a->ipv6.iniface_mask, IFNAMSIZ)
+	    || iptcc_masked_differ((const unsigned char *)a->ipv6.outiface,
+				   (const unsigned char *)b->ipv6.outiface,
+				   a->ipv6.outiface_mask, IFNAMSIZ))
+		return NULL;
 
 	if (a->target_offset != b->target_offset
 	    || a->next_offset != b->next_offset)
@@ -244,6 +253,17 @@ is_same(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b,
 	return mptr;
 }
 
+/* Hash the head fields compared by is_same(), for the fingerprint index */
+static unsigned int
+head_hash(const STRUCT_ENTRY *e, unsigned int hash)
+{
+	hash = iptcc_fp_hash_bytes(hash, &e->ipv6.src, sizeof(e->ipv6.src));
+	hash = iptcc_fp_hash_bytes(hash, &e->ipv6.dst, sizeof(e->ipv6.dst));
+	hash = iptcc_fp_hash_bytes(hash, &e->ipv6.proto, sizeof(e->ipv6.proto));
+
+	return hash;
+}
+
 /* All zeroes == unconditional rule. */
 static inline int
 unconditional(const struct ip6t_ip6 *ipv6)
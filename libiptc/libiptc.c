@@ -33,7 +33,13 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/utsname.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <xtables.h>
 #include <libiptc/xtcshared.h>
 
@@ -56,7 +62,9 @@
 #define debug(x, args...)
 #endif
 
-static void *iptc_fn = NULL;
+/* Last function called, for TC_STRERROR().  Kept per thread so that
+ * different handles can be used from different threads at once. */
+static __thread void *iptc_fn = NULL;
 
 static const char *hooknames[] = {
 	[HOOK_PRE_ROUTING]	= "PREROUTING",
@@ -100,13 +108,21 @@ struct rule_head
 	enum iptcc_rule_type type;
 	struct chain_head *jump;	/* jump target, if IPTCC_R_JUMP */
 
+	int in_arena;			/* allocated from the handle arena */
+
+	struct hlist_node fp_node;	/* chain fingerprint index bucket */
+
 	unsigned int size;		/* size of entry data */
-	STRUCT_ENTRY entry[0];
+	STRUCT_ENTRY *entry;		/* points into the parsed blob for
+					 * rules read from the kernel, else
+					 * to entry_data */
+	STRUCT_ENTRY entry_data[0];
 };
 
 struct chain_head
 {
 	struct list_head list;
+	struct hlist_node hash;		/* chain name hash bucket list */
 	char name[TABLE_MAXNAMELEN];
 	unsigned int hooknum;		/* hook number+1 if builtin */
 	unsigned int references;	/* how many jumps reference us */
@@ -118,10 +134,21 @@ struct chain_head
 	unsigned int num_rules;		/* number of rules in list */
 	struct list_head rules;		/* list of rules */
 
+	struct rule_head **rule_index;	/* rule number -> rule_head */
+	unsigned int rule_index_sz;	/* allocated size of rule_index */
+	int rule_index_valid;		/* rule_index matches rules list */
+
+	struct rule_fp_index *fp_index;	/* rule fingerprint -> rule_head */
+
 	unsigned int index;		/* index (needed for jump resolval) */
 	unsigned int head_offset;	/* offset in rule blob */
 	unsigned int foot_index;	/* index (needed for counter_map) */
 	unsigned int foot_offset;	/* offset in rule blob */
+
+	int in_arena;			/* allocated from the handle arena */
+	int dirty;			/* rules changed since parsing */
+	unsigned int blob_offset;	/* head offset in parsed blob */
+	unsigned int blob_size;		/* head + rules size in parsed blob */
 };
 
 struct xtc_handle {
@@ -138,11 +165,25 @@ struct xtc_handle {
 	struct chain_head **chain_index;   /* array for fast chain list access*/
 	unsigned int        chain_index_sz;/* size of chain index array */
 
+	struct hlist_head  *chain_hash;    /* chain name -> chain_head */
+	unsigned int        chain_hash_sz; /* number of hash buckets */
+	unsigned int        chain_hash_cnt;/* number of hashed chains */
+
 	int sorted_offsets; /* if chains are received sorted from kernel,
 			     * then the offsets are also sorted. Says if its
 			     * possible to bsearch offsets using chain_index.
 			     */
 
+	int blob_stale;	    /* offsets in the cache no longer refer to
+			     * the parsed blob, thus clean chains can't
+			     * be copied from it on commit.
+			     */
+
+	struct iptcc_arena_block *arena;   /* chains and rules of the blob */
+
+	struct rule_head **blob_rules;	   /* rules of the blob, in blob order */
+	unsigned int blob_rules_num;	   /* number of blob_rules */
+
 	STRUCT_GETINFO info;
 	STRUCT_GET_ENTRIES *entries;
 };
@@ -152,21 +193,118 @@ enum bsearch_type {
 	BSEARCH_OFFSET,	/* Binary search based on offset */
 };
 
+/**********************************************************************
+ * Arena allocator
+ **********************************************************************
+ * The chain and rule heads created while parsing the blob are carved
+ * out of a few large blocks, sized from the number of entries at
+ * TC_INIT, instead of being malloc'ed one by one.  Objects are never
+ * returned to the arena; all blocks are released at once by TC_FREE.
+ * Chains and rules created through the API are malloc'ed.
+ */
+#ifndef IPTCC_ARENA_BLOCK_MIN
+#define IPTCC_ARENA_BLOCK_MIN	65536
+#endif
+
+struct iptcc_arena_block {
+	struct iptcc_arena_block *next;
+	size_t size;			/* usable size of data */
+	size_t used;			/* bytes handed out */
+	char data[0] __attribute__((aligned(8)));
+};
+
+static int iptcc_arena_grow(struct xtc_handle *h, size_t size)
+{
+	struct iptcc_arena_block *b;
+
+	if (size < IPTCC_ARENA_BLOCK_MIN)
+		size = IPTCC_ARENA_BLOCK_MIN;
+
+	b = malloc(sizeof(*b) + size);
+	if (b == NULL)
+		return -ENOMEM;
+
+	debug("New arena block of %zu bytes\n", size);
+
+	b->size = size;
+	b->used = 0;
+	b->next = h->arena;
+	h->arena = b;
+	return 1;
+}
+
+static void *iptcc_arena_alloc(struct xtc_handle *h, size_t size)
+{
+	struct iptcc_arena_block *b = h->arena;
+	void *p;
+
+	size = ALIGN(size);
+	if (b == NULL || b->size - b->used < size) {
+		if (iptcc_arena_grow(h, size) < 0)
+			return NULL;
+		b = h->arena;
+	}
+
+	p = b->data + b->used;
+	b->used += size;
+	return p;
+}
+
+static void iptcc_arena_free(struct xtc_handle *h)
+{
+	struct iptcc_arena_block *b, *next;
+
+	for (b = h->arena; b != NULL; b = next) {
+		next = b->next;
+		free(b);
+	}
+	h->arena = NULL;
+}
+
+static void iptcc_init_chain_head(struct chain_head *c, const char *name,
+				  int hooknum)
+{
+	memset(c, 0, sizeof(*c));
+
+	strncpy(c->name, name, TABLE_MAXNAMELEN);
+	c->hooknum = hooknum;
+	c->dirty = 1;		/* not part of the parsed blob (yet) */
+	INIT_LIST_HEAD(&c->rules);
+}
+
 /* allocate a new chain head for the cache */
 static struct chain_head *iptcc_alloc_chain_head(const char *name, int hooknum)
 {
 	struct chain_head *c = malloc(sizeof(*c));
 	if (!c)
 		return NULL;
-	memset(c, 0, sizeof(*c));
 
-	strncpy(c->name, name, TABLE_MAXNAMELEN);
-	c->hooknum = hooknum;
-	INIT_LIST_HEAD(&c->rules);
+	iptcc_init_chain_head(c, name, hooknum);
+
+	return c;
+}
+
+/* allocate a new chain head for a chain of the parsed blob */
+static struct chain_head *
+iptcc_alloc_blob_chain_head(struct xtc_handle *h, const char *name,
+			    int hooknum)
+{
+	struct chain_head *c = iptcc_arena_alloc(h, sizeof(*c));
+	if (!c)
+		return NULL;
+
+	iptcc_init_chain_head(c, name, hooknum);
+	c->in_arena = 1;
 
 	return c;
 }
 
+static void iptcc_free_chain_head(struct chain_head *c)
+{
+	if (!c->in_arena)
+		free(c);
+}
+
 /* allocate and initialize a new rule for the cache */
 static struct rule_head *iptcc_alloc_rule(struct chain_head *c, unsigned int size)
 {
@@ -177,10 +315,38 @@ static struct rule_head *iptcc_alloc_rule(struct chain_head *c, unsigned int siz
 
 	r->chain = c;
 	r->size = size;
+	r->entry = r->entry_data;
+
+	return r;
+}
+
+/* allocate a new rule for an entry of the parsed blob, the entry
+ * itself is referenced instead of copied */
+static struct rule_head *iptcc_alloc_blob_rule(struct xtc_handle *h,
+					       struct chain_head *c,
+					       STRUCT_ENTRY *e)
+{
+	struct rule_head *r = iptcc_arena_alloc(h, sizeof(*r));
+	if (!r)
+		return NULL;
+	memset(r, 0, sizeof(*r));
+
+	r->chain = c;
+	r->size = e->next_offset;
+	r->entry = e;
+	r->in_arena = 1;
+
+	h->blob_rules[h->blob_rules_num++] = r;
 
 	return r;
 }
 
+static void iptcc_free_rule(struct rule_head *r)
+{
+	if (!r->in_arena)
+		free(r);
+}
+
 /* notify us that the ruleset has been modified by the user */
 static inline void
 set_changed(struct xtc_handle *h)
@@ -635,6 +801,116 @@ static int iptcc_chain_index_delete_chain(struct chain_head *c, struct xtc_handl
 }
 
 
+/**********************************************************************
+ * Chain hash (cache utility) functions
+ **********************************************************************
+ * The chain hash maps a chain name directly to its chain_head, for
+ * builtin and user defined chains alike.  It makes chain lookups
+ * O(1) on average, independent of the number of chains, while the
+ * sorted chain list (and the chain index above) is only needed for
+ * keeping user defined chains in alphabetical order on insert.
+ *
+ * The number of buckets is always a power of two, and is doubled
+ * once the number of hashed chains exceeds it.
+ */
+#ifndef CHAIN_HASH_MIN_SIZE
+#define CHAIN_HASH_MIN_SIZE 64
+#endif
+
+/* FNV-1a over the chain name */
+static inline unsigned int iptcc_chain_hash_fn(const char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static int iptcc_chain_hash_alloc(struct xtc_handle *h, unsigned int size)
+{
+	h->chain_hash = calloc(size, sizeof(*h->chain_hash));
+	if (h->chain_hash == NULL)
+		return -ENOMEM;
+	h->chain_hash_sz = size;
+	h->chain_hash_cnt = 0;
+	return 1;
+}
+
+static void iptcc_chain_hash_free(struct xtc_handle *h)
+{
+	h->chain_hash_sz = 0;
+	h->chain_hash_cnt = 0;
+	free(h->chain_hash);
+}
+
+/* Double the number of buckets and rehash all chains.  If memory
+ * can't be had, the old table is kept: lookups stay correct, the
+ * bucket lists just get longer. */
+static void iptcc_chain_hash_grow(struct xtc_handle *h)
+{
+	unsigned int i, size = h->chain_hash_sz * 2;
+	struct hlist_head *new;
+	struct hlist_node *pos, *n;
+
+	new = calloc(size, sizeof(*new));
+	if (new == NULL)
+		return;
+
+	debug("Grow chain hash %u -> %u buckets\n", h->chain_hash_sz, size);
+
+	for (i = 0; i < h->chain_hash_sz; i++) {
+		hlist_for_each_safe(pos, n, &h->chain_hash[i]) {
+			struct chain_head *c =
+				hlist_entry(pos, struct chain_head, hash);
+			hlist_del(&c->hash);
+			hlist_add_head(&c->hash,
+			       &new[iptcc_chain_hash_fn(c->name) & (size - 1)]);
+		}
+	}
+
+	free(h->chain_hash);
+	h->chain_hash = new;
+	h->chain_hash_sz = size;
+}
+
+static void iptcc_chain_hash_add(struct xtc_handle *h, struct chain_head *c)
+{
+	unsigned int bucket;
+
+	if (h->chain_hash_cnt >= h->chain_hash_sz)
+		iptcc_chain_hash_grow(h);
+
+	bucket = iptcc_chain_hash_fn(c->name) & (h->chain_hash_sz - 1);
+	hlist_add_head(&c->hash, &h->chain_hash[bucket]);
+	h->chain_hash_cnt++;
+}
+
+static void iptcc_chain_hash_del(struct xtc_handle *h, struct chain_head *c)
+{
+	hlist_del(&c->hash);
+	h->chain_hash_cnt--;
+}
+
+static struct chain_head *
+iptcc_chain_hash_find(struct xtc_handle *h, const char *name)
+{
+	unsigned int bucket;
+	struct hlist_node *pos;
+	struct chain_head *c;
+
+	bucket = iptcc_chain_hash_fn(name) & (h->chain_hash_sz - 1);
+	for (pos = h->chain_hash[bucket].first; pos; pos = pos->next) {
+		c = hlist_entry(pos, struct chain_head, hash);
+		if (strcmp(c->name, name) == 0)
+			return c;
+	}
+	return NULL;
+}
+
+
 /**********************************************************************
  * iptc cache utility functions (iptcc_*)
  **********************************************************************/
@@ -645,9 +921,90 @@ static inline unsigned int iptcc_is_builtin(struct chain_head *c)
 	return (c->hooknum ? 1 : 0);
 }
 
-/* Get a specific rule within a chain */
-static struct rule_head *iptcc_get_rule_num(struct chain_head *c,
-					    unsigned int rulenum)
+/**********************************************************************
+ * Rule index (cache utility) functions
+ **********************************************************************
+ * Every chain can carry an array of pointers to its rules, in list
+ * order, which turns positional access (insert/replace/delete by
+ * number, counter access) into an array lookup.  The index is built
+ * lazily on the first positional access, and invalidated by any
+ * change of the rule list that shifts rule positions.  Appending to
+ * and removing from the tail of a chain keeps the index valid.
+ */
+
+static inline void iptcc_rule_index_invalidate(struct chain_head *c)
+{
+	c->rule_index_valid = 0;
+}
+
+static void iptcc_rule_index_free(struct chain_head *c)
+{
+	c->rule_index_valid = 0;
+	c->rule_index_sz = 0;
+	free(c->rule_index);
+	c->rule_index = NULL;
+}
+
+/* Make sure the index array has room for `size' rules */
+static int iptcc_rule_index_resize(struct chain_head *c, unsigned int size)
+{
+	struct rule_head **new;
+	unsigned int new_sz;
+
+	if (size <= c->rule_index_sz)
+		return 1;
+
+	new_sz = c->rule_index_sz ? c->rule_index_sz : 16;
+	while (new_sz < size)
+		new_sz *= 2;
+
+	new = realloc(c->rule_index, new_sz * sizeof(*new));
+	if (new == NULL)
+		return -ENOMEM;
+
+	c->rule_index = new;
+	c->rule_index_sz = new_sz;
+	return 1;
+}
+
+static int iptcc_rule_index_build(struct chain_head *c)
+{
+	struct rule_head *r;
+	unsigned int num = 0;
+
+	if (c->rule_index_valid)
+		return 1;
+
+	if (iptcc_rule_index_resize(c, c->num_rules) < 0)
+		return -ENOMEM;
+
+	debug("Building rule index of chain %s (%u rules)\n",
+	      c->name, c->num_rules);
+
+	list_for_each_entry(r, &c->rules, list)
+		c->rule_index[num++] = r;
+
+	c->rule_index_valid = 1;
+	return 1;
+}
+
+/* Rule `r' was just appended to the tail of chain `c', but
+ * c->num_rules has not yet been incremented. */
+static void iptcc_rule_index_append(struct chain_head *c, struct rule_head *r)
+{
+	if (!c->rule_index_valid)
+		return;
+
+	if (iptcc_rule_index_resize(c, c->num_rules + 1) < 0) {
+		iptcc_rule_index_invalidate(c);
+		return;
+	}
+	c->rule_index[c->num_rules] = r;
+}
+
+/* Get a specific rule within a chain, by walking the list */
+static struct rule_head *__iptcc_get_rule_num(struct chain_head *c,
+					      unsigned int rulenum)
 {
 	struct rule_head *r;
 	unsigned int num = 0;
@@ -660,9 +1017,9 @@ static struct rule_head *iptcc_get_rule_num(struct chain_head *c,
 	return NULL;
 }
 
-/* Get a specific rule within a chain backwards */
-static struct rule_head *iptcc_get_rule_num_reverse(struct chain_head *c,
-					    unsigned int rulenum)
+/* Get a specific rule within a chain backwards, by walking the list */
+static struct rule_head *__iptcc_get_rule_num_reverse(struct chain_head *c,
+						      unsigned int rulenum)
 {
 	struct rule_head *r;
 	unsigned int num = 0;
@@ -675,6 +1032,233 @@ static struct rule_head *iptcc_get_rule_num_reverse(struct chain_head *c,
 	return NULL;
 }
 
+/* Get a specific rule within a chain, first rule is number 1 */
+static struct rule_head *iptcc_get_rule_num(struct chain_head *c,
+					    unsigned int rulenum)
+{
+	if (rulenum == 0 || rulenum > c->num_rules)
+		return NULL;
+
+	if (iptcc_rule_index_build(c) > 0)
+		return c->rule_index[rulenum - 1];
+
+	/* No memory for the index, take advantage of the double
+	 * linked list instead. */
+	if (rulenum <= c->num_rules/2)
+		return __iptcc_get_rule_num(c, rulenum);
+	else
+		return __iptcc_get_rule_num_reverse(c,
+						    c->num_rules - rulenum + 1);
+}
+
+/**********************************************************************
+ * Rule fingerprint index (cache utility) functions
+ **********************************************************************
+ * Deleting or checking a rule by its specification compares it to
+ * every rule of the chain under the match mask handed in by the
+ * caller.  The fingerprint index hashes the rules of a chain by
+ * exactly the bytes that comparison looks at (see is_same() and
+ * target_same()), so only rules in the same bucket need a full
+ * comparison.  Equal rules always share a bucket, and buckets keep
+ * rules in chain order, so the first full match in the bucket is the
+ * first match in the chain.
+ *
+ * The index is built lazily for the mask of the first lookup, and
+ * rebuilt when a lookup uses a different mask.  Appends and
+ * deletions keep it up to date, other changes of the rule list just
+ * invalidate it.
+ */
+struct rule_fp_index {
+	int valid;			/* index matches rules list */
+	unsigned char *mask;		/* match mask the index was built for */
+	unsigned int mask_len;		/* == next_offset of hashed rules */
+	unsigned int size;		/* number of buckets, power of two */
+	struct hlist_head *buckets;
+};
+
+static unsigned int head_hash(const STRUCT_ENTRY *e, unsigned int hash);
+
+static inline unsigned int
+iptcc_fp_hash_bytes(unsigned int hash, const void *data, unsigned int len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static inline unsigned int
+iptcc_fp_hash_masked(unsigned int hash, const unsigned char *data,
+		     const unsigned char *mask, unsigned int len)
+{
+	while (len--) {
+		hash ^= *data++ & *mask++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* Fingerprint of rule `r' under `mask', r->size has to be mask_len */
+static unsigned int iptcc_fp_hash(const struct rule_head *r,
+				  const unsigned char *mask)
+{
+	const STRUCT_ENTRY *e = r->entry;
+	const STRUCT_ENTRY_TARGET *t = GET_TARGET((STRUCT_ENTRY *)e);
+	unsigned int hash = 2166136261U;
+	unsigned int off;
+
+	hash = head_hash(e, hash);
+	hash = iptcc_fp_hash_bytes(hash, &e->target_offset,
+				   sizeof(e->target_offset));
+
+	/* Matches: name, size and data under the mask */
+	for (off = sizeof(STRUCT_ENTRY); off < e->target_offset; ) {
+		const STRUCT_ENTRY_MATCH *m = (const void *)e + off;
+		unsigned int hdr = ALIGN(sizeof(*m));
+
+		if (m->u.match_size < hdr)
+			break;
+		hash = iptcc_fp_hash_bytes(hash, m->u.user.name,
+					   strnlen(m->u.user.name,
+						   sizeof(m->u.user.name)));
+		hash = iptcc_fp_hash_bytes(hash, &m->u.match_size,
+					   sizeof(m->u.match_size));
+		hash = iptcc_fp_hash_masked(hash, m->data,
+					    mask + off + hdr,
+					    m->u.match_size - hdr);
+		off += m->u.match_size;
+	}
+
+	hash = iptcc_fp_hash_bytes(hash, &r->type, sizeof(r->type));
+	switch (r->type) {
+	case IPTCC_R_FALLTHROUGH:
+		break;
+	case IPTCC_R_JUMP:
+		hash = iptcc_fp_hash_bytes(hash, &r->jump, sizeof(r->jump));
+		break;
+	case IPTCC_R_STANDARD:
+		hash = iptcc_fp_hash_bytes(hash,
+			&((const STRUCT_STANDARD_TARGET *)t)->verdict,
+			sizeof(int));
+		break;
+	case IPTCC_R_MODULE:
+		hash = iptcc_fp_hash_bytes(hash, t->u.user.name,
+					   strnlen(t->u.user.name,
+						   sizeof(t->u.user.name)));
+		hash = iptcc_fp_hash_masked(hash, t->data,
+				mask + e->target_offset + sizeof(*t),
+				t->u.target_size - sizeof(*t));
+		break;
+	}
+	return hash;
+}
+
+static void iptcc_fp_index_free(struct chain_head *c)
+{
+	if (c->fp_index == NULL)
+		return;
+
+	free(c->fp_index->buckets);
+	free(c->fp_index->mask);
+	free(c->fp_index);
+	c->fp_index = NULL;
+}
+
+static inline void iptcc_fp_index_invalidate(struct chain_head *c)
+{
+	if (c->fp_index)
+		c->fp_index->valid = 0;
+}
+
+static inline int iptcc_fp_index_valid(struct chain_head *c)
+{
+	return c->fp_index && c->fp_index->valid;
+}
+
+/* Hash rule `r' at the tail of its bucket, it has to be the last
+ * rule of the chain */
+static void iptcc_fp_index_append(struct chain_head *c, struct rule_head *r)
+{
+	struct rule_fp_index *fpi = c->fp_index;
+	struct hlist_head *head;
+	struct hlist_node *pos;
+
+	if (r->size != fpi->mask_len)
+		return;
+
+	head = &fpi->buckets[iptcc_fp_hash(r, fpi->mask) & (fpi->size - 1)];
+	if (hlist_empty(head)) {
+		hlist_add_head(&r->fp_node, head);
+		return;
+	}
+	for (pos = head->first; pos->next; pos = pos->next)
+		;
+	hlist_add_after(pos, &r->fp_node);
+}
+
+/* Rule `r' was just appended to the tail of chain `c' */
+static void iptcc_fp_index_add_tail(struct chain_head *c, struct rule_head *r)
+{
+	if (iptcc_fp_index_valid(c))
+		iptcc_fp_index_append(c, r);
+}
+
+/* Rule `r' is about to be removed from its chain */
+static void iptcc_fp_index_del(struct rule_head *r)
+{
+	if (iptcc_fp_index_valid(r->chain))
+		hlist_del_init(&r->fp_node);
+}
+
+/* Make sure chain `c' has a valid index for `mask' */
+static int iptcc_fp_index_build(struct chain_head *c,
+				const unsigned char *mask,
+				unsigned int mask_len)
+{
+	struct rule_fp_index *fpi = c->fp_index;
+	struct rule_head *r;
+	unsigned int size;
+
+	if (fpi && fpi->valid && fpi->mask_len == mask_len
+	    && memcmp(fpi->mask, mask, mask_len) == 0)
+		return 1;
+
+	iptcc_fp_index_free(c);
+
+	fpi = calloc(1, sizeof(*fpi));
+	if (fpi == NULL)
+		return -ENOMEM;
+
+	for (size = 16; size < c->num_rules; size *= 2)
+		;
+	fpi->buckets = calloc(size, sizeof(*fpi->buckets));
+	fpi->mask = malloc(mask_len);
+	if (fpi->buckets == NULL || fpi->mask == NULL) {
+		free(fpi->buckets);
+		free(fpi->mask);
+		free(fpi);
+		return -ENOMEM;
+	}
+	memcpy(fpi->mask, mask, mask_len);
+	fpi->mask_len = mask_len;
+	fpi->size = size;
+
+	debug("Building fingerprint index of chain %s (%u rules)\n",
+	      c->name, c->num_rules);
+
+	c->fp_index = fpi;
+	list_for_each_entry(r, &c->rules, list) {
+		INIT_HLIST_NODE(&r->fp_node);
+		iptcc_fp_index_append(c, r);
+	}
+	fpi->valid = 1;
+
+	return 1;
+}
+
 /* Returns chain head if found, otherwise NULL. */
 static struct chain_head *
 iptcc_find_chain_by_offset(struct xtc_handle *handle, unsigned int offset)
@@ -711,77 +1295,11 @@ iptcc_find_chain_by_offset(struct xtc_handle *handle, unsigned int offset)
 static struct chain_head *
 iptcc_find_label(const char *name, struct xtc_handle *handle)
 {
-	struct list_head *pos;
-	struct list_head *list_start_pos;
-	unsigned int i=0;
-	int res;
-
-	if (list_empty(&handle->chains))
-		return NULL;
-
-	/* First look at builtin chains */
-	list_for_each(pos, &handle->chains) {
-		struct chain_head *c = list_entry(pos, struct chain_head, list);
-		if (!iptcc_is_builtin(c))
-			break;
-		if (!strcmp(c->name, name))
-			return c;
-	}
-
-	/* Find a smart place to start the search via chain index */
-  	//list_start_pos = iptcc_linearly_search_chain_index(name, handle);
-  	list_start_pos = iptcc_bsearch_chain_index(name, &i, handle);
-
-	/* Handel if bsearch bails out early */
-	if (list_start_pos == &handle->chains) {
-		list_start_pos = pos;
-	}
-#ifdef DEBUG
-	else {
-		/* Verify result of bsearch against linearly index search */
-		struct list_head *test_pos;
-		struct chain_head *test_c, *tmp_c;
-		test_pos = iptcc_linearly_search_chain_index(name, handle);
-		if (list_start_pos != test_pos) {
-			debug("BUG in chain_index search\n");
-			test_c=list_entry(test_pos,      struct chain_head,list);
-			tmp_c =list_entry(list_start_pos,struct chain_head,list);
-			debug("Verify search found:\n");
-			debug(" Chain:%s\n", test_c->name);
-			debug("BSearch found:\n");
-			debug(" Chain:%s\n", tmp_c->name);
-			exit(42);
-		}
-	}
-#endif
-
-	/* Initial/special case, no user defined chains */
-	if (handle->num_chains == 0)
-		return NULL;
-
-	/* Start searching through the chain list */
-	list_for_each(pos, list_start_pos->prev) {
-		struct chain_head *c = list_entry(pos, struct chain_head, list);
-		res = strcmp(c->name, name);
-		debug("List search name:%s == %s res:%d\n", name, c->name, res);
-		if (res==0)
-			return c;
-
-		/* We can stop earlier as we know list is sorted */
-		if (res>0 && !iptcc_is_builtin(c)) { /* Walked too far*/
-			debug(" Not in list, walked too far, sorted list\n");
-			return NULL;
-		}
-
-		/* Stop on wrap around, if list head is reached */
-		if (pos == &handle->chains) {
-			debug("Stop, list head reached\n");
-			return NULL;
-		}
-	}
+	struct chain_head *c;
 
-	debug("List search NOT found name:%s\n", name);
-	return NULL;
+	c = iptcc_chain_hash_find(handle, name);
+	debug("Hash search name:%s %sfound\n", name, c ? "" : "NOT ");
+	return c;
 }
 
 /* called when rule is to be removed from cache */
@@ -793,8 +1311,14 @@ static void iptcc_delete_rule(struct rule_head *r)
 	    && r->jump)
 		r->jump->references--;
 
+	/* Removing the last rule doesn't shift any rule positions */
+	if (r->list.next != &r->chain->rules)
+		iptcc_rule_index_invalidate(r->chain);
+	iptcc_fp_index_del(r);
+	r->chain->dirty = 1;
+
 	list_del(&r->list);
-	free(r);
+	iptcc_free_rule(r);
 }
 
 
@@ -846,8 +1370,38 @@ static void iptc_insert_chain(struct xtc_handle *h, struct chain_head *c)
 	struct list_head  *list_start_pos;
 	unsigned int i=1;
 
+	/* Fast path: chains are usually created in sorted order
+	 * (e.g. by iptables-restore), so try the list tail first.
+	 * Builtin chains come first, thus a builtin tail means there
+	 * are no user defined chains yet. */
+	if (!c->hooknum && !list_empty(&h->chains)) {
+		tmp = list_entry(h->chains.prev, struct chain_head, list);
+		if (iptcc_is_builtin(tmp) || strcmp(c->name, tmp->name) > 0) {
+			list_add_tail(&c->list, &h->chains);
+			return;
+		}
+	}
+
 	/* Find a smart place to start the insert search */
   	list_start_pos = iptcc_bsearch_chain_index(c->name, &i, h);
+#ifdef DEBUG
+	if (list_start_pos != &h->chains) {
+		/* Verify result of bsearch against linearly index search */
+		struct list_head *test_pos;
+		struct chain_head *test_c, *tmp_c;
+		test_pos = iptcc_linearly_search_chain_index(c->name, h);
+		if (list_start_pos != test_pos) {
+			debug("BUG in chain_index search\n");
+			test_c=list_entry(test_pos,      struct chain_head,list);
+			tmp_c =list_entry(list_start_pos,struct chain_head,list);
+			debug("Verify search found:\n");
+			debug(" Chain:%s\n", test_c->name);
+			debug("BSearch found:\n");
+			debug(" Chain:%s\n", tmp_c->name);
+			exit(42);
+		}
+	}
+#endif
 
 	/* Handle the case, where chain.name is smaller than index[0] */
 	if (i==0 && strcmp(c->name, h->chain_index[0]->name) <= 0) {
@@ -921,6 +1475,8 @@ static void __iptcc_p_add_chain(struct xtc_handle *h, struct chain_head *c,
 		}
 	}
 
+	iptcc_chain_hash_add(h, c);
+
 	h->chain_iterator_cur = c;
 }
 
@@ -951,7 +1507,8 @@ static int cache_add_entry(STRUCT_ENTRY *e,
 
 	if (strcmp(GET_TARGET(e)->u.user.name, ERROR_TARGET) == 0) {
 		struct chain_head *c =
-			iptcc_alloc_chain_head((const char *)GET_TARGET(e)->data, 0);
+			iptcc_alloc_blob_chain_head(h,
+					(const char *)GET_TARGET(e)->data, 0);
 		DEBUGP_C("%u:%u:new userdefined chain %s: %p\n", *num, offset,
 			(char *)c->name, c);
 		if (!c) {
@@ -964,8 +1521,8 @@ static int cache_add_entry(STRUCT_ENTRY *e,
 
 	} else if ((builtin = iptcb_ent_is_hook_entry(e, h)) != 0) {
 		struct chain_head *c =
-			iptcc_alloc_chain_head((char *)hooknames[builtin-1],
-						builtin);
+			iptcc_alloc_blob_chain_head(h,
+					(char *)hooknames[builtin-1], builtin);
 		DEBUGP_C("%u:%u new builtin chain: %p (rules=%p)\n",
 			*num, offset, c, &c->rules);
 		if (!c) {
@@ -984,8 +1541,7 @@ static int cache_add_entry(STRUCT_ENTRY *e,
 		struct rule_head *r;
 new_rule:
 
-		if (!(r = iptcc_alloc_rule(h->chain_iterator_cur,
-					   e->next_offset))) {
+		if (!(r = iptcc_alloc_blob_rule(h, h->chain_iterator_cur, e))) {
 			errno = ENOMEM;
 			return -1;
 		}
@@ -993,7 +1549,6 @@ new_rule:
 
 		r->index = *num;
 		r->offset = offset;
-		memcpy(r->entry, e, e->next_offset);
 		r->counter_map.maptype = COUNTER_MAP_NORMAL_MAP;
 		r->counter_map.mappos = r->index;
 
@@ -1005,7 +1560,6 @@ new_rule:
 			if (t->target.u.target_size
 			    != ALIGN(sizeof(STRUCT_STANDARD_TARGET))) {
 				errno = EINVAL;
-				free(r);
 				return -1;
 			}
 
@@ -1059,6 +1613,13 @@ static int parse_table(struct xtc_handle *h)
 	/* Second pass: fixup parsed data from first pass */
 	list_for_each_entry(c, &h->chains, list) {
 		struct rule_head *r;
+
+		/* Remember where the chain lives in the blob, commit
+		 * copies it from there as long as it stays untouched */
+		c->dirty = 0;
+		c->blob_offset = c->head_offset;
+		c->blob_size = c->foot_offset - c->head_offset;
+
 		list_for_each_entry(r, &c->rules, list) {
 			struct chain_head *lc;
 			STRUCT_STANDARD_TARGET *t;
@@ -1107,6 +1668,13 @@ struct iptcb_chain_error {
 
 
 
+/* Can the chain be copied from the parsed blob as a whole? */
+static inline int iptcc_chain_reusable(struct xtc_handle *h,
+				       struct chain_head *c)
+{
+	return !h->blob_stale && !c->dirty;
+}
+
 /* compile rule from cache into blob */
 static inline int iptcc_compile_rule (struct xtc_handle *h, STRUCT_REPLACE *repl, struct rule_head *r)
 {
@@ -1132,6 +1700,41 @@ static inline int iptcc_compile_rule (struct xtc_handle *h, STRUCT_REPLACE *repl
 	return 1;
 }
 
+/* copy an untouched chain from the parsed blob, and relocate the
+ * rules which carry an offset as verdict */
+static void iptcc_relocate_chain(struct xtc_handle *h, STRUCT_REPLACE *repl,
+				 struct chain_head *c)
+{
+	struct rule_head *r;
+	unsigned int num = c->index;
+	int delta = c->head_offset - c->blob_offset;
+
+	memcpy((char *)repl->entries + c->head_offset,
+	       (char *)h->entries->entrytable + c->blob_offset, c->blob_size);
+
+	if (!iptcc_is_builtin(c))
+		num++;
+
+	list_for_each_entry(r, &c->rules, list) {
+		STRUCT_STANDARD_TARGET *t;
+
+		r->offset += delta;
+		r->index = num++;
+
+		if (r->type != IPTCC_R_JUMP && r->type != IPTCC_R_FALLTHROUGH)
+			continue;
+
+		t = (STRUCT_STANDARD_TARGET *)
+			GET_TARGET((STRUCT_ENTRY *)((char *)repl->entries
+						    + r->offset));
+		if (r->type == IPTCC_R_JUMP)
+			t->verdict = r->jump->head_offset
+				     + IPTCB_CHAIN_START_SIZE;
+		else
+			t->verdict = r->offset + r->size;
+	}
+}
+
 /* compile chain from cache into blob */
 static int iptcc_compile_chain(struct xtc_handle *h, STRUCT_REPLACE *repl, struct chain_head *c)
 {
@@ -1140,10 +1743,22 @@ static int iptcc_compile_chain(struct xtc_handle *h, STRUCT_REPLACE *repl, struc
 	struct iptcb_chain_start *head;
 	struct iptcb_chain_foot *foot;
 
+	if (iptcc_chain_reusable(h, c)) {
+		iptcc_relocate_chain(h, repl, c);
+	} else {
+		/* iterate over rules */
+		list_for_each_entry(r, &c->rules, list) {
+			ret = iptcc_compile_rule(h, repl, r);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
 	/* only user-defined chains have heaer */
 	if (!iptcc_is_builtin(c)) {
 		/* put chain header in place */
 		head = (void *)repl->entries + c->head_offset;
+		memset(head, 0, IPTCB_CHAIN_START_SIZE);
 		head->e.target_offset = sizeof(STRUCT_ENTRY);
 		head->e.next_offset = IPTCB_CHAIN_START_SIZE;
 		strcpy(head->name.target.u.user.name, ERROR_TARGET);
@@ -1155,15 +1770,9 @@ static int iptcc_compile_chain(struct xtc_handle *h, STRUCT_REPLACE *repl, struc
 		repl->underflow[c->hooknum-1] = c->foot_offset;
 	}
 
-	/* iterate over rules */
-	list_for_each_entry(r, &c->rules, list) {
-		ret = iptcc_compile_rule(h, repl, r);
-		if (ret < 0)
-			return ret;
-	}
-
 	/* put chain footer in place */
 	foot = (void *)repl->entries + c->foot_offset;
+	memset(foot, 0, IPTCB_CHAIN_FOOT_SIZE);
 	foot->e.target_offset = sizeof(STRUCT_ENTRY);
 	foot->e.next_offset = IPTCB_CHAIN_FOOT_SIZE;
 	strcpy(foot->target.target.u.user.name, STANDARD_TARGET);
@@ -1187,8 +1796,17 @@ static int iptcc_compile_chain_offsets(struct xtc_handle *h, struct chain_head *
 	struct rule_head *r;
 
 	c->head_offset = *offset;
+	c->index = *num;
 	DEBUGP("%s: chain_head %u, offset=%u\n", c->name, *num, *offset);
 
+	if (iptcc_chain_reusable(h, c)) {
+		/* Chain is copied as a whole, rule offsets are fixed
+		 * up while relocating it in iptcc_compile_chain() */
+		*offset += c->blob_size;
+		*num += c->num_rules + (iptcc_is_builtin(c) ? 0 : 1);
+		goto foot;
+	}
+
 	if (!iptcc_is_builtin(c))  {
 		/* Chain has header */
 		*offset += sizeof(STRUCT_ENTRY)
@@ -1204,6 +1822,7 @@ static int iptcc_compile_chain_offsets(struct xtc_handle *h, struct chain_head *
 		(*num)++;
 	}
 
+foot:
 	DEBUGP("%s; chain_foot %u, offset=%u, index=%u\n", c->name, *num,
 		*offset, *num);
 	c->foot_offset = *offset;
@@ -1253,6 +1872,7 @@ static int iptcc_compile_table(struct xtc_handle *h, STRUCT_REPLACE *repl)
 
 	/* Append error rule at end of chain */
 	error = (void *)repl->entries + repl->size - IPTCB_CHAIN_ERROR_SIZE;
+	memset(error, 0, IPTCB_CHAIN_ERROR_SIZE);
 	error->entry.target_offset = sizeof(STRUCT_ENTRY);
 	error->entry.next_offset = IPTCB_CHAIN_ERROR_SIZE;
 	error->target.target.u.user.target_size =
@@ -1282,15 +1902,34 @@ alloc_handle(const char *tablename, unsigned int size, unsigned int num_rules)
 	INIT_LIST_HEAD(&h->chains);
 	strcpy(h->info.name, tablename);
 
+	if (iptcc_chain_hash_alloc(h, CHAIN_HASH_MIN_SIZE) < 0)
+		goto out_free_handle;
+
+	/* Every entry becomes at most one rule, user defined chains
+	 * that don't fit go to additional arena blocks */
+	if (iptcc_arena_grow(h, num_rules * ALIGN(sizeof(struct rule_head))
+			     + NUMHOOKS * ALIGN(sizeof(struct chain_head))) < 0)
+		goto out_free_hash;
+
+	h->blob_rules = malloc((num_rules + 1) * sizeof(struct rule_head *));
+	if (!h->blob_rules)
+		goto out_free_arena;
+
 	h->entries = malloc(sizeof(STRUCT_GET_ENTRIES) + size);
 	if (!h->entries)
-		goto out_free_handle;
+		goto out_free_blob_rules;
 
 	strcpy(h->entries->name, tablename);
 	h->entries->size = size;
 
 	return h;
 
+out_free_blob_rules:
+	free(h->blob_rules);
+out_free_arena:
+	iptcc_arena_free(h);
+out_free_hash:
+	iptcc_chain_hash_free(h);
 out_free_handle:
 	free(h);
 
@@ -1389,15 +2028,23 @@ TC_FREE(struct xtc_handle *h)
 	list_for_each_entry_safe(c, tmp, &h->chains, list) {
 		struct rule_head *r, *rtmp;
 
-		list_for_each_entry_safe(r, rtmp, &c->rules, list) {
-			free(r);
+		/* Untouched chains only hold rules from the arena */
+		if (c->dirty) {
+			list_for_each_entry_safe(r, rtmp, &c->rules, list) {
+				iptcc_free_rule(r);
+			}
 		}
 
-		free(c);
+		iptcc_rule_index_free(c);
+		iptcc_fp_index_free(c);
+		iptcc_free_chain_head(c);
 	}
 
 	iptcc_chain_index_free(h);
+	iptcc_chain_hash_free(h);
+	iptcc_arena_free(h);
 
+	free(h->blob_rules);
 	free(h->entries);
 	free(h);
 }
@@ -1587,16 +2234,60 @@ static const char *standard_target_map(int verdict)
 	return NULL;
 }
 
+/* Returns the rule an entry handed out by the iterator belongs to. */
+static struct rule_head *
+iptcc_entry2rule(struct xtc_handle *handle, const STRUCT_ENTRY *e)
+{
+	const char *blob = (const char *)handle->entries->entrytable;
+	unsigned int lo, hi;
+	struct rule_head *r;
+
+	/* Entries of rules added to the cache are stored inline */
+	if ((const char *)e < blob
+	    || (const char *)e >= blob + handle->entries->size)
+		return container_of(e, struct rule_head, entry_data[0]);
+
+	/* Callers nearly always ask about the rule just returned by
+	 * the iterator, otherwise look it up among the blob's rules. */
+	r = handle->rule_iterator_cur;
+	if (r && r->entry == e)
+		return r;
+
+	lo = 0;
+	hi = handle->blob_rules_num;
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		r = handle->blob_rules[mid];
+		if (r->entry == e)
+			return r;
+		if ((const char *)r->entry < (const char *)e)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* Every rule entry of the blob has a rule_head */
+	assert(0);
+	return NULL;
+}
+
 /* Returns a pointer to the target name of this position. */
 const char *TC_GET_TARGET(const STRUCT_ENTRY *ce,
 			  struct xtc_handle *handle)
 {
 	STRUCT_ENTRY *e = (STRUCT_ENTRY *)ce;
-	struct rule_head *r = container_of(e, struct rule_head, entry[0]);
+	struct rule_head *r;
 	const unsigned char *data;
 
 	iptc_fn = TC_GET_TARGET;
 
+	r = iptcc_entry2rule(handle, e);
+	if (!r) {
+		errno = ENOENT;
+		return NULL;
+	}
+
 	switch(r->type) {
 		int spos;
 		case IPTCC_R_FALLTHROUGH:
@@ -1765,11 +2456,8 @@ TC_INSERT_ENTRY(const IPT_CHAINLABEL chain,
 	   prev points to. */
 	if (rulenum == c->num_rules) {
 		prev = &c->rules;
-	} else if (rulenum + 1 <= c->num_rules/2) {
-		r = iptcc_get_rule_num(c, rulenum + 1);
-		prev = &r->list;
 	} else {
-		r = iptcc_get_rule_num_reverse(c, c->num_rules - rulenum);
+		r = iptcc_get_rule_num(c, rulenum + 1);
 		prev = &r->list;
 	}
 
@@ -1786,8 +2474,17 @@ TC_INSERT_ENTRY(const IPT_CHAINLABEL chain,
 		return 0;
 	}
 
+	if (prev == &c->rules) {
+		iptcc_rule_index_append(c, r);
+		iptcc_fp_index_add_tail(c, r);
+	} else {
+		iptcc_rule_index_invalidate(c);
+		iptcc_fp_index_invalidate(c);
+	}
+
 	list_add_tail(&r->list, prev);
 	c->num_rules++;
+	c->dirty = 1;
 
 	set_changed(handle);
 
@@ -1803,6 +2500,7 @@ TC_REPLACE_ENTRY(const IPT_CHAINLABEL chain,
 {
 	struct chain_head *c;
 	struct rule_head *r, *old;
+	int valid;
 
 	iptc_fn = TC_REPLACE_ENTRY;
 
@@ -1816,14 +2514,57 @@ TC_REPLACE_ENTRY(const IPT_CHAINLABEL chain,
 		return 0;
 	}
 
-	/* Take advantage of the double linked list if possible. */
-	if (rulenum + 1 <= c->num_rules/2) {
-		old = iptcc_get_rule_num(c, rulenum + 1);
-	} else {
-		old = iptcc_get_rule_num_reverse(c, c->num_rules - rulenum);
+	old = iptcc_get_rule_num(c, rulenum + 1);
+
+	if (!(r = iptcc_alloc_rule(c, e->next_offset))) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	memcpy(r->entry, e, e->next_offset);
+	r->counter_map.maptype = COUNTER_MAP_SET;
+
+	if (!iptcc_map_target(handle, r)) {
+		free(r);
+		return 0;
+	}
+
+	valid = c->rule_index_valid;
+	iptcc_fp_index_invalidate(c);
+
+	list_add(&r->list, &old->list);
+	iptcc_delete_rule(old);
+
+	/* The replacement takes the same position */
+	if (valid) {
+		c->rule_index[rulenum] = r;
+		c->rule_index_valid = 1;
+	}
+
+	set_changed(handle);
+
+	return 1;
+}
+
+/* Append entry `fw' to chain `chain'.  Equivalent to insert with
+   rulenum = length of chain. */
+int
+TC_APPEND_ENTRY(const IPT_CHAINLABEL chain,
+		const STRUCT_ENTRY *e,
+		struct xtc_handle *handle)
+{
+	struct chain_head *c;
+	struct rule_head *r;
+
+	iptc_fn = TC_APPEND_ENTRY;
+	if (!(c = iptcc_find_label(chain, handle))) {
+		DEBUGP("unable to find chain `%s'\n", chain);
+		errno = ENOENT;
+		return 0;
 	}
 
 	if (!(r = iptcc_alloc_rule(c, e->next_offset))) {
+		DEBUGP("unable to allocate rule for chain `%s'\n", chain);
 		errno = ENOMEM;
 		return 0;
 	}
@@ -1832,56 +2573,218 @@ TC_REPLACE_ENTRY(const IPT_CHAINLABEL chain,
 	r->counter_map.maptype = COUNTER_MAP_SET;
 
 	if (!iptcc_map_target(handle, r)) {
+		DEBUGP("unable to map target of rule for chain `%s'\n", chain);
 		free(r);
 		return 0;
 	}
 
-	list_add(&r->list, &old->list);
-	iptcc_delete_rule(old);
+	iptcc_rule_index_append(c, r);
+	iptcc_fp_index_add_tail(c, r);
+	list_add_tail(&r->list, &c->rules);
+	c->num_rules++;
+	c->dirty = 1;
+
+	set_changed(handle);
+
+	return 1;
+}
+
+/* Build one rule per source x destination pair of the template `e' on
+ * the private list `rules', in the order repeated calls of insert
+ * (`reverse') or append would leave them in the chain.  The target is
+ * mapped once and its result copied to the other rules; jump references
+ * are only taken when the rules are spliced into the chain. */
+static int
+iptcc_alloc_rules(struct xtc_handle *handle, struct chain_head *c,
+		  const STRUCT_ENTRY *e, bool reverse,
+		  unsigned int nsaddrs, const STRUCT_ADDR saddrs[],
+		  const STRUCT_ADDR smasks[],
+		  unsigned int ndaddrs, const STRUCT_ADDR daddrs[],
+		  const STRUCT_ADDR dmasks[], struct list_head *rules)
+{
+	struct rule_head *r, *first = NULL, *tmp;
+	unsigned int i, j;
+
+	INIT_LIST_HEAD(rules);
+	for (i = 0; i < nsaddrs; i++) {
+		for (j = 0; j < ndaddrs; j++) {
+			if (!(r = iptcc_alloc_rule(c, e->next_offset))) {
+				errno = ENOMEM;
+				goto fail;
+			}
+			if (first == NULL) {
+				memcpy(r->entry, e, e->next_offset);
+				SET_ENTRY_ADDRS(r->entry, saddrs[i], smasks[i],
+						daddrs[j], dmasks[j]);
+				if (!iptcc_map_target(handle, r)) {
+					free(r);
+					return 0;
+				}
+				first = r;
+			} else {
+				memcpy(r->entry, first->entry, e->next_offset);
+				SET_ENTRY_ADDRS(r->entry, saddrs[i], smasks[i],
+						daddrs[j], dmasks[j]);
+				r->type = first->type;
+				r->jump = first->jump;
+			}
+			r->counter_map.maptype = COUNTER_MAP_SET;
+			if (reverse)
+				list_add(&r->list, rules);
+			else
+				list_add_tail(&r->list, rules);
+		}
+	}
+	return 1;
+
+fail:
+	list_for_each_entry_safe(r, tmp, rules, list)
+		free(r);
+	return 0;
+}
+
+/* Count the rules of `rules' into chain `c' and splice them in before
+ * `prev'. */
+static void
+iptcc_splice_rules(struct xtc_handle *handle, struct chain_head *c,
+		   struct list_head *rules, struct list_head *prev)
+{
+	struct rule_head *r;
+
+	list_for_each_entry(r, rules, list) {
+		if (r->type == IPTCC_R_JUMP)
+			r->jump->references++;
+		if (prev == &c->rules) {
+			iptcc_rule_index_append(c, r);
+			iptcc_fp_index_add_tail(c, r);
+		}
+		c->num_rules++;
+	}
+	if (prev != &c->rules) {
+		iptcc_rule_index_invalidate(c);
+		iptcc_fp_index_invalidate(c);
+	}
+
+	list_splice(rules, prev->prev);
+	c->dirty = 1;
+
+	set_changed(handle);
+}
+
+/* Insert a copy of `e' for every pair of source and destination address
+ * into position `rulenum' of `chain', as if TC_INSERT_ENTRY was called
+ * for each pair in turn.  Either all rules are inserted or none. */
+int
+TC_INSERT_ENTRIES(const IPT_CHAINLABEL chain,
+		  const STRUCT_ENTRY *e,
+		  unsigned int rulenum,
+		  unsigned int nsaddrs,
+		  const STRUCT_ADDR saddrs[],
+		  const STRUCT_ADDR smasks[],
+		  unsigned int ndaddrs,
+		  const STRUCT_ADDR daddrs[],
+		  const STRUCT_ADDR dmasks[],
+		  struct xtc_handle *handle)
+{
+	struct chain_head *c;
+	struct list_head rules, *prev;
+
+	iptc_fn = TC_INSERT_ENTRIES;
+
+	if (!(c = iptcc_find_label(chain, handle))) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	if (rulenum > c->num_rules) {
+		errno = E2BIG;
+		return 0;
+	}
+
+	if (rulenum == c->num_rules)
+		prev = &c->rules;
+	else
+		prev = &iptcc_get_rule_num(c, rulenum + 1)->list;
 
-	set_changed(handle);
+	if (!iptcc_alloc_rules(handle, c, e, true, nsaddrs, saddrs, smasks,
+			       ndaddrs, daddrs, dmasks, &rules))
+		return 0;
+
+	iptcc_splice_rules(handle, c, &rules, prev);
 
 	return 1;
 }
 
-/* Append entry `fw' to chain `chain'.  Equivalent to insert with
-   rulenum = length of chain. */
+/* Append a copy of `e' for every pair of source and destination address
+ * to `chain', sources varying slowest.  Either all rules are appended or
+ * none. */
 int
-TC_APPEND_ENTRY(const IPT_CHAINLABEL chain,
-		const STRUCT_ENTRY *e,
-		struct xtc_handle *handle)
+TC_APPEND_ENTRIES(const IPT_CHAINLABEL chain,
+		  const STRUCT_ENTRY *e,
+		  unsigned int nsaddrs,
+		  const STRUCT_ADDR saddrs[],
+		  const STRUCT_ADDR smasks[],
+		  unsigned int ndaddrs,
+		  const STRUCT_ADDR daddrs[],
+		  const STRUCT_ADDR dmasks[],
+		  struct xtc_handle *handle)
 {
 	struct chain_head *c;
-	struct rule_head *r;
+	struct list_head rules;
+
+	iptc_fn = TC_APPEND_ENTRIES;
 
-	iptc_fn = TC_APPEND_ENTRY;
 	if (!(c = iptcc_find_label(chain, handle))) {
 		DEBUGP("unable to find chain `%s'\n", chain);
 		errno = ENOENT;
 		return 0;
 	}
 
-	if (!(r = iptcc_alloc_rule(c, e->next_offset))) {
-		DEBUGP("unable to allocate rule for chain `%s'\n", chain);
-		errno = ENOMEM;
+	if (!iptcc_alloc_rules(handle, c, e, false, nsaddrs, saddrs, smasks,
+			       ndaddrs, daddrs, dmasks, &rules))
 		return 0;
-	}
 
-	memcpy(r->entry, e, e->next_offset);
-	r->counter_map.maptype = COUNTER_MAP_SET;
+	iptcc_splice_rules(handle, c, &rules, &c->rules);
 
-	if (!iptcc_map_target(handle, r)) {
-		DEBUGP("unable to map target of rule for chain `%s'\n", chain);
-		free(r);
-		return 0;
-	}
+	return 1;
+}
 
-	list_add_tail(&r->list, &c->rules);
-	c->num_rules++;
+/* Returns nonzero if `a' and `b' differ in any bit set in `mask'.
+ * Compares 16 bytes at a time with SSE2 where the compiler targets it,
+ * then native words, then the remaining bytes. */
+static inline int
+iptcc_masked_differ(const unsigned char *a, const unsigned char *b,
+		    const unsigned char *mask, unsigned int len)
+{
+	unsigned int i = 0;
 
-	set_changed(handle);
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16) {
+		__m128i x = _mm_xor_si128(
+				_mm_loadu_si128((const __m128i *)(a + i)),
+				_mm_loadu_si128((const __m128i *)(b + i)));
 
-	return 1;
+		x = _mm_and_si128(x,
+				  _mm_loadu_si128((const __m128i *)(mask + i)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128()))
+		    != 0xffff)
+			return 1;
+	}
+#endif
+	for (; i + sizeof(unsigned long) <= len; i += sizeof(unsigned long)) {
+		unsigned long wa, wb, wm;
+
+		memcpy(&wa, a + i, sizeof(wa));
+		memcpy(&wb, b + i, sizeof(wb));
+		memcpy(&wm, mask + i, sizeof(wm));
+		if ((wa ^ wb) & wm)
+			return 1;
+	}
+	for (; i < len; i++)
+		if ((a[i] ^ b[i]) & mask[i])
+			return 1;
+
+	return 0;
 }
 
 static inline int
@@ -1891,7 +2794,7 @@ match_different(const STRUCT_ENTRY_MATCH *a,
 		unsigned char **maskptr)
 {
 	const STRUCT_ENTRY_MATCH *b;
-	unsigned int i;
+	unsigned int len;
 
 	/* Offset of b is the same as a. */
 	b = (void *)b_elems + ((unsigned char *)a - a_elems);
@@ -1904,17 +2807,16 @@ match_different(const STRUCT_ENTRY_MATCH *a,
 
 	*maskptr += ALIGN(sizeof(*a));
 
-	for (i = 0; i < a->u.match_size - ALIGN(sizeof(*a)); i++)
-		if (((a->data[i] ^ b->data[i]) & (*maskptr)[i]) != 0)
-			return 1;
-	*maskptr += i;
+	len = a->u.match_size - ALIGN(sizeof(*a));
+	if (iptcc_masked_differ(a->data, b->data, *maskptr, len))
+		return 1;
+	*maskptr += len;
 	return 0;
 }
 
 static inline int
 target_same(struct rule_head *a, struct rule_head *b,const unsigned char *mask)
 {
-	unsigned int i;
 	STRUCT_ENTRY_TARGET *ta, *tb;
 
 	if (a->type != b->type)
@@ -1937,10 +2839,8 @@ target_same(struct rule_head *a, struct rule_head *b,const unsigned char *mask)
 		if (strcmp(ta->u.user.name, tb->u.user.name) != 0)
 			return 0;
 
-		for (i = 0; i < ta->u.target_size - sizeof(*ta); i++)
-			if (((ta->data[i] ^ tb->data[i]) & mask[i]) != 0)
-				return 0;
-		return 1;
+		return !iptcc_masked_differ(ta->data, tb->data, mask,
+					    ta->u.target_size - sizeof(*ta));
 	default:
 		fprintf(stderr, "ERROR: bad type %i\n", a->type);
 		abort();
@@ -1953,6 +2853,42 @@ is_same(const STRUCT_ENTRY *a,
 	unsigned char *matchmask);
 
 
+/* find the first rule in chain `c' which matches rule `r' under `matchmask' */
+static struct rule_head *
+iptcc_find_same_rule(struct chain_head *c, struct rule_head *r,
+		     unsigned char *matchmask)
+{
+	struct rule_head *i;
+	unsigned char *mask;
+
+	/* Only rules in the same bucket can match */
+	if (iptcc_fp_index_build(c, matchmask, r->size) > 0) {
+		struct rule_fp_index *fpi = c->fp_index;
+		struct hlist_node *pos;
+		unsigned int hash = iptcc_fp_hash(r, fpi->mask);
+
+		for (pos = fpi->buckets[hash & (fpi->size - 1)].first; pos;
+		     pos = pos->next) {
+			i = hlist_entry(pos, struct rule_head, fp_node);
+			mask = is_same(r->entry, i->entry, matchmask);
+			if (mask && target_same(r, i, mask))
+				return i;
+		}
+		return NULL;
+	}
+
+	/* No memory for the index, compare against every rule */
+	list_for_each_entry(i, &c->rules, list) {
+		mask = is_same(r->entry, i->entry, matchmask);
+		if (!mask)
+			continue;
+
+		if (target_same(r, i, mask))
+			return i;
+	}
+	return NULL;
+}
+
 /* find the first rule in `chain' which matches `fw' and remove it unless dry_run is set */
 static int delete_entry(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *origfw,
 			unsigned char *matchmask, struct xtc_handle *handle,
@@ -1990,42 +2926,34 @@ static int delete_entry(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *origfw,
 			r->jump->references--;
 	}
 
-	list_for_each_entry(i, &c->rules, list) {
-		unsigned char *mask;
-
-		mask = is_same(r->entry, i->entry, matchmask);
-		if (!mask)
-			continue;
-
-		if (!target_same(r, i, mask))
-			continue;
-
-		/* if we are just doing a dry run, we simply skip the rest */
-		if (dry_run){
-			free(r);
-			return 1;
-		}
-
-		/* If we are about to delete the rule that is the
-		 * current iterator, move rule iterator back.  next
-		 * pointer will then point to real next node */
-		if (i == handle->rule_iterator_cur) {
-			handle->rule_iterator_cur =
-				list_entry(handle->rule_iterator_cur->list.prev,
-					   struct rule_head, list);
-		}
-
-		c->num_rules--;
-		iptcc_delete_rule(i);
+	i = iptcc_find_same_rule(c, r, matchmask);
+	if (!i) {
+		free(r);
+		errno = ENOENT;
+		return 0;
+	}
 
-		set_changed(handle);
+	/* if we are just doing a dry run, we simply skip the rest */
+	if (dry_run){
 		free(r);
 		return 1;
 	}
 
+	/* If we are about to delete the rule that is the
+	 * current iterator, move rule iterator back.  next
+	 * pointer will then point to real next node */
+	if (i == handle->rule_iterator_cur) {
+		handle->rule_iterator_cur =
+			list_entry(handle->rule_iterator_cur->list.prev,
+				   struct rule_head, list);
+	}
+
+	c->num_rules--;
+	iptcc_delete_rule(i);
+
+	set_changed(handle);
 	free(r);
-	errno = ENOENT;
-	return 0;
+	return 1;
 }
 
 /* check whether a specified rule is present */
@@ -2064,12 +2992,7 @@ TC_DELETE_NUM_ENTRY(const IPT_CHAINLABEL chain,
 		return 0;
 	}
 
-	/* Take advantage of the double linked list if possible. */
-	if (rulenum + 1 <= c->num_rules/2) {
-		r = iptcc_get_rule_num(c, rulenum + 1);
-	} else {
-		r = iptcc_get_rule_num_reverse(c, c->num_rules - rulenum);
-	}
+	r = iptcc_get_rule_num(c, rulenum + 1);
 
 	/* If we are about to delete the rule that is the current
 	 * iterator, move rule iterator back.  next pointer will then
@@ -2265,6 +3188,7 @@ TC_CREATE_CHAIN(const IPT_CHAINLABEL chain, struct xtc_handle *handle)
 
 	DEBUGP("Creating chain `%s'\n", chain);
 	iptc_insert_chain(handle, c); /* Insert sorted */
+	iptcc_chain_hash_add(handle, c);
 
 	/* Inserting chains don't change the correctness of the chain
 	 * index (except if its smaller than index[0], but that
@@ -2350,7 +3274,10 @@ TC_DELETE_CHAIN(const IPT_CHAINLABEL chain, struct xtc_handle *handle)
 
 	//list_del(&c->list); /* Done in iptcc_chain_index_delete_chain() */
 	iptcc_chain_index_delete_chain(c, handle);
-	free(c);
+	iptcc_chain_hash_del(handle, c);
+	iptcc_rule_index_free(c);
+	iptcc_fp_index_free(c);
+	iptcc_free_chain_head(c);
 
 	DEBUGP("chain `%s' deleted\n", chain);
 
@@ -2391,12 +3318,14 @@ int TC_RENAME_CHAIN(const IPT_CHAINLABEL oldname,
 
 	/* This only unlinks "c" from the list, thus no free(c) */
 	iptcc_chain_index_delete_chain(c, handle);
+	iptcc_chain_hash_del(handle, c);
 
 	/* Change the name of the chain */
 	strncpy(c->name, newname, sizeof(IPT_CHAINLABEL));
 
 	/* Insert sorted into to list again */
 	iptc_insert_chain(handle, c);
+	iptcc_chain_hash_add(handle, c);
 
 	set_changed(handle);
 
@@ -2514,6 +3443,59 @@ static void counters_map_set(STRUCT_COUNTERS_INFO *newcounters,
 }
 
 
+/* CPU time spent in the commit phases, printed to stderr if the
+ * IPTC_COMMIT_STATS environment variable is set. */
+struct iptcc_commit_stats {
+	int enabled;
+	unsigned int chains;	/* number of chains */
+	unsigned int reused;	/* chains copied from the parsed blob */
+	struct timespec ts[4];	/* start, compiled, replaced, counters */
+};
+
+static void iptcc_commit_stats_init(struct xtc_handle *h,
+				    struct iptcc_commit_stats *stats)
+{
+	struct chain_head *c;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!getenv("IPTC_COMMIT_STATS"))
+		return;
+
+	stats->enabled = 1;
+	list_for_each_entry(c, &h->chains, list) {
+		stats->chains++;
+		if (iptcc_chain_reusable(h, c))
+			stats->reused++;
+	}
+}
+
+static void iptcc_commit_stats_mark(struct iptcc_commit_stats *stats,
+				    unsigned int phase)
+{
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &stats->ts[phase]);
+}
+
+static double iptcc_commit_stats_ms(const struct iptcc_commit_stats *stats,
+				    unsigned int from, unsigned int to)
+{
+	return (stats->ts[to].tv_sec - stats->ts[from].tv_sec) * 1000.0
+	       + (stats->ts[to].tv_nsec - stats->ts[from].tv_nsec) / 1000000.0;
+}
+
+static void iptcc_commit_stats_print(struct xtc_handle *h,
+				     const struct iptcc_commit_stats *stats)
+{
+	if (!stats->enabled)
+		return;
+
+	fprintf(stderr, "libiptc: commit `%s': %u/%u chains recompiled, "
+		"cpu time: compile %.3fms, replace %.3fms, counters %.3fms\n",
+		h->info.name, stats->chains - stats->reused, stats->chains,
+		iptcc_commit_stats_ms(stats, 0, 1),
+		iptcc_commit_stats_ms(stats, 1, 2),
+		iptcc_commit_stats_ms(stats, 2, 3));
+}
+
 int
 TC_COMMIT(struct xtc_handle *handle)
 {
@@ -2525,6 +3507,7 @@ TC_COMMIT(struct xtc_handle *handle)
 	size_t counterlen;
 	int new_number;
 	unsigned int new_size;
+	struct iptcc_commit_stats stats;
 
 	iptc_fn = TC_COMMIT;
 	CHECK(*handle);
@@ -2533,6 +3516,9 @@ TC_COMMIT(struct xtc_handle *handle)
 	if (!handle->changed)
 		goto finished;
 
+	iptcc_commit_stats_init(handle, &stats);
+	iptcc_commit_stats_mark(&stats, 0);
+
 	new_number = iptcc_compile_table_prep(handle, &new_size);
 	if (new_number < 0) {
 		errno = ENOMEM;
@@ -2544,7 +3530,8 @@ TC_COMMIT(struct xtc_handle *handle)
 		errno = ENOMEM;
 		goto out_zero;
 	}
-	memset(repl, 0, sizeof(*repl) + new_size);
+	/* No need to clear the entries: compilation writes every byte */
+	memset(repl, 0, sizeof(*repl));
 
 #if 0
 	TC_DUMP_ENTRIES(*handle);
@@ -2579,11 +3566,17 @@ TC_COMMIT(struct xtc_handle *handle)
 		repl->num_entries, repl->size, repl->num_counters);
 
 	ret = iptcc_compile_table(handle, repl);
+
+	/* Relocation moved the rules of untouched chains */
+	handle->blob_stale = 1;
+
 	if (ret < 0) {
 		errno = ret;
 		goto out_free_newcounters;
 	}
 
+	iptcc_commit_stats_mark(&stats, 1);
+
 
 #ifdef IPTC_DEBUG2
 	{
@@ -2601,6 +3594,8 @@ TC_COMMIT(struct xtc_handle *handle)
 	if (ret < 0)
 		goto out_free_newcounters;
 
+	iptcc_commit_stats_mark(&stats, 2);
+
 	/* Put counters back. */
 	strcpy(newcounters->name, handle->info.name);
 	newcounters->num_counters = new_number;
@@ -2677,6 +3672,9 @@ TC_COMMIT(struct xtc_handle *handle)
 	if (ret < 0)
 		goto out_free_newcounters;
 
+	iptcc_commit_stats_mark(&stats, 3);
+	iptcc_commit_stats_print(handle, &stats);
+
 	free(repl->counters);
 	free(repl);
 	free(newcounters);
@@ -2694,6 +3692,355 @@ out_zero:
 	return 0;
 }
 
+/**********************************************************************
+ * Binary blob save/restore
+ **********************************************************************/
+
+/* A saved table is this header, followed by a STRUCT_REPLACE and its
+ * entries exactly as handed to SO_SET_REPLACE.  Restoring patches the
+ * counter fields of the STRUCT_REPLACE in place and passes it on, so
+ * a mapped file goes to the kernel without being copied or parsed. */
+#define IPTCB_BLOB_MAGIC	"XTCBLOB"
+#define IPTCB_BLOB_VERSION	1
+
+struct iptcb_blob_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	family;		/* TC_AF */
+	uint32_t	abi[4];		/* sizes of entry/match/target/replace */
+	char		release[72];	/* kernel release the table was read on */
+	uint32_t	size;		/* bytes following this header */
+	uint32_t	checksum;	/* crc32 of those bytes */
+};
+
+/* Number of distinct extension revisions remembered while probing */
+#define IPTCB_REV_CACHE_SIZE	64
+
+struct iptcb_rev_cache {
+	unsigned int num;
+	struct {
+		char name[XT_EXTENSION_MAXNAMELEN];
+		uint8_t revision;
+		uint8_t target;
+	} ent[IPTCB_REV_CACHE_SIZE];
+};
+
+static uint32_t iptcb_crc32(uint32_t crc, const void *data, size_t len)
+{
+	static uint32_t table[256];
+	const unsigned char *p = data;
+	size_t i;
+
+	if (!table[1]) {
+		for (i = 0; i < 256; i++) {
+			uint32_t c = i;
+			int k;
+
+			for (k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
+
+	crc = ~crc;
+	for (i = 0; i < len; i++)
+		crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+/* fill in the fields describing the ABI we run on */
+static void iptcb_blob_header_init(struct iptcb_blob_header *hdr)
+{
+	struct utsname uts;
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, IPTCB_BLOB_MAGIC, sizeof(hdr->magic));
+	hdr->version = IPTCB_BLOB_VERSION;
+	hdr->family = TC_AF;
+	hdr->abi[0] = sizeof(STRUCT_ENTRY);
+	hdr->abi[1] = sizeof(STRUCT_ENTRY_MATCH);
+	hdr->abi[2] = sizeof(STRUCT_ENTRY_TARGET);
+	hdr->abi[3] = sizeof(STRUCT_REPLACE);
+
+	if (uname(&uts) == 0)
+		strncpy(hdr->release, uts.release, sizeof(hdr->release) - 1);
+}
+
+static int iptcb_write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Check the saved table at `data' and return its STRUCT_REPLACE */
+static STRUCT_REPLACE *
+iptcb_blob_check(void *data, size_t len)
+{
+	struct iptcb_blob_header *hdr = data, cur;
+	STRUCT_REPLACE *repl;
+	STRUCT_ENTRY *e;
+	unsigned int off, n;
+
+	if (len < sizeof(*hdr)
+	    || memcmp(hdr->magic, IPTCB_BLOB_MAGIC, sizeof(hdr->magic))
+	    || hdr->version != IPTCB_BLOB_VERSION
+	    || hdr->size < sizeof(*repl)
+	    || len - sizeof(*hdr) < hdr->size
+	    || iptcb_crc32(0, hdr + 1, hdr->size) != hdr->checksum) {
+		errno = EBADMSG;
+		return NULL;
+	}
+
+	iptcb_blob_header_init(&cur);
+	if (hdr->family != cur.family
+	    || memcmp(hdr->abi, cur.abi, sizeof(cur.abi))
+	    || strncmp(hdr->release, cur.release, sizeof(cur.release))) {
+		errno = ENOEXEC;
+		return NULL;
+	}
+
+	repl = (STRUCT_REPLACE *)(hdr + 1);
+	if (repl->size != hdr->size - sizeof(*repl)
+	    || strnlen(repl->name, TABLE_MAXNAMELEN) == TABLE_MAXNAMELEN) {
+		errno = EBADMSG;
+		return NULL;
+	}
+
+	/* Restoring walks the entries, make sure that stays inside */
+	for (off = 0, n = 0; off < repl->size; off += e->next_offset, n++) {
+		e = (void *)repl->entries + off;
+		if (repl->size - off < sizeof(*e)
+		    || e->next_offset < sizeof(*e)
+		    || e->next_offset > repl->size - off
+		    || e->target_offset < sizeof(*e)
+		    || e->target_offset + sizeof(STRUCT_ENTRY_TARGET)
+			> e->next_offset) {
+			errno = EBADMSG;
+			return NULL;
+		}
+	}
+	if (n != repl->num_entries) {
+		errno = EBADMSG;
+		return NULL;
+	}
+
+	return repl;
+}
+
+/* Ask the kernel whether it has revision `rev' of extension `name' */
+static int
+iptcb_probe_revision(int sockfd, struct iptcb_rev_cache *cache,
+		     const char *name, uint8_t rev, int target)
+{
+	struct xt_get_revision xrev;
+	socklen_t s = sizeof(xrev);
+	unsigned int i;
+
+	/* The standard and error targets are built into the table code */
+	if (target && (name[0] == '\0' || !strcmp(name, ERROR_TARGET)))
+		return 0;
+
+	for (i = 0; i < cache->num; i++)
+		if (cache->ent[i].revision == rev
+		    && cache->ent[i].target == target
+		    && !strcmp(cache->ent[i].name, name))
+			return 0;
+
+	memset(&xrev, 0, sizeof(xrev));
+	strncpy(xrev.name, name, sizeof(xrev.name) - 1);
+	xrev.revision = rev;
+	if (getsockopt(sockfd, TC_IPPROTO, target ? SO_GET_REVISION_TARGET
+		       : SO_GET_REVISION_MATCH, &xrev, &s) < 0)
+		return -1;
+
+	if (cache->num < IPTCB_REV_CACHE_SIZE) {
+		strcpy(cache->ent[cache->num].name, xrev.name);
+		cache->ent[cache->num].revision = rev;
+		cache->ent[cache->num].target = target;
+		cache->num++;
+	}
+	return 0;
+}
+
+/* Make sure the kernel supports every match and target revision used */
+static int iptcb_blob_check_revisions(int sockfd, STRUCT_REPLACE *repl)
+{
+	struct iptcb_rev_cache cache = { .num = 0 };
+	STRUCT_ENTRY_MATCH *m;
+	STRUCT_ENTRY_TARGET *t;
+	STRUCT_ENTRY *e;
+	unsigned int off, moff;
+
+	for (off = 0; off < repl->size; off += e->next_offset) {
+		e = (void *)repl->entries + off;
+
+		for (moff = sizeof(*e); moff < e->target_offset;
+		     moff += m->u.match_size) {
+			m = (void *)e + moff;
+			if (e->target_offset - moff < sizeof(*m)
+			    || m->u.match_size < sizeof(*m)) {
+				errno = EBADMSG;
+				return -1;
+			}
+			m->u.user.name[sizeof(m->u.user.name) - 1] = '\0';
+			if (iptcb_probe_revision(sockfd, &cache,
+						 m->u.user.name,
+						 m->u.user.revision, 0) < 0)
+				return -1;
+		}
+
+		t = GET_TARGET(e);
+		t->u.user.name[sizeof(t->u.user.name) - 1] = '\0';
+		if (iptcb_probe_revision(sockfd, &cache, t->u.user.name,
+					 t->u.user.revision, 1) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Put the counters saved with the entries back */
+static int iptcb_blob_set_counters(int sockfd, STRUCT_REPLACE *repl)
+{
+	STRUCT_COUNTERS_INFO *newcounters;
+	STRUCT_ENTRY *e;
+	size_t counterlen;
+	unsigned int off, i;
+	int ret;
+
+	counterlen = sizeof(STRUCT_COUNTERS_INFO)
+			+ sizeof(STRUCT_COUNTERS) * repl->num_entries;
+	newcounters = malloc(counterlen);
+	if (!newcounters) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	strcpy(newcounters->name, repl->name);
+	newcounters->num_counters = repl->num_entries;
+	for (off = 0, i = 0; off < repl->size; off += e->next_offset, i++) {
+		e = (void *)repl->entries + off;
+		newcounters->counters[i] = e->counters;
+	}
+
+	ret = setsockopt(sockfd, TC_IPPROTO, SO_SET_ADD_COUNTERS,
+			 newcounters, counterlen);
+	free(newcounters);
+	return ret;
+}
+
+int
+TC_SAVE_BLOB(struct xtc_handle *handle, int fd)
+{
+	struct iptcb_blob_header hdr;
+	STRUCT_REPLACE repl;
+
+	iptc_fn = TC_SAVE_BLOB;
+
+	/* What we save is the blob from the kernel, not the cache */
+	if (handle->changed) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	memset(&repl, 0, sizeof(repl));
+	strcpy(repl.name, handle->info.name);
+	repl.valid_hooks = handle->info.valid_hooks;
+	repl.num_entries = handle->info.num_entries;
+	repl.size = handle->info.size;
+	memcpy(repl.hook_entry, handle->info.hook_entry,
+	       sizeof(repl.hook_entry));
+	memcpy(repl.underflow, handle->info.underflow,
+	       sizeof(repl.underflow));
+
+	iptcb_blob_header_init(&hdr);
+	hdr.size = sizeof(repl) + repl.size;
+	hdr.checksum = iptcb_crc32(0, &repl, sizeof(repl));
+	hdr.checksum = iptcb_crc32(hdr.checksum, handle->entries->entrytable,
+				   repl.size);
+
+	if (iptcb_write_all(fd, &hdr, sizeof(hdr)) < 0
+	    || iptcb_write_all(fd, &repl, sizeof(repl)) < 0
+	    || iptcb_write_all(fd, handle->entries->entrytable,
+			       repl.size) < 0)
+		return 0;
+
+	return 1;
+}
+
+size_t
+TC_RESTORE_BLOB(void *data, size_t len, const char *tablename,
+		int counters, int testing)
+{
+	struct iptcb_blob_header *hdr = data;
+	STRUCT_REPLACE *repl;
+	STRUCT_GETINFO info;
+	socklen_t s;
+	int sockfd;
+
+	iptc_fn = TC_RESTORE_BLOB;
+
+	repl = iptcb_blob_check(data, len);
+	if (!repl)
+		return 0;
+
+	sockfd = socket(TC_AF, SOCK_RAW, IPPROTO_RAW);
+	if (sockfd < 0)
+		return 0;
+
+	if (iptcb_blob_check_revisions(sockfd, repl) < 0)
+		goto out_close;
+
+	if (testing || (tablename && strcmp(tablename, repl->name) != 0))
+		goto out;
+
+retry:
+	s = sizeof(info);
+	strcpy(info.name, repl->name);
+	if (getsockopt(sockfd, TC_IPPROTO, SO_GET_INFO, &info, &s) < 0)
+		goto out_close;
+
+	/* These are the old counters we will get from kernel */
+	repl->num_counters = info.num_entries;
+	repl->counters = malloc(sizeof(STRUCT_COUNTERS) * info.num_entries);
+	if (!repl->counters) {
+		errno = ENOMEM;
+		goto out_close;
+	}
+
+	if (setsockopt(sockfd, TC_IPPROTO, SO_SET_REPLACE, repl,
+		       sizeof(*repl) + repl->size) < 0) {
+		free(repl->counters);
+		/* A different process changed the ruleset size, retry */
+		if (errno == EAGAIN)
+			goto retry;
+		goto out_close;
+	}
+	free(repl->counters);
+	repl->counters = NULL;
+
+	if (counters && iptcb_blob_set_counters(sockfd, repl) < 0)
+		goto out_close;
+out:
+	close(sockfd);
+	return sizeof(*hdr) + hdr->size;
+
+out_close:
+	close(sockfd);
+	return 0;
+}
+
 /* Translates errno numbers into more human-readable form than strerror. */
 const char *
 TC_STRERROR(int err)
@@ -2714,12 +4061,14 @@ TC_STRERROR(int err)
 	      "Can't delete chain with references left" },
 	    { TC_CREATE_CHAIN, EEXIST, "Chain already exists" },
 	    { TC_INSERT_ENTRY, E2BIG, "Index of insertion too big" },
+	    { TC_INSERT_ENTRIES, E2BIG, "Index of insertion too big" },
 	    { TC_REPLACE_ENTRY, E2BIG, "Index of replacement too big" },
 	    { TC_DELETE_NUM_ENTRY, E2BIG, "Index of deletion too big" },
 	    { TC_READ_COUNTER, E2BIG, "Index of counter too big" },
 	    { TC_ZERO_COUNTER, E2BIG, "Index of counter too big" },
 	    { TC_INSERT_ENTRY, ELOOP, "Loop found in table" },
 	    { TC_INSERT_ENTRY, EINVAL, "Target problem" },
+	    { TC_INSERT_ENTRIES, EINVAL, "Target problem" },
 	    /* ENOENT for DELETE probably means no matching rule */
 	    { TC_DELETE_ENTRY, ENOENT,
 	      "Bad rule (does a matching rule exist in that chain?)" },
@@ -2727,6 +4076,14 @@ TC_STRERROR(int err)
 	      "Bad built-in chain name" },
 	    { TC_SET_POLICY, EINVAL,
 	      "Bad policy name" },
+	    { TC_SAVE_BLOB, EINVAL,
+	      "Table was modified, save it before making changes" },
+	    { TC_RESTORE_BLOB, EBADMSG,
+	      "Saved table is truncated or corrupt" },
+	    { TC_RESTORE_BLOB, ENOEXEC,
+	      "Saved table is from a different kernel or architecture" },
+	    { TC_RESTORE_BLOB, EPROTONOSUPPORT,
+	      "Saved table uses a match or target revision this kernel lacks" },
 
 	    { NULL, 0, "Incompatible with this kernel" },
 	    { NULL, ENOPROTOOPT, "iptables who? (do you need to insmod?)" },
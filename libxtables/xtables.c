@@ -21,11 +21,13 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -49,6 +51,7 @@
 #include <libiptc/libxtc.h>
 
 #ifndef NO_SHARED_LIBS
+#include <dirent.h>
 #include <dlfcn.h>
 #endif
 #ifndef IPT_SO_GET_REVISION_MATCH /* Old kernel source. */
@@ -176,18 +179,57 @@ static const char *xtables_libdir;
 /* the path to command to load kernel module */
 const char *xtables_modprobe_program;
 
-/* Keep track of matches/targets pending full registration: linked lists. */
-struct xtables_match *xtables_pending_matches;
-struct xtables_target *xtables_pending_targets;
-
 /* Keep track of fully registered external matches/targets: linked lists. */
 struct xtables_match *xtables_matches;
 struct xtables_target *xtables_targets;
 
+/*
+ * Index of extensions by name.  Each slot holds the matches and targets of
+ * that name still pending full registration (linked through ->next, most
+ * recently registered first) and the one that won registration, so finding
+ * an extension does not walk every extension that was ever registered -
+ * which, in a build with all extensions linked in, is all of them.
+ */
+#define XT_EXT_BUCKETS	256
+
+struct xt_ext_slot {
+	struct xt_ext_slot *next;
+	struct xtables_match *pending_matches;
+	struct xtables_target *pending_targets;
+	struct xtables_match *match;
+	struct xtables_target *target;
+	char name[XT_EXTENSION_MAXNAMELEN];
+};
+
+static struct xt_ext_slot *xt_ext_index[XT_EXT_BUCKETS];
+
 /* Fully register a match/target which was previously partially registered. */
 static void xtables_fully_register_pending_match(struct xtables_match *me);
 static void xtables_fully_register_pending_target(struct xtables_target *me);
 
+static struct xt_ext_slot *xt_ext_slot(const char *name, bool create)
+{
+	struct xt_ext_slot **bucket, *slot;
+	uint32_t h = 2166136261U;
+	const char *p;
+
+	for (p = name; *p != '\0'; ++p)
+		h = (h ^ (unsigned char)*p) * 16777619U;
+	bucket = &xt_ext_index[h % XT_EXT_BUCKETS];
+
+	for (slot = *bucket; slot != NULL; slot = slot->next)
+		if (strcmp(slot->name, name) == 0)
+			return slot;
+	if (!create)
+		return NULL;
+
+	slot = xtables_calloc(1, sizeof(*slot));
+	strcpy(slot->name, name);
+	slot->next = *bucket;
+	*bucket = slot;
+	return slot;
+}
+
 void xtables_init(void)
 {
 	xtables_libdir = getenv("XTABLES_LIBDIR");
@@ -537,27 +579,141 @@ void xtables_parse_interface(const char *arg, char *vianame,
 }
 
 #ifndef NO_SHARED_LIBS
+/*
+ * The extension directories are read once per process, and
+ * load_extension() looks file names up in that listing rather than
+ * stat()ing every directory/prefix combination for every extension.
+ * A directory that could not be read is probed with stat() as before.
+ */
+struct xt_libdir {
+	char *path;
+	char **files;		/* sorted; NULL if the directory was not read */
+	unsigned int nfiles;
+};
+
+static char *xt_libdir_search;
+static struct xt_libdir *xt_libdirs;
+static unsigned int xt_libdir_count;
+
+static int xt_libdir_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void xt_libdir_read(struct xt_libdir *ld)
+{
+	unsigned int size = 0;
+	struct dirent *de;
+	char **files;
+	DIR *dir;
+
+	/* an empty search path element names the root, as in "%s/%s" */
+	dir = opendir(*ld->path != '\0' ? ld->path : "/");
+	if (dir == NULL) {
+		/* nothing to find in a directory that is not there */
+		if (errno == ENOENT || errno == ENOTDIR)
+			ld->files = calloc(1, sizeof(*ld->files));
+		return;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		size_t len = strlen(de->d_name);
+
+		if (len <= 3 || strcmp(de->d_name + len - 3, ".so") != 0)
+			continue;
+		if (ld->nfiles == size) {
+			size = size ? 2 * size : 64;
+			files = realloc(ld->files, size * sizeof(*files));
+			if (files == NULL)
+				goto fail;
+			ld->files = files;
+		}
+		ld->files[ld->nfiles] = strdup(de->d_name);
+		if (ld->files[ld->nfiles] == NULL)
+			goto fail;
+		++ld->nfiles;
+	}
+	closedir(dir);
+
+	/* an empty directory still counts as read */
+	if (ld->files == NULL)
+		ld->files = calloc(1, sizeof(*ld->files));
+	if (ld->files != NULL)
+		qsort(ld->files, ld->nfiles, sizeof(*ld->files),
+		      xt_libdir_cmp);
+	return;
+
+ fail:
+	closedir(dir);
+	while (ld->nfiles > 0)
+		free(ld->files[--ld->nfiles]);
+	free(ld->files);
+	ld->files = NULL;
+}
+
+static void xt_libdir_index(const char *search_path)
+{
+	const char *dir = search_path, *next;
+	unsigned int i;
+
+	if (xt_libdir_search != NULL &&
+	    strcmp(xt_libdir_search, search_path) == 0)
+		return;
+
+	for (i = 0; i < xt_libdir_count; ++i) {
+		while (xt_libdirs[i].nfiles > 0)
+			free(xt_libdirs[i].files[--xt_libdirs[i].nfiles]);
+		free(xt_libdirs[i].files);
+		free(xt_libdirs[i].path);
+	}
+	free(xt_libdirs);
+	free(xt_libdir_search);
+
+	xt_libdir_count = 1;
+	for (next = search_path; (next = strchr(next, ':')) != NULL; ++next)
+		++xt_libdir_count;
+	xt_libdirs = xtables_calloc(xt_libdir_count, sizeof(*xt_libdirs));
+	xt_libdir_search = strdup(search_path);
+	if (xt_libdir_search == NULL)
+		xtables_error(OTHER_PROBLEM, "strdup: %s", strerror(errno));
+
+	for (i = 0; i < xt_libdir_count; ++i, dir = next + 1) {
+		next = strchr(dir, ':');
+		if (next == NULL)
+			next = dir + strlen(dir);
+		xt_libdirs[i].path = strndup(dir, next - dir);
+		if (xt_libdirs[i].path == NULL)
+			xtables_error(OTHER_PROBLEM, "strndup: %s",
+				      strerror(errno));
+		xt_libdir_read(&xt_libdirs[i]);
+	}
+}
+
 static void *load_extension(const char *search_path, const char *af_prefix,
     const char *name, bool is_target)
 {
 	const char *all_prefixes[] = {"libxt_", af_prefix, NULL};
 	const char **prefix;
-	const char *dir = search_path, *next;
+	const struct xt_libdir *ld;
 	void *ptr = NULL;
 	struct stat sb;
-	char path[256];
+	char file[256], path[256];
+	const char *key = file;
 
-	do {
-		next = strchr(dir, ':');
-		if (next == NULL)
-			next = dir + strlen(dir);
+	xt_libdir_index(search_path);
 
+	for (ld = xt_libdirs; ld < xt_libdirs + xt_libdir_count; ++ld) {
 		for (prefix = all_prefixes; *prefix != NULL; ++prefix) {
-			snprintf(path, sizeof(path), "%.*s/%s%s.so",
-			         (unsigned int)(next - dir), dir,
-			         *prefix, name);
-
-			if (stat(path, &sb) != 0) {
+			snprintf(file, sizeof(file), "%s%s.so", *prefix, name);
+			snprintf(path, sizeof(path), "%s/%s%s.so",
+				 ld->path, *prefix, name);
+
+			if (ld->files != NULL) {
+				if (bsearch(&key, ld->files, ld->nfiles,
+					    sizeof(*ld->files),
+					    xt_libdir_cmp) == NULL)
+					continue;
+			} else if (stat(path, &sb) != 0) {
 				if (errno == ENOENT)
 					continue;
 				fprintf(stderr, "%s: %s\n", path,
@@ -581,9 +737,9 @@ static void *load_extension(const char *search_path, const char *af_prefix,
 			errno = ENOENT;
 			return NULL;
 		}
-		dir = next + 1;
-	} while (*next != '\0');
+	}
 
+	errno = ENOENT;
 	return NULL;
 }
 #endif
@@ -592,8 +748,8 @@ struct xtables_match *
 xtables_find_match(const char *name, enum xtables_tryload tryload,
 		   struct xtables_rule_match **matches)
 {
-	struct xtables_match **dptr;
-	struct xtables_match *ptr;
+	struct xt_ext_slot *slot;
+	struct xtables_match *ptr = NULL;
 	const char *icmp6 = "icmp6";
 
 	if (strlen(name) >= XT_EXTENSION_MAXNAMELEN)
@@ -603,32 +759,26 @@ xtables_find_match(const char *name, enum xtables_tryload tryload,
 
 	/* This is ugly as hell. Nonetheless, there is no way of changing
 	 * this without hurting backwards compatibility */
-	if ( (strcmp(name,"icmpv6") == 0) ||
+	if (name[0] == 'i' &&
+	    ((strcmp(name,"icmpv6") == 0) ||
 	     (strcmp(name,"ipv6-icmp") == 0) ||
-	     (strcmp(name,"icmp6") == 0) )
+	     (strcmp(name,"icmp6") == 0)))
 		name = icmp6;
 
-	/* Trigger delayed initialization */
-	for (dptr = &xtables_pending_matches; *dptr; ) {
-		if (strcmp(name, (*dptr)->name) == 0) {
-			ptr = *dptr;
-			*dptr = (*dptr)->next;
+	slot = xt_ext_slot(name, false);
+	if (slot != NULL) {
+		/* Trigger delayed initialization */
+		while ((ptr = slot->pending_matches) != NULL) {
+			slot->pending_matches = ptr->next;
 			ptr->next = NULL;
 			xtables_fully_register_pending_match(ptr);
-		} else {
-			dptr = &((*dptr)->next);
 		}
-	}
 
-	for (ptr = xtables_matches; ptr; ptr = ptr->next) {
-		if (strcmp(name, ptr->name) == 0) {
+		ptr = slot->match;
+		/* Second and subsequent uses get a clone */
+		if (ptr != NULL && ptr->m != NULL) {
 			struct xtables_match *clone;
 
-			/* First match of this type: */
-			if (ptr->m == NULL)
-				break;
-
-			/* Second and subsequent clones */
 			clone = xtables_malloc(sizeof(struct xtables_match));
 			memcpy(clone, ptr, sizeof(struct xtables_match));
 			clone->udata = NULL;
@@ -637,7 +787,6 @@ xtables_find_match(const char *name, enum xtables_tryload tryload,
 			clone->next = clone;
 
 			ptr = clone;
-			break;
 		}
 	}
 
@@ -683,35 +832,42 @@ xtables_find_match(const char *name, enum xtables_tryload tryload,
 	return ptr;
 }
 
+/* Is @name one of the verdicts that the "standard" target carries? */
+static bool xt_is_standard_target(const char *name)
+{
+	switch (name[0]) {
+	case '\0':
+		return true;
+	case 'A':
+		return strcmp(name, XTC_LABEL_ACCEPT) == 0;
+	case 'D':
+		return strcmp(name, XTC_LABEL_DROP) == 0;
+	case 'Q':
+		return strcmp(name, XTC_LABEL_QUEUE) == 0;
+	case 'R':
+		return strcmp(name, XTC_LABEL_RETURN) == 0;
+	}
+	return false;
+}
+
 struct xtables_target *
 xtables_find_target(const char *name, enum xtables_tryload tryload)
 {
-	struct xtables_target **dptr;
-	struct xtables_target *ptr;
+	struct xt_ext_slot *slot;
+	struct xtables_target *ptr = NULL;
 
-	/* Standard target? */
-	if (strcmp(name, "") == 0
-	    || strcmp(name, XTC_LABEL_ACCEPT) == 0
-	    || strcmp(name, XTC_LABEL_DROP) == 0
-	    || strcmp(name, XTC_LABEL_QUEUE) == 0
-	    || strcmp(name, XTC_LABEL_RETURN) == 0)
+	if (xt_is_standard_target(name))
 		name = "standard";
 
-	/* Trigger delayed initialization */
-	for (dptr = &xtables_pending_targets; *dptr; ) {
-		if (strcmp(name, (*dptr)->name) == 0) {
-			ptr = *dptr;
-			*dptr = (*dptr)->next;
+	slot = xt_ext_slot(name, false);
+	if (slot != NULL) {
+		/* Trigger delayed initialization */
+		while ((ptr = slot->pending_targets) != NULL) {
+			slot->pending_targets = ptr->next;
 			ptr->next = NULL;
 			xtables_fully_register_pending_target(ptr);
-		} else {
-			dptr = &((*dptr)->next);
 		}
-	}
-
-	for (ptr = xtables_targets; ptr; ptr = ptr->next) {
-		if (strcmp(name, ptr->name) == 0)
-			break;
+		ptr = slot->target;
 	}
 
 #ifndef NO_SHARED_LIBS
@@ -745,30 +901,39 @@ xtables_find_target(const char *name, enum xtables_tryload tryload)
 
 int xtables_compatible_revision(const char *name, uint8_t revision, int opt)
 {
+	/* one socket serves all the probes of a process */
+	static int sockfd = -1, sockfamily;
 	struct xt_get_revision rev;
 	socklen_t s = sizeof(rev);
-	int max_rev, sockfd;
+	int max_rev;
 
-	sockfd = socket(afinfo->family, SOCK_RAW, IPPROTO_RAW);
+	if (sockfd >= 0 && sockfamily != afinfo->family) {
+		close(sockfd);
+		sockfd = -1;
+	}
 	if (sockfd < 0) {
-		if (errno == EPERM) {
-			/* revision 0 is always supported. */
-			if (revision != 0)
-				fprintf(stderr, "%s: Could not determine whether "
-						"revision %u is supported, "
-						"assuming it is.\n",
-					name, revision);
-			return 1;
+		sockfd = socket(afinfo->family, SOCK_RAW, IPPROTO_RAW);
+		if (sockfd < 0) {
+			if (errno == EPERM) {
+				/* revision 0 is always supported. */
+				if (revision != 0)
+					fprintf(stderr, "%s: Could not determine "
+						"whether revision %u is "
+						"supported, assuming it is.\n",
+						name, revision);
+				return 1;
+			}
+			fprintf(stderr, "Could not open socket to kernel: %s\n",
+				strerror(errno));
+			exit(1);
 		}
-		fprintf(stderr, "Could not open socket to kernel: %s\n",
-			strerror(errno));
-		exit(1);
-	}
 
-	if (fcntl(sockfd, F_SETFD, FD_CLOEXEC) == -1) {
-		fprintf(stderr, "Could not set close on exec: %s\n",
-			strerror(errno));
-		exit(1);
+		if (fcntl(sockfd, F_SETFD, FD_CLOEXEC) == -1) {
+			fprintf(stderr, "Could not set close on exec: %s\n",
+				strerror(errno));
+			exit(1);
+		}
+		sockfamily = afinfo->family;
 	}
 
 	xtables_load_ko(xtables_modprobe_program, true);
@@ -780,10 +945,8 @@ int xtables_compatible_revision(const char *name, uint8_t revision, int opt)
 	if (max_rev < 0) {
 		/* Definitely don't support this? */
 		if (errno == ENOENT || errno == EPROTONOSUPPORT) {
-			close(sockfd);
 			return 0;
 		} else if (errno == ENOPROTOOPT) {
-			close(sockfd);
 			/* Assume only revision 0 support (old kernel) */
 			return (revision == 0);
 		} else {
@@ -792,19 +955,178 @@ int xtables_compatible_revision(const char *name, uint8_t revision, int opt)
 			exit(1);
 		}
 	}
-	close(sockfd);
 	return 1;
 }
 
+/*
+ * Answers to revision probes are kept for the life of the process and,
+ * for root, in XT_REVISION_CACHE, so that later invocations need not ask
+ * the kernel again.  The file is only believed if it was written during
+ * the current boot with the same set of modules loaded, since loading a
+ * module can make new revisions available.
+ */
+#ifndef XT_REVISION_CACHE
+#define XT_REVISION_CACHE	"/run/xtables.revisions"
+#endif
+
+struct xt_rev_probe {
+	struct xt_rev_probe *next;
+	char prober;		/* 'l' legacy getsockopt, 'n' other */
+	int opt;
+	unsigned int revision;
+	int result;
+	char name[XT_EXTENSION_MAXNAMELEN];
+};
+
+static struct xt_rev_probe *xt_rev_probes;
+static bool xt_rev_loaded, xt_rev_dirty;
+
+/* Describe the current boot and module set, "" if that is not possible */
+static void xt_rev_stamp(char *buf, size_t size)
+{
+	uint64_t h = 14695981039346656037ULL;
+	char mod[256], boot[64];
+	FILE *fp;
+	char *p;
+
+	buf[0] = '\0';
+	fp = fopen("/proc/sys/kernel/random/boot_id", "r");
+	if (fp == NULL)
+		return;
+	p = fgets(boot, sizeof(boot), fp);
+	fclose(fp);
+	if (p == NULL)
+		return;
+	boot[strcspn(boot, "\n")] = '\0';
+
+	/* only the names: use counts and states change all the time */
+	fp = fopen("/proc/modules", "r");
+	if (fp != NULL) {
+		while (fgets(mod, sizeof(mod), fp) != NULL) {
+			if (strchr(mod, '\n') == NULL)
+				continue;	/* tail of an overlong line */
+			for (p = mod; *p != ' ' && *p != '\n'; ++p)
+				h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+			h = (h ^ '\n') * 1099511628211ULL;
+		}
+		fclose(fp);
+	}
+	snprintf(buf, size, "%s %016" PRIx64, boot, h);
+}
+
+static struct xt_rev_probe *
+xt_rev_add(char prober, int opt, const char *name, unsigned int revision,
+	   int result)
+{
+	struct xt_rev_probe *rp = xtables_calloc(1, sizeof(*rp));
+
+	rp->prober = prober;
+	rp->opt = opt;
+	rp->revision = revision;
+	rp->result = result;
+	strcpy(rp->name, name);
+	rp->next = xt_rev_probes;
+	xt_rev_probes = rp;
+	return rp;
+}
+
+static void xt_rev_load(void)
+{
+	char stamp[128], entry[128], name[XT_EXTENSION_MAXNAMELEN];
+	unsigned int revision;
+	int opt, result;
+	struct stat sb;
+	char prober;
+	FILE *fp;
+
+	fp = fopen(XT_REVISION_CACHE, "r");
+	if (fp == NULL)
+		return;
+	/* believe only what root wrote */
+	if (fstat(fileno(fp), &sb) < 0 || sb.st_uid != 0 ||
+	    (sb.st_mode & (S_IWGRP | S_IWOTH)))
+		goto out;
+
+	xt_rev_stamp(stamp, sizeof(stamp));
+	if (stamp[0] == '\0' || fgets(entry, sizeof(entry), fp) == NULL ||
+	    strncmp(entry, "# ", 2) != 0 ||
+	    strncmp(entry + 2, stamp, strlen(stamp)) != 0 ||
+	    entry[2 + strlen(stamp)] != '\n')
+		goto out;
+
+	while (fgets(entry, sizeof(entry), fp) != NULL)
+		if (sscanf(entry, "%c %d %28s %u %d", &prober, &opt, name,
+			   &revision, &result) == 5)
+			xt_rev_add(prober, opt, name, revision, result);
+ out:
+	fclose(fp);
+}
+
+static void xt_rev_save(void)
+{
+	char stamp[128], tmp[] = XT_REVISION_CACHE ".XXXXXX";
+	const struct xt_rev_probe *rp;
+	FILE *fp;
+	int fd;
+
+	if (!xt_rev_dirty || geteuid() != 0)
+		return;
+	xt_rev_stamp(stamp, sizeof(stamp));
+	if (stamp[0] == '\0')
+		return;
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+	fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	fchmod(fd, 0644);
+	fprintf(fp, "# %s\n", stamp);
+	for (rp = xt_rev_probes; rp != NULL; rp = rp->next)
+		fprintf(fp, "%c %d %s %u %d\n", rp->prober, rp->opt,
+			rp->name, rp->revision, rp->result);
+	if (fclose(fp) != 0 || rename(tmp, XT_REVISION_CACHE) < 0)
+		unlink(tmp);
+}
+
+static int xt_compat_rev(const char *name, uint8_t revision, int opt)
+{
+	char prober = xt_params->compat_rev == xtables_compatible_revision ?
+		      'l' : 'n';
+	const struct xt_rev_probe *rp;
+	int result;
+
+	if (!xt_rev_loaded) {
+		xt_rev_loaded = true;
+		xt_rev_load();
+	}
+	for (rp = xt_rev_probes; rp != NULL; rp = rp->next)
+		if (rp->prober == prober && rp->opt == opt &&
+		    rp->revision == revision && strcmp(rp->name, name) == 0)
+			return rp->result;
+
+	result = xt_params->compat_rev(name, revision, opt);
+	xt_rev_add(prober, opt, name, revision, result);
+	if (!xt_rev_dirty) {
+		xt_rev_dirty = true;
+		atexit(xt_rev_save);
+	}
+	return result;
+}
+
 
 static int compatible_match_revision(const char *name, uint8_t revision)
 {
-	return xt_params->compat_rev(name, revision, afinfo->so_rev_match);
+	return xt_compat_rev(name, revision, afinfo->so_rev_match);
 }
 
 static int compatible_target_revision(const char *name, uint8_t revision)
 {
-	return xt_params->compat_rev(name, revision, afinfo->so_rev_target);
+	return xt_compat_rev(name, revision, afinfo->so_rev_target);
 }
 
 static void xtables_check_options(const char *name, const struct option *opt)
@@ -820,6 +1142,8 @@ static void xtables_check_options(const char *name, const struct option *opt)
 
 void xtables_register_match(struct xtables_match *me)
 {
+	struct xt_ext_slot *slot;
+
 	if (me->version == NULL) {
 		fprintf(stderr, "%s: match %s<%u> is missing a version\n",
 		        xt_params->program_name, me->name, me->revision);
@@ -855,9 +1179,10 @@ void xtables_register_match(struct xtables_match *me)
 	if (me->family != afinfo->family && me->family != AF_UNSPEC)
 		return;
 
-	/* place on linked list of matches pending full registration */
-	me->next = xtables_pending_matches;
-	xtables_pending_matches = me;
+	/* place on the list of matches of this name pending full registration */
+	slot = xt_ext_slot(me->name, true);
+	me->next = slot->pending_matches;
+	slot->pending_matches = me;
 }
 
 /**
@@ -964,6 +1289,7 @@ static void xtables_fully_register_pending_match(struct xtables_match *me)
 	for (i = &xtables_matches; *i; i = &(*i)->next);
 	me->next = NULL;
 	*i = me;
+	xt_ext_slot(me->name, true)->match = me;
 
 	me->m = NULL;
 	me->mflags = 0;
@@ -978,6 +1304,8 @@ void xtables_register_matches(struct xtables_match *match, unsigned int n)
 
 void xtables_register_target(struct xtables_target *me)
 {
+	struct xt_ext_slot *slot;
+
 	if (me->version == NULL) {
 		fprintf(stderr, "%s: target %s<%u> is missing a version\n",
 		        xt_params->program_name, me->name, me->revision);
@@ -1013,9 +1341,10 @@ void xtables_register_target(struct xtables_target *me)
 	if (me->family != afinfo->family && me->family != AF_UNSPEC)
 		return;
 
-	/* place on linked list of targets pending full registration */
-	me->next = xtables_pending_targets;
-	xtables_pending_targets = me;
+	/* place on the list of targets of this name pending full registration */
+	slot = xt_ext_slot(me->name, true);
+	me->next = slot->pending_targets;
+	slot->pending_targets = me;
 }
 
 static void xtables_fully_register_pending_target(struct xtables_target *me)
@@ -1062,6 +1391,7 @@ static void xtables_fully_register_pending_target(struct xtables_target *me)
 	/* Prepend to list. */
 	me->next = xtables_targets;
 	xtables_targets = me;
+	xt_ext_slot(me->name, true)->target = me;
 	me->t = NULL;
 	me->tflags = 0;
 }
@@ -1173,24 +1503,543 @@ void xtables_param_act(unsigned int status, const char *p1, ...)
 	va_end(args);
 }
 
+/*
+ * Rule listings and saves are dominated by small numbers and addresses,
+ * so these are formatted by hand rather than through the printf engine.
+ * xt_fmt_uint() writes backwards from @end and returns the first digit.
+ */
+static char *xt_fmt_uint(char *end, uint64_t number)
+{
+	do {
+		*--end = '0' + number % 10;
+		number /= 10;
+	} while (number != 0);
+	return end;
+}
+
+static char *xt_fmt_ipaddr(char *p, const struct in_addr *addrp)
+{
+	const unsigned char *bytep = (const void *)&addrp->s_addr;
+	unsigned int i;
+
+	for (i = 0; i < 4; ++i) {
+		if (i > 0)
+			*p++ = '.';
+		if (bytep[i] >= 100)
+			*p++ = '0' + bytep[i] / 100;
+		if (bytep[i] >= 10)
+			*p++ = '0' + bytep[i] / 10 % 10;
+		*p++ = '0' + bytep[i] % 10;
+	}
+	*p = '\0';
+	return p;
+}
+
 const char *xtables_ipaddr_to_numeric(const struct in_addr *addrp)
 {
 	static char buf[20];
-	const unsigned char *bytep = (const void *)&addrp->s_addr;
 
-	sprintf(buf, "%u.%u.%u.%u", bytep[0], bytep[1], bytep[2], bytep[3]);
+	xt_fmt_ipaddr(buf, addrp);
 	return buf;
 }
 
-static const char *ipaddr_to_host(const struct in_addr *addr)
+/*
+ * Host name lookups are memoized for the life of the process, keyed by
+ * name and family; names that did not resolve are remembered too.  The
+ * addresses of a name are kept sorted, so that the rules made from it do
+ * not depend on the order the resolver happened to return them in.
+ * xtables_host_prefetch() fills the cache from several threads at once.
+ */
+#define XT_HOST_BUCKETS	1024
+#define XT_HOST_WORKERS	16
+
+struct xt_host {
+	struct xt_host *next;
+	int family;
+	unsigned int naddrs;
+	void *addrs;
+	char name[];
+};
+
+static struct xt_host *xt_hosts[XT_HOST_BUCKETS];
+static pthread_mutex_t xt_hosts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t xt_host_addrlen(int family)
+{
+	return family == AF_INET ? sizeof(struct in_addr) :
+				   sizeof(struct in6_addr);
+}
+
+static unsigned int xt_host_hash(const char *name, int family)
 {
-	struct hostent *host;
+	uint32_t h = 2166136261U ^ family;
 
-	host = gethostbyaddr(addr, sizeof(struct in_addr), AF_INET);
-	if (host == NULL)
+	while (*name != '\0')
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	return h % XT_HOST_BUCKETS;
+}
+
+/* Call with xt_hosts_lock held */
+static struct xt_host *xt_host_find(const char *name, int family)
+{
+	struct xt_host *h;
+
+	for (h = xt_hosts[xt_host_hash(name, family)]; h != NULL; h = h->next)
+		if (h->family == family && strcmp(h->name, name) == 0)
+			return h;
+	return NULL;
+}
+
+static int xt_host_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct in_addr));
+}
+
+static int xt_host_cmp6(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct in6_addr));
+}
+
+/* Resolve `name' and add it to the cache; safe to call from any thread */
+static struct xt_host *xt_host_resolve(const char *name, int family)
+{
+	size_t alen = xt_host_addrlen(family);
+	struct addrinfo hints, *res, *p;
+	struct xt_host *h, *old;
+	unsigned int i, j, n = 0;
+	char *addrs = NULL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = family;
+	hints.ai_socktype = SOCK_RAW;
+
+	if (getaddrinfo(name, NULL, &hints, &res) == 0) {
+		for (p = res; p != NULL; p = p->ai_next)
+			++n;
+		addrs = xtables_calloc(n, alen);
+		for (i = 0, p = res; p != NULL; p = p->ai_next, i++) {
+			if (family == AF_INET)
+				memcpy(addrs + i * alen, &((const struct
+				       sockaddr_in *)p->ai_addr)->sin_addr,
+				       alen);
+			else
+				memcpy(addrs + i * alen, &((const struct
+				       sockaddr_in6 *)p->ai_addr)->sin6_addr,
+				       alen);
+		}
+		freeaddrinfo(res);
+
+		qsort(addrs, n, alen,
+		      family == AF_INET ? xt_host_cmp : xt_host_cmp6);
+		/* drop duplicates */
+		for (i = 1, j = 1; i < n; i++)
+			if (memcmp(addrs + (j - 1) * alen, addrs + i * alen,
+				   alen) != 0)
+				memcpy(addrs + j++ * alen, addrs + i * alen,
+				       alen);
+		if (n > 0)
+			n = j;
+	}
+
+	h = xtables_malloc(sizeof(*h) + strlen(name) + 1);
+	h->family = family;
+	h->naddrs = n;
+	h->addrs  = addrs;
+	strcpy(h->name, name);
+
+	pthread_mutex_lock(&xt_hosts_lock);
+	old = xt_host_find(name, family);
+	if (old == NULL) {
+		h->next = xt_hosts[xt_host_hash(name, family)];
+		xt_hosts[xt_host_hash(name, family)] = h;
+	}
+	pthread_mutex_unlock(&xt_hosts_lock);
+
+	if (old != NULL) {
+		free(addrs);
+		free(h);
+		return old;
+	}
+	return h;
+}
+
+/* Addresses of `name', in a copy for the caller to free, or NULL */
+static void *xt_host_lookup(const char *name, int family, unsigned int *naddr)
+{
+	size_t alen = xt_host_addrlen(family);
+	struct xt_host *h;
+	void *addrs;
+
+	pthread_mutex_lock(&xt_hosts_lock);
+	h = xt_host_find(name, family);
+	pthread_mutex_unlock(&xt_hosts_lock);
+	if (h == NULL)
+		h = xt_host_resolve(name, family);
+
+	*naddr = h->naddrs;
+	if (h->naddrs == 0)
 		return NULL;
+	addrs = xtables_malloc(h->naddrs * alen);
+	memcpy(addrs, h->addrs, h->naddrs * alen);
+	return addrs;
+}
+
+struct xt_host_work {
+	const char *const *names;
+	unsigned int count;
+	unsigned int next;
+	int family;
+};
+
+static void *xt_host_worker(void *data)
+{
+	struct xt_host_work *w = data;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&w->next, 1)) < w->count)
+		xt_host_resolve(w->names[i], w->family);
+	return NULL;
+}
+
+/**
+ * xtables_host_prefetch - resolve host names ahead of time
+ * @names:	host names, without masks
+ * @count:	number of names
+ * @family:	AF_INET or AF_INET6
+ *
+ * Look up all of @names that are not in the cache yet, using a bounded
+ * number of threads, so that parsing the rules that use them later does
+ * not wait for the resolver one name at a time.  Failures are cached and
+ * reported when a rule uses the name, as before.
+ */
+void xtables_host_prefetch(const char *const *names, unsigned int count,
+			   int family)
+{
+	pthread_t threads[XT_HOST_WORKERS];
+	struct xt_host_work work = { .family = family };
+	const char **todo;
+	unsigned int i, n = 0, nthreads;
+
+	todo = xtables_calloc(count ? count : 1, sizeof(*todo));
+	pthread_mutex_lock(&xt_hosts_lock);
+	for (i = 0; i < count; i++)
+		if (xt_host_find(names[i], family) == NULL)
+			todo[n++] = names[i];
+	pthread_mutex_unlock(&xt_hosts_lock);
+
+	work.names = todo;
+	work.count = n;
+	nthreads = n < XT_HOST_WORKERS ? n : XT_HOST_WORKERS;
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, xt_host_worker,
+				   &work) != 0)
+			break;
+	nthreads = i;
+	/* Whatever no thread could be started for is done right here */
+	xt_host_worker(&work);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	free(todo);
+}
+
+/*
+ * Reverse lookups are memoized the same way, keyed by address, so that a
+ * listing asks the resolver about each address once.  The names handed
+ * out stay valid for the life of the process.  xtables_addr_prefetch()
+ * looks up the addresses a listing is about to print on several threads
+ * and gives up on any one of them after XT_ADDR_TIMEOUT milliseconds; such
+ * an address is then printed as if it had no name.
+ */
+#define XT_ADDR_TIMEOUT	2000
+
+struct xt_addr_name {
+	struct xt_addr_name *next;
+	int family;
+	struct in6_addr addr;	/* or a struct in_addr at its start */
+	char *name;		/* NULL if the address has none */
+};
+
+static struct xt_addr_name *xt_addr_names[XT_HOST_BUCKETS];
+
+static unsigned int xt_addr_hash(const void *addr, int family)
+{
+	const unsigned char *p = addr;
+	uint32_t h = 2166136261U ^ family;
+	size_t i;
+
+	for (i = 0; i < xt_host_addrlen(family); i++)
+		h = (h ^ p[i]) * 16777619U;
+	return h % XT_HOST_BUCKETS;
+}
+
+/* Call with xt_hosts_lock held */
+static struct xt_addr_name *xt_addr_find(const void *addr, int family)
+{
+	struct xt_addr_name *a;
+
+	for (a = xt_addr_names[xt_addr_hash(addr, family)]; a != NULL;
+	     a = a->next)
+		if (a->family == family &&
+		    memcmp(&a->addr, addr, xt_host_addrlen(family)) == 0)
+			return a;
+	return NULL;
+}
+
+/* Remember `name' for `addr' unless another thread was first; the name
+ * cached for `addr' is returned. */
+static const char *xt_addr_add(const void *addr, int family, char *name)
+{
+	struct xt_addr_name *a;
+
+	pthread_mutex_lock(&xt_hosts_lock);
+	a = xt_addr_find(addr, family);
+	if (a == NULL) {
+		a = xtables_calloc(1, sizeof(*a));
+		a->family = family;
+		memcpy(&a->addr, addr, xt_host_addrlen(family));
+		a->name = name;
+		a->next = xt_addr_names[xt_addr_hash(addr, family)];
+		xt_addr_names[xt_addr_hash(addr, family)] = a;
+		name = NULL;
+	}
+	pthread_mutex_unlock(&xt_hosts_lock);
+
+	free(name);
+	return a->name;
+}
+
+/* Ask the resolver for the name of `addr'; safe to call from any thread */
+static char *xt_addr_resolve(const void *addr, int family)
+{
+	char host[NI_MAXHOST];
+	union {
+		struct sockaddr_in in;
+		struct sockaddr_in6 in6;
+	} sa;
+	socklen_t len;
+	int flags = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	if (family == AF_INET) {
+		sa.in.sin_family = AF_INET;
+		memcpy(&sa.in.sin_addr, addr, sizeof(sa.in.sin_addr));
+		len = sizeof(sa.in);
+		/* IPv4 falls back to network names, not to the number */
+		flags = NI_NAMEREQD;
+	} else {
+		sa.in6.sin6_family = AF_INET6;
+		memcpy(&sa.in6.sin6_addr, addr, sizeof(sa.in6.sin6_addr));
+		len = sizeof(sa.in6);
+	}
+
+	if (getnameinfo((const void *)&sa, len, host, sizeof(host),
+			NULL, 0, flags) != 0)
+		return NULL;
+	return strdup(host);
+}
+
+static const char *xt_addr_to_host(const void *addr, int family)
+{
+	struct xt_addr_name *a;
+
+	pthread_mutex_lock(&xt_hosts_lock);
+	a = xt_addr_find(addr, family);
+	pthread_mutex_unlock(&xt_hosts_lock);
+	if (a != NULL)
+		return a->name;
+
+	return xt_addr_add(addr, family, xt_addr_resolve(addr, family));
+}
+
+enum {
+	XT_JOB_QUEUED = 0,
+	XT_JOB_RUNNING,
+	XT_JOB_DONE,
+	XT_JOB_ABANDONED,
+};
+
+struct xt_addr_job {
+	struct in6_addr addr;
+	struct timespec start;
+	int state;
+};
+
+/* Shared by xtables_addr_prefetch() and its workers; whoever leaves last
+ * frees it, as workers stuck in the resolver may outlive the call. */
+struct xt_addr_work {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct xt_addr_job *jobs;
+	unsigned int count, next, left, workers;
+	bool orphaned;
+	int family;
+};
+
+static void xt_addr_work_free(struct xt_addr_work *w)
+{
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	free(w->jobs);
+	free(w);
+}
+
+static void *xt_addr_worker(void *data)
+{
+	struct xt_addr_work *w = data;
+	struct xt_addr_job *job;
+	bool last;
+	char *name;
+
+	pthread_mutex_lock(&w->lock);
+	while (w->next < w->count) {
+		job = &w->jobs[w->next++];
+		job->state = XT_JOB_RUNNING;
+		clock_gettime(CLOCK_MONOTONIC, &job->start);
+		pthread_mutex_unlock(&w->lock);
+
+		name = xt_addr_resolve(&job->addr, w->family);
+
+		pthread_mutex_lock(&w->lock);
+		if (job->state == XT_JOB_ABANDONED) {
+			/* too late, and replaced by another worker */
+			free(name);
+			break;
+		}
+		xt_addr_add(&job->addr, w->family, name);
+		job->state = XT_JOB_DONE;
+		--w->left;
+		pthread_cond_signal(&w->cond);
+	}
+	last = --w->workers == 0 && w->orphaned;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	if (last)
+		xt_addr_work_free(w);
+	return NULL;
+}
+
+/* Call with w->lock held */
+static void xt_addr_spawn(struct xt_addr_work *w)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
 
-	return host->h_name;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, xt_addr_worker, w) == 0)
+		++w->workers;
+	pthread_attr_destroy(&attr);
+}
+
+/**
+ * xtables_addr_prefetch - look up the names of addresses ahead of time
+ * @addrs:	array of struct in_addr or struct in6_addr
+ * @count:	number of addresses
+ * @family:	AF_INET or AF_INET6
+ *
+ * Resolve all of @addrs that are not cached yet, a bounded number at a
+ * time, so that xtables_ipaddr_to_anyname() and
+ * xtables_ip6addr_to_anyname() find them in the cache.
+ */
+void xtables_addr_prefetch(const void *addrs, unsigned int count, int family)
+{
+	size_t alen = xt_host_addrlen(family);
+	struct xt_addr_work *w;
+	struct xt_addr_job *job;
+	pthread_condattr_t cattr;
+	struct timespec now, deadline;
+	unsigned int i, n = 0, oldest = 0;
+	char *sorted;
+
+	if (count == 0)
+		return;
+
+	sorted = xtables_malloc(count * alen);
+	memcpy(sorted, addrs, count * alen);
+	qsort(sorted, count, alen,
+	      family == AF_INET ? xt_host_cmp : xt_host_cmp6);
+
+	w = xtables_calloc(1, sizeof(*w));
+	w->jobs = xtables_calloc(count, sizeof(*w->jobs));
+	w->family = family;
+	pthread_mutex_lock(&xt_hosts_lock);
+	for (i = 0; i < count; i++) {
+		if (i > 0 && memcmp(sorted + (i - 1) * alen,
+				    sorted + i * alen, alen) == 0)
+			continue;
+		if (xt_addr_find(sorted + i * alen, family) == NULL)
+			memcpy(&w->jobs[n++].addr, sorted + i * alen, alen);
+	}
+	pthread_mutex_unlock(&xt_hosts_lock);
+	free(sorted);
+
+	w->count = w->left = n;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&w->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	pthread_mutex_lock(&w->lock);
+	for (i = 0; i < n && i < XT_HOST_WORKERS; i++)
+		xt_addr_spawn(w);
+
+	while (w->left > 0) {
+		if (w->workers == 0) {
+			/* no thread to be had, the rest is looked up later */
+			w->left -= w->count - w->next;
+			w->next = w->count;
+			break;
+		}
+
+		/* Jobs start in order, so the oldest running one expires
+		 * first */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		while (oldest < w->next) {
+			job = &w->jobs[oldest];
+			if (job->state != XT_JOB_RUNNING) {
+				oldest++;
+				continue;
+			}
+			deadline = job->start;
+			deadline.tv_sec  += XT_ADDR_TIMEOUT / 1000;
+			deadline.tv_nsec += XT_ADDR_TIMEOUT % 1000 * 1000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			if (now.tv_sec < deadline.tv_sec ||
+			    (now.tv_sec == deadline.tv_sec &&
+			     now.tv_nsec < deadline.tv_nsec))
+				break;
+
+			job->state = XT_JOB_ABANDONED;
+			xt_addr_add(&job->addr, family, NULL);
+			--w->left;
+			if (w->next < w->count)
+				xt_addr_spawn(w);
+			oldest++;
+		}
+		if (w->left == 0)
+			break;
+
+		if (oldest < w->next)
+			pthread_cond_timedwait(&w->cond, &w->lock, &deadline);
+		else
+			pthread_cond_wait(&w->cond, &w->lock);
+	}
+
+	w->orphaned = w->workers > 0;
+	pthread_mutex_unlock(&w->lock);
+	if (!w->orphaned)
+		xt_addr_work_free(w);
+}
+
+static const char *ipaddr_to_host(const struct in_addr *addr)
+{
+	return xt_addr_to_host(addr, AF_INET);
 }
 
 static const char *ipaddr_to_network(const struct in_addr *addr)
@@ -1243,14 +2092,23 @@ const char *xtables_ipmask_to_numeric(const struct in_addr *mask)
 	cidr = xtables_ipmask_to_cidr(mask);
 	if (cidr == (unsigned int)-1) {
 		/* mask was not a decent combination of 1's and 0's */
-		sprintf(buf, "/%s", xtables_ipaddr_to_numeric(mask));
+		buf[0] = '/';
+		xt_fmt_ipaddr(buf + 1, mask);
 		return buf;
 	} else if (cidr == 32) {
 		/* we don't want to see "/32" */
 		return "";
 	}
 
-	sprintf(buf, "/%d", cidr);
+	buf[0] = '/';
+	if (cidr >= 10) {
+		buf[1] = '0' + cidr / 10;
+		buf[2] = '0' + cidr % 10;
+		buf[3] = '\0';
+	} else {
+		buf[1] = '0' + cidr;
+		buf[2] = '\0';
+	}
 	return buf;
 }
 
@@ -1327,26 +2185,7 @@ static struct in_addr *network_to_ipaddr(const char *name)
 
 static struct in_addr *host_to_ipaddr(const char *name, unsigned int *naddr)
 {
-	struct hostent *host;
-	struct in_addr *addr;
-	unsigned int i;
-
-	*naddr = 0;
-	if ((host = gethostbyname(name)) != NULL) {
-		if (host->h_addrtype != AF_INET ||
-		    host->h_length != sizeof(struct in_addr))
-			return NULL;
-
-		while (host->h_addr_list[*naddr] != NULL)
-			++*naddr;
-		addr = xtables_calloc(*naddr, sizeof(struct in_addr));
-		for (i = 0; i < *naddr; i++)
-			memcpy(&addr[i], host->h_addr_list[i],
-			       sizeof(struct in_addr));
-		return addr;
-	}
-
-	return NULL;
+	return xt_host_lookup(name, AF_INET, naddr);
 }
 
 static struct in_addr *
@@ -1528,27 +2367,7 @@ const char *xtables_ip6addr_to_numeric(const struct in6_addr *addrp)
 
 static const char *ip6addr_to_host(const struct in6_addr *addr)
 {
-	static char hostname[NI_MAXHOST];
-	struct sockaddr_in6 saddr;
-	int err;
-
-	memset(&saddr, 0, sizeof(struct sockaddr_in6));
-	memcpy(&saddr.sin6_addr, addr, sizeof(*addr));
-	saddr.sin6_family = AF_INET6;
-
-	err = getnameinfo((const void *)&saddr, sizeof(struct sockaddr_in6),
-	      hostname, sizeof(hostname) - 1, NULL, 0, 0);
-	if (err != 0) {
-#ifdef DEBUG
-		fprintf(stderr,"IP2Name: %s\n",gai_strerror(err));
-#endif
-		return NULL;
-	}
-
-#ifdef DEBUG
-	fprintf (stderr, "\naddr2host: %s\n", hostname);
-#endif
-	return hostname;
+	return xt_addr_to_host(addr, AF_INET6);
 }
 
 const char *xtables_ip6addr_to_anyname(const struct in6_addr *addr)
@@ -1619,42 +2438,7 @@ struct in6_addr *xtables_numeric_to_ip6addr(const char *num)
 static struct in6_addr *
 host_to_ip6addr(const char *name, unsigned int *naddr)
 {
-	struct in6_addr *addr;
-	struct addrinfo hints;
-	struct addrinfo *res, *p;
-	int err;
-	unsigned int i;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_flags    = AI_CANONNAME;
-	hints.ai_family   = AF_INET6;
-	hints.ai_socktype = SOCK_RAW;
-
-	*naddr = 0;
-	if ((err = getaddrinfo(name, NULL, &hints, &res)) != 0) {
-#ifdef DEBUG
-		fprintf(stderr,"Name2IP: %s\n",gai_strerror(err));
-#endif
-		return NULL;
-	} else {
-		/* Find length of address chain */
-		for (p = res; p != NULL; p = p->ai_next)
-			++*naddr;
-#ifdef DEBUG
-		fprintf(stderr, "resolved: len=%d  %s ", res->ai_addrlen,
-		        xtables_ip6addr_to_numeric(&((struct sockaddr_in6 *)res->ai_addr)->sin6_addr));
-#endif
-		/* Copy each element of the address chain */
-		addr = xtables_calloc(*naddr, sizeof(struct in6_addr));
-		for (i = 0, p = res; p != NULL; p = p->ai_next)
-			memcpy(&addr[i++],
-			       &((const struct sockaddr_in6 *)p->ai_addr)->sin6_addr,
-			       sizeof(struct in6_addr));
-		freeaddrinfo(res);
-		return addr;
-	}
-
-	return NULL;
+	return xt_host_lookup(name, AF_INET6, naddr);
 }
 
 static struct in6_addr *network_to_ip6addr(const char *name)
@@ -1849,7 +2633,7 @@ void xtables_save_string(const char *value)
 		   value, which we have to quote.  Write double quotes
 		   around the value and escape special characters with
 		   a backslash */
-		printf(" \"");
+		fputs(" \"", stdout);
 
 		for (p = strpbrk(value, escape_chars); p != NULL;
 		     p = strpbrk(value, escape_chars)) {
@@ -1914,33 +2698,66 @@ xtables_parse_protocol(const char *s)
 	return -1;
 }
 
+void xtables_print_u64(uint64_t number)
+{
+	char buf[24], *end = buf + sizeof(buf);
+	char *p = xt_fmt_uint(end, number);
+
+	fwrite(p, 1, end - p, stdout);
+}
+
+void xtables_print_field(const char *value, unsigned int width)
+{
+	static const char spaces[] = "                    ";
+	size_t len = strlen(value);
+
+	fwrite(value, 1, len, stdout);
+	while (len < width) {
+		size_t n = width - len;
+
+		if (n > sizeof(spaces) - 1)
+			n = sizeof(spaces) - 1;
+		fwrite(spaces, 1, n, stdout);
+		len += n;
+	}
+}
+
+/* Print @number right-aligned in @width columns and a unit suffix */
+static void xt_print_scaled(uint64_t number, unsigned int width, char unit)
+{
+	char buf[32], *end = buf + sizeof(buf);
+	char *p;
+
+	*--end = ' ';
+	if (unit != '\0')
+		*--end = unit;
+	p = xt_fmt_uint(end, number);
+	while (buf + sizeof(buf) - p < width + 1 + (unit != '\0'))
+		*--p = ' ';
+	fwrite(p, 1, buf + sizeof(buf) - p, stdout);
+}
+
 void xtables_print_num(uint64_t number, unsigned int format)
 {
+	static const char units[] = "KMGT";
+	unsigned int i;
+
 	if (!(format & FMT_KILOMEGAGIGA)) {
-		printf(FMT("%8llu ","%llu "), (unsigned long long)number);
+		xt_print_scaled(number, FMT(8, 0), '\0');
 		return;
 	}
 	if (number <= 99999) {
-		printf(FMT("%5llu ","%llu "), (unsigned long long)number);
-		return;
-	}
-	number = (number + 500) / 1000;
-	if (number <= 9999) {
-		printf(FMT("%4lluK ","%lluK "), (unsigned long long)number);
-		return;
-	}
-	number = (number + 500) / 1000;
-	if (number <= 9999) {
-		printf(FMT("%4lluM ","%lluM "), (unsigned long long)number);
+		xt_print_scaled(number, FMT(5, 0), '\0');
 		return;
 	}
-	number = (number + 500) / 1000;
-	if (number <= 9999) {
-		printf(FMT("%4lluG ","%lluG "), (unsigned long long)number);
-		return;
+	for (i = 0; i < sizeof(units) - 2; ++i) {
+		number = (number + 500) / 1000;
+		if (number <= 9999)
+			break;
 	}
-	number = (number + 500) / 1000;
-	printf(FMT("%4lluT ","%lluT "), (unsigned long long)number);
+	if (i == sizeof(units) - 2)
+		number = (number + 500) / 1000;
+	xt_print_scaled(number, FMT(4, 0), units[i]);
 }
 
 int kernel_version;